@@ -0,0 +1,278 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <algorithm>
+#include <iostream>
+
+#include <core/binding_automaton.hpp>
+
+/* constants */
+constexpr auto MAX_TIMEOUT =	INT16_MAX;
+
+/*
+ * Replayed symbols always end up in a start state, which never replays, so a
+ * step takes at most two transitions.
+ */
+int BindingAutomaton::step(int profile, int symbol, struct BindingAction *actions, int *timeout) {
+	int count = 0;
+	*timeout = -1;
+
+	if (profile != profile_) {
+		profile_ = profile;
+		state_ = isBound(profile) ? starts_[profile] : AUTOMATON_NO_STATE;
+		*timeout = 0;
+	}
+
+	if (state_ == AUTOMATON_NO_STATE || symbol < 0 || symbol >= AUTOMATON_SYMBOLS) {
+		return 0;
+	}
+
+	for (int i = 0; i < MAX_BINDING_ACTIONS; i++) {
+		const Transition &transition = table_[state_ * AUTOMATON_SYMBOLS + symbol];
+		state_ = transition.next;
+
+		if (transition.macro) {
+			actions[count].macro = transition.macro;
+			actions[count].key = transition.key;
+			count++;
+		}
+
+		if (transition.timeout >= 0) {
+			*timeout = transition.timeout;
+		}
+
+		if (!transition.isReplay) {
+			break;
+		}
+	}
+
+	return count;
+}
+
+bool BindingAutomaton::isBound(int profile) const {
+	return profile >= 0 && profile < static_cast<int>(starts_.size()) && starts_[profile] != AUTOMATON_NO_STATE;
+}
+
+int BindingAutomaton::getPress(int key) {
+	return key - 1;
+}
+
+int BindingAutomaton::getRelease(int key) {
+	return MAX_MACRO_KEYS + key - 1;
+}
+
+int BindingAutomaton::getTimeout() {
+	return 2 * MAX_MACRO_KEYS;
+}
+
+/*
+ * Rules for all profiles are compiled before rules for a single profile, so
+ * the latter take precedence.
+ */
+BindingAutomaton::BindingAutomaton(int profiles, const std::vector<BindingRule> &rules, int tapTimeout, int sequenceTimeout) {
+	profile_ = -1;
+	state_ = AUTOMATON_NO_STATE;
+	tapTimeout_ = std::min(std::max(tapTimeout, 1), MAX_TIMEOUT);
+	sequenceTimeout_ = std::min(std::max(sequenceTimeout, 1), MAX_TIMEOUT);
+	starts_.resize(std::max(profiles, 1), AUTOMATON_NO_STATE);
+	std::vector<BindingRule> valid;
+
+	for (auto &rule : rules) {
+		if (isValid(rule, starts_.size())) {
+			valid.push_back(rule);
+		} else {
+			std::cerr << "Ignoring binding for key " << rule.key << ", which is out of range." << std::endl;
+		}
+	}
+
+	std::stable_sort(valid.begin(), valid.end(),
+		[](const BindingRule &a, const BindingRule &b) { return a.profile < b.profile; });
+
+	for (std::size_t profile = 0; profile < starts_.size(); profile++) {
+		std::vector<BindingRule> sequences;
+		int idle = -1;
+
+		for (auto &rule : valid) {
+			if (rule.profile >= 0 && rule.profile != static_cast<int>(profile)) {
+				continue;
+			}
+
+			if (idle < 0) {
+				idle = addState();
+				starts_[profile] = idle;
+
+				for (int key = 1; key <= MAX_MACRO_KEYS; key++) {
+					set(idle, getPress(key), idle, key, key, -1);
+				}
+			}
+
+			if (rule.sequence.empty()) {
+				addTap(idle, rule);
+			} else {
+				sequences.push_back(rule);
+			}
+		}
+
+		if (!sequences.empty()) {
+			addSequences(idle, sequences);
+		}
+	}
+
+	if (table_.size() / AUTOMATON_SYMBOLS >= AUTOMATON_NO_STATE) {
+		std::cerr << "Too many bindings, ignoring all of them." << std::endl;
+		std::fill(starts_.begin(), starts_.end(), AUTOMATON_NO_STATE);
+		table_.clear();
+	}
+}
+
+/*
+ * New states stay in themselves and keep the timer on every symbol.
+ */
+int BindingAutomaton::addState() {
+	int state = table_.size() / AUTOMATON_SYMBOLS;
+	Transition stay = Transition();
+	stay.next = state;
+	stay.timeout = -1;
+	table_.resize(table_.size() + AUTOMATON_SYMBOLS, stay);
+
+	return state;
+}
+
+void BindingAutomaton::set(int state, int symbol, int next, int macro, int key, int timeout, bool isReplay) {
+	Transition &transition = table_[state * AUTOMATON_SYMBOLS + symbol];
+	transition.next = next;
+	transition.macro = macro;
+	transition.key = key;
+	transition.timeout = timeout;
+	transition.isReplay = isReplay;
+}
+
+/*
+ * Keys with a hold binding wait for the tap timeout while pressed, keys with a
+ * double tap binding wait for it after being released. Pressing another key
+ * resolves the pending binding and replays the press in the start state.
+ */
+void BindingAutomaton::addTap(int idle, const BindingRule &rule) {
+	int key = rule.key;
+	int tap = rule.tap ? rule.tap : key;
+
+	if (!rule.hold && !rule.doubleTap) {
+		set(idle, getPress(key), idle, tap, key, -1);
+
+		return;
+	}
+
+	int pressed = addState();
+	set(idle, getPress(key), pressed, 0, 0, rule.hold ? tapTimeout_ : 0);
+
+	for (int other = 1; other <= MAX_MACRO_KEYS; other++) {
+		set(pressed, getPress(other), idle, rule.hold ? rule.hold : tap, key, 0, true);
+	}
+
+	set(pressed, getTimeout(), idle, rule.hold, key, 0);
+
+	if (!rule.doubleTap) {
+		set(pressed, getRelease(key), idle, tap, key, 0);
+
+		return;
+	}
+
+	int released = addState();
+	set(pressed, getRelease(key), released, 0, 0, tapTimeout_);
+
+	for (int other = 1; other <= MAX_MACRO_KEYS; other++) {
+		set(released, getPress(other), idle, tap, key, 0, true);
+	}
+
+	set(released, getPress(key), idle, rule.doubleTap, key, 0);
+	set(released, getTimeout(), idle, tap, key, 0);
+}
+
+/*
+ * Sequences of all leader keys are merged into a trie first, which is turned
+ * into states afterwards.
+ */
+void BindingAutomaton::addSequences(int idle, const std::vector<BindingRule> &rules) {
+	std::vector<SequenceNode> nodes;
+	std::map<int, int> leaders;
+
+	for (auto &rule : rules) {
+		if (!leaders.count(rule.key)) {
+			leaders[rule.key] = nodes.size();
+			nodes.push_back(SequenceNode());
+			nodes.back().macro = 0;
+			nodes.back().key = rule.key;
+		}
+
+		int node = leaders[rule.key];
+
+		for (auto key : rule.sequence) {
+			auto it = nodes[node].children.find(key);
+
+			if (it == nodes[node].children.end()) {
+				nodes[node].children[key] = nodes.size();
+				nodes.push_back(SequenceNode());
+				nodes.back().macro = 0;
+				nodes.back().key = key;
+			}
+
+			node = nodes[node].children[key];
+		}
+
+		nodes[node].macro = rule.macro;
+	}
+
+	for (auto &leader : leaders) {
+		Transition enter = enterNode(nodes, leader.second, idle);
+		set(idle, getPress(leader.first), enter.next, enter.macro, enter.key, enter.timeout);
+	}
+}
+
+/*
+ * Returns the transition into a trie node. Leaves run their macro right away.
+ * Inner nodes wait for the next key, a timeout or a key, which doesn't continue
+ * any sequence, runs the macro of the node, if there is one.
+ */
+BindingAutomaton::Transition BindingAutomaton::enterNode(const std::vector<SequenceNode> &nodes, int node, int idle) {
+	Transition enter = Transition();
+	enter.next = idle;
+	enter.macro = nodes[node].macro;
+	enter.key = nodes[node].key;
+
+	if (nodes[node].children.empty()) {
+		return enter;
+	}
+
+	int state = addState();
+
+	for (int key = 1; key <= MAX_MACRO_KEYS; key++) {
+		set(state, getPress(key), idle, nodes[node].macro, nodes[node].key, 0, nodes[node].macro != 0);
+	}
+
+	set(state, getTimeout(), idle, nodes[node].macro, nodes[node].key, 0);
+
+	for (auto &child : nodes[node].children) {
+		Transition next = enterNode(nodes, child.second, idle);
+		set(state, getPress(child.first), next.next, next.macro, next.key, next.timeout);
+	}
+
+	enter.next = state;
+	enter.macro = 0;
+	enter.key = 0;
+	enter.timeout = sequenceTimeout_;
+
+	return enter;
+}
+
+bool BindingAutomaton::isValid(const BindingRule &rule, int profiles) {
+	auto isKey = [](int key) { return key >= 1 && key <= MAX_MACRO_KEYS; };
+	auto isMacro = [&](int key) { return !key || isKey(key); };
+
+	return rule.profile < profiles && isKey(rule.key) && isMacro(rule.tap) && isMacro(rule.hold)
+			&& isMacro(rule.doubleTap) && isMacro(rule.macro)
+			&& std::all_of(rule.sequence.begin(), rule.sequence.end(), isKey);
+}
@@ -0,0 +1,95 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef BINDING_AUTOMATON_CLASS_H
+#define BINDING_AUTOMATON_CLASS_H
+
+#include <cstdint>
+#include <map>
+#include <vector>
+
+#include <core/key.hpp>
+#include <core/settings.hpp>
+
+/* constants */
+const int AUTOMATON_SYMBOLS = 2 * MAX_MACRO_KEYS + 1;
+const int MAX_BINDING_ACTIONS = 2;
+const uint16_t AUTOMATON_NO_STATE = UINT16_MAX;
+
+/**
+ * Struct describing a macro to run after a step.
+ *
+ * @var macro macro key index of the macro to run
+ * @var key macro key, which triggered the macro
+ */
+struct BindingAction {
+	int macro;
+	int key;
+};
+
+/**
+ * Class representing the deterministic finite automaton, which resolves tap,
+ * hold, double tap and leader key sequence bindings of macro keys.
+ *
+ * Bindings are compiled into a flat transition table, with one row per state
+ * and one column per symbol, i.e. pressing or releasing a macro key or the
+ * timer expiring. Every profile with bindings has its own start state, in
+ * which keys without bindings run their macro on press right away. Keys with
+ * a hold binding resolve to hold, when another key is pressed in the meantime.
+ * Leader keys can't have tap bindings.
+ */
+class BindingAutomaton {
+	public:
+		/**
+		 * Feeds a symbol to the automaton. Switching profiles resets it.
+		 * @param actions receives up to MAX_BINDING_ACTIONS macros to run
+		 * @param timeout receives the timer to arm in milliseconds, 0 for
+		 * disarming it and -1 for keeping it
+		 * @return number of actions
+		 */
+		int step(int profile, int symbol, struct BindingAction *actions, int *timeout);
+
+		/**
+		 * Returns true, if a profile has bindings. Macro keys of other
+		 * profiles don't need to go through the automaton.
+		 */
+		bool isBound(int profile) const;
+		static int getPress(int key);
+		static int getRelease(int key);
+		static int getTimeout();
+		BindingAutomaton(int profiles, const std::vector<BindingRule> &rules, int tapTimeout, int sequenceTimeout);
+
+	private:
+		struct Transition {
+			uint16_t next;
+			uint8_t macro; /**< macro key to run or 0 */
+			uint8_t key;
+			int16_t timeout; /**< see step() */
+			bool isReplay; /**< the symbol is fed again in the next state */
+		};
+
+		struct SequenceNode {
+			int macro;
+			int key;
+			std::map<int, int> children;
+		};
+
+		int profile_;
+		int state_;
+		int tapTimeout_;
+		int sequenceTimeout_;
+		std::vector<uint16_t> starts_;
+		std::vector<Transition> table_;
+		int addState();
+		void set(int state, int symbol, int next, int macro, int key, int timeout, bool isReplay = false);
+		void addTap(int idle, const BindingRule &rule);
+		void addSequences(int idle, const std::vector<BindingRule> &rules);
+		Transition enterNode(const std::vector<SequenceNode> &nodes, int node, int idle);
+		static bool isValid(const BindingRule &rule, int profiles);
+};
+
+#endif
@@ -5,9 +5,13 @@
  * MIT License. For more information, see LICENSE file.
  */
 
+#include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <iostream>
 
+#include <unistd.h>
+
 #include <core/device_manager.hpp>
 #include <vendor/logitech/g105.hpp>
 #include <vendor/logitech/g710.hpp>
@@ -15,49 +19,104 @@
 
 constexpr auto VENDOR_MICROSOFT =	"045e";
 constexpr auto VENDOR_LOGITECH =	"046d";
-constexpr auto TIMEOUT =		5000;
-constexpr auto NUM_POLL =		1;
+constexpr auto NUM_POLL =		5;
+constexpr auto STATE_FILE =		"state.bin";
 
+/*
+ * A shared virtual input device is created along with the first keyboards, so
+ * it advertises all of their keys. Keyboards added later can only send keys,
+ * it advertises already.
+ */
 void DeviceManager::discover() {
-	for (auto it : devices_) {
-		struct Device device = it;
-		struct sidewinderd::DevNode devNode;
+	auto start = Stats::Clock::now();
+	auto found = probe();
+	Stats::addTiming("startup.probe", Stats::Clock::now() - start);
+	std::vector<std::pair<std::string, Keyboard *>> added;
+
+	for (auto &it : found) {
+		struct Device device = it.second.first;
+		struct sidewinderd::DevNode devNode = it.second.second;
+
+		// TODO use a unique identifier
+		// skip this loop, if device is already connected
+		if (connected_.find(device.product) != connected_.end()) {
+			continue;
+		}
 
-		if (probe(&device, &devNode) > 0) {
-			// TODO use a unique identifier
-			auto it = connected_.find(device.product);
+		// resume a recently disconnected device with its runtime state
+		auto parked = parked_.find(device.product);
 
-			// skip this loop, if device is already connected
-			if (it != connected_.end()) {
-				continue;
+		if (parked != parked_.end()) {
+			// stays parked, if its hidraw node isn't accessible yet
+			if (parked->second.keyboard->reconnect(&devNode)) {
+				connected_[device.product] = std::move(parked->second.keyboard);
+				parked_.erase(parked);
 			}
 
-			switch (device.driver) {
-				case Device::Driver::LogitechG105: {
-					auto keyboard = new LogitechG105(&device, &devNode, config_, process_);
-					keyboard->connect();
-					connected_[device.product] = std::unique_ptr<Keyboard>(keyboard);
-					break;
-				}
-				case Device::Driver::LogitechG710: {
-					auto keyboard = new LogitechG710(&device, &devNode, config_, process_);
-					keyboard->connect();
-					connected_[device.product] = std::unique_ptr<Keyboard>(keyboard);
-					break;
-				}
-				case Device::Driver::SideWinder: {
-					auto keyboard = new SideWinder(&device, &devNode, config_, process_);
-					keyboard->connect();
-					connected_[device.product] = std::unique_ptr<Keyboard>(keyboard);
-					break;
-				}
-			}
+			continue;
+		}
+
+		Keyboard *keyboard = nullptr;
+
+		switch (device.driver) {
+			case Device::Driver::LogitechG105:
+				keyboard = new LogitechG105(&device, &devNode, settings_, process_);
+				break;
+			case Device::Driver::LogitechG710:
+				keyboard = new LogitechG710(&device, &devNode, settings_, process_);
+				break;
+			case Device::Driver::SideWinder:
+				keyboard = new SideWinder(&device, &devNode, settings_, process_);
+				break;
 		}
+
+		added.push_back(std::make_pair(device.product, keyboard));
+	}
+
+	if (settings_->get()->isUinputShared && sharedDevice_ < 0) {
+		start = Stats::Clock::now();
+		KeyBitmap keys = DEFAULT_KEYS;
+		bool hasMotion = false;
+
+		for (auto &it : added) {
+			it.second->setBundle(bundle_);
+			keys |= it.second->getOutputKeys(true, &hasMotion);
+		}
+
+		sharedDevice_ = output_.addDevice(nullptr, keys, hasMotion);
+		Stats::addTiming("startup.uinput", Stats::Clock::now() - start);
+	}
+
+	for (auto &it : added) {
+		Keyboard *keyboard = it.second;
+
+		// profiles are read from the bundle, so it's set before warming
+		keyboard->setBundle(bundle_);
+		keyboard->warmProfiles(policy_.getTargets());
+		keyboard->setOutput(&output_, sharedDevice_);
+		keyboard->setState(state_.getSlot(it.first, keyboard->getDevNode().serial));
+		keyboard->setSharedLayers(&layers_);
+
+		keyboard->connect();
+		connected_[it.first] = std::unique_ptr<Keyboard>(keyboard);
+	}
+}
+
+void DeviceManager::switchProfile() {
+	int profile = policy_.receive();
+
+	if (profile < 0) {
+		return;
+	}
+
+	for (auto &it : connected_) {
+		it.second->requestProfile(profile);
 	}
 }
 
 int DeviceManager::monitor() {
 	// create udev object
+	auto start = Stats::Clock::now();
 	udev_ = udev_new();
 
 	if (!udev_) {
@@ -76,17 +135,84 @@ int DeviceManager::monitor() {
 	fd_ = udev_monitor_get_fd(monitor_);
 
 	// setup poll
-	pfd_.fd = fd_;
-	pfd_.events = POLLIN;
+	pfds_[0].fd = fd_;
+	pfds_[0].events = POLLIN;
+
+	// set up focus-event socket for per-application profiles
+	const Settings *settings = settings_->get();
+	policy_.loadRules(settings);
+	pfds_[1].fd = policy_.open(settings->focusSocket);
+	pfds_[1].events = POLLIN;
+
+	// signals wake up the loop, so it doesn't need a timeout
+	pfds_[2].fd = Process::getWakeFd();
+	pfds_[2].events = POLLIN;
+
+	// pending encrypted working directory, negative fds are ignored by poll()
+	pfds_[3].fd = process_->getWorkdirWatch()->getFd();
+	pfds_[3].events = POLLIN;
+	pfds_[4].fd = process_->getWorkdirWatch()->getMountFd();
+	pfds_[4].events = POLLPRI;
+
+	Stats::addTiming("startup.udev", Stats::Clock::now() - start);
+
+	output_.start();
+
+	// the state file and the profile bundle live in the working directory
+	if (process_->isWorkdirReady()) {
+		state_.open(STATE_FILE);
+		openBundle();
+	}
 
 	// initial discovery of new devices
 	discover();
+	lockMemory();
 
 	struct udev_device *dev;
 
 	// run monitoring loop, until we receive a signal
 	while (process_->isActive()) {
-		poll(&pfd_, NUM_POLL, TIMEOUT);
+		int ret = poll(pfds_, NUM_POLL, expire());
+
+		if (!ret) {
+			Stats::increment(Counter::WakeupExpiry);
+		} else if (ret < 0) {
+			Stats::increment(Counter::WakeupSpurious);
+		}
+
+		if (pfds_[2].revents & POLLIN) {
+			uint64_t wake;
+			read(pfds_[2].fd, &wake, sizeof(wake));
+			Stats::increment(Counter::WakeupSignal);
+			recover();
+			lockMemory();
+		}
+
+		if (process_->isStatsRequested()) {
+			process_->setStatsRequested(false);
+			Stats::dump();
+		}
+
+		if (process_->isReloadRequested()) {
+			process_->setReloadRequested(false);
+			reload();
+		}
+
+		if (pfds_[1].revents & POLLIN) {
+			Stats::increment(Counter::WakeupFocus);
+			switchProfile();
+		}
+
+		if ((pfds_[3].revents & POLLIN) || (pfds_[4].revents & POLLPRI)) {
+			Stats::increment(Counter::WakeupWorkdir);
+			attachProfiles();
+		}
+
+		if (!(pfds_[0].revents & POLLIN)) {
+			continue;
+		}
+
+		Stats::increment(Counter::WakeupUdev);
 		dev = udev_monitor_receive_device(monitor_);
 
 		if (dev) {
@@ -100,6 +226,7 @@ int DeviceManager::monitor() {
 					discover();
 				} else if (action == "remove") {
 					// check for disconnected devices
+					remove(udev_device_get_devnode(dev));
 					unbind();
 				}
 			}
@@ -110,15 +237,111 @@ int DeviceManager::monitor() {
 
 	udev_monitor_unref(monitor_);
 	udev_unref(udev_);
+	udev_ = nullptr;
+	output_.stop();
+	Stats::dump();
 
 	return 0;
 }
 
-int DeviceManager::probe(struct Device *device, struct sidewinderd::DevNode *devNode) {
-	struct udev_device *dev;
+/*
+ * Attaches the profiles of all connected devices, once the working directory
+ * has become available.
+ */
+void DeviceManager::attachProfiles() {
+	if (!process_->updateWorkdir()) {
+		return;
+	}
+
+	pfds_[3].fd = -1;
+	pfds_[4].fd = -1;
+	std::clog << "Working directory is available, attaching profiles." << std::endl;
+	state_.open(STATE_FILE);
+	openBundle();
+
+	for (auto &it : connected_) {
+		it.second->attachProfiles();
+		it.second->attachState(state_.getSlot(it.first, it.second->getDevNode().serial));
+	}
+
+	for (auto &it : parked_) {
+		it.second.keyboard->attachProfiles();
+		it.second.keyboard->attachState(state_.getSlot(it.first, it.second.keyboard->getDevNode().serial));
+	}
+}
+
+/*
+ * Publishes a new settings snapshot. Devices pick up most settings, e.g.
+ * capture_delays, on their next use. Profile counts, the output setup and the
+ * real-time mode only apply to devices connected afterwards or after a
+ * restart. A replaced profile bundle is swapped in and all macros are read
+ * again.
+ */
+void DeviceManager::reload() {
+	if (settings_->reload()) {
+		policy_.loadRules(settings_->get());
+		std::clog << "Reloaded configuration." << std::endl;
+	}
+
+	if (!process_->isWorkdirReady()) {
+		return;
+	}
+
+	openBundle();
+
+	// pick up macro files, which have been added or edited by hand
+	for (auto &it : connected_) {
+		it.second->rescanProfiles();
+	}
+
+	for (auto &it : parked_) {
+		it.second.keyboard->rescanProfiles();
+	}
+}
+
+/*
+ * Bundles are replaced by renaming a new file over the old one. The old
+ * mapping is released, once no keyboard uses it anymore.
+ */
+void DeviceManager::openBundle() {
+	if (bundle_ ? bundle_->isCurrent(BUNDLE_FILE) : access(BUNDLE_FILE, F_OK)) {
+		return;
+	}
+
+	auto start = Stats::Clock::now();
+	std::shared_ptr<ProfileBundle> bundle = std::make_shared<ProfileBundle>();
+
+	if (!bundle->open(BUNDLE_FILE)) {
+		bundle.reset();
+	}
+
+	/* a broken bundle doesn't replace a working one */
+	if (!bundle && (!bundle_ || !access(BUNDLE_FILE, F_OK))) {
+		return;
+	}
+
+	bundle_ = bundle;
+	std::clog << (bundle_ ? "Using profile bundle." : "Using profile directories.") << std::endl;
+
+	for (auto &it : connected_) {
+		it.second->setBundle(bundle_);
+	}
+
+	for (auto &it : parked_) {
+		it.second.keyboard->setBundle(bundle_);
+	}
+
+	Stats::addTiming("bundle.load", Stats::Clock::now() - start);
+}
+
+/*
+ * Enumerates hidraw and input devices once and matches them against all
+ * supported devices, instead of running a full enumeration per device.
+ */
+std::map<std::string, std::pair<Device, sidewinderd::DevNode>> DeviceManager::probe() {
 	struct udev_enumerate *enumerate;
 	struct udev_list_entry *devices, *entry;
-	bool isFound = false;
+	std::map<std::string, std::pair<Device, sidewinderd::DevNode>> candidates, found;
 
 	// create a list of devices in hidraw and input subsystems
 	enumerate = udev_enumerate_new(udev_);
@@ -128,50 +351,52 @@ int DeviceManager::probe(struct Device *device, struct sidewinderd::DevNode *dev
 	devices = udev_enumerate_get_list_entry(enumerate);
 
 	udev_list_entry_foreach(entry, devices) {
-		const char *sysPath, *devNodePath;
-		sysPath = udev_list_entry_get_name(entry);
-		dev = udev_device_new_from_syspath(udev_, sysPath);
-		auto hidraw = udev_device_get_subsystem(dev);
+		const char *sysPath = udev_list_entry_get_name(entry);
+		struct udev_device *dev = udev_device_new_from_syspath(udev_, sysPath);
+		auto subsystem = udev_device_get_subsystem(dev);
 
 		// evaluation from left to right; used to filter out nullptr
-		if (hidraw && std::string(hidraw) == std::string("hidraw")) {
-			devNodePath = udev_device_get_devnode(dev);
-			dev = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_interface");
+		if (subsystem && std::string(subsystem) == std::string("hidraw")) {
+			auto devNodePath = udev_device_get_devnode(dev);
+			auto parent = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_interface");
 
-			if (!dev) {
+			if (!parent) {
 				std::cerr << "Unable to find parent device." << std::endl;
+				udev_device_unref(dev);
+				continue;
 			}
 
-			auto bInterfaceNumber = udev_device_get_sysattr_value(dev, "bInterfaceNumber");
+			auto bInterfaceNumber = udev_device_get_sysattr_value(parent, "bInterfaceNumber");
 
 			if (bInterfaceNumber && std::string(bInterfaceNumber) == std::string("01")) {
-				dev = udev_device_get_parent_with_subsystem_devtype(dev, "usb", "usb_device");
-				auto idVendor = udev_device_get_sysattr_value(dev, "idVendor");
-				auto idProduct = udev_device_get_sysattr_value(dev, "idProduct");
-
-				if (idVendor && std::string(idVendor) == device->vendor
-					&& idProduct && std::string(idProduct) == device->product) {
-						devNode->hidraw = devNodePath;
+				parent = udev_device_get_parent_with_subsystem_devtype(parent, "usb", "usb_device");
+				auto idVendor = udev_device_get_sysattr_value(parent, "idVendor");
+				auto idProduct = udev_device_get_sysattr_value(parent, "idProduct");
+				auto device = findDevice(idVendor, idProduct);
+
+				if (device) {
+					candidates[device->product].first = *device;
+					candidates[device->product].second.hidraw = devNodePath;
 				}
 			}
-		}
-
-		auto input = udev_device_get_subsystem(dev);
-		auto product = udev_device_get_property_value(dev, "ID_MODEL_ID");
-		auto vendor = udev_device_get_property_value(dev, "ID_VENDOR_ID");
-		auto interface = udev_device_get_property_value(dev, "ID_USB_INTERFACE_NUM");
-
-		/* find correct /dev/input/event* file */
-		if (input && std::string(input) == std::string("input")
-			&& product && std::string(product) == device->product
-			&& vendor && std::string(vendor) == device->vendor
-			&& interface && std::string(interface) == "00"
-			&& udev_device_get_property_value(dev, "ID_INPUT_KEYBOARD")
-			&& strstr(sysPath, "event")
-			&& udev_device_get_parent_with_subsystem_devtype(dev, "usb", NULL)) {
-				devNode->inputEvent = udev_device_get_devnode(dev);
-				std::clog << "Found device: " << device->vendor << ":" << device->product << std::endl;
-				isFound = true;
+		} else if (subsystem && std::string(subsystem) == std::string("input")) {
+			auto product = udev_device_get_property_value(dev, "ID_MODEL_ID");
+			auto vendor = udev_device_get_property_value(dev, "ID_VENDOR_ID");
+			auto interface = udev_device_get_property_value(dev, "ID_USB_INTERFACE_NUM");
+			auto device = findDevice(vendor, product);
+
+			/* find correct /dev/input/event* file */
+			if (device
+				&& interface && std::string(interface) == "00"
+				&& udev_device_get_property_value(dev, "ID_INPUT_KEYBOARD")
+				&& strstr(sysPath, "event")
+				&& udev_device_get_parent_with_subsystem_devtype(dev, "usb", NULL)) {
+					auto serial = udev_device_get_property_value(dev, "ID_SERIAL_SHORT");
+					auto path = udev_device_get_property_value(dev, "ID_PATH");
+					candidates[device->product].first = *device;
+					candidates[device->product].second.inputEvent = udev_device_get_devnode(dev);
+					candidates[device->product].second.serial = serial ? serial : path ? path : "";
+			}
 		}
 
 		udev_device_unref(dev);
@@ -180,18 +405,120 @@ int DeviceManager::probe(struct Device *device, struct sidewinderd::DevNode *dev
 	/* free the enumerator object */
 	udev_enumerate_unref(enumerate);
 
-	return isFound;
+	for (auto &it : candidates) {
+		if (!it.second.second.inputEvent.empty()) {
+			std::clog << "Found device: " << it.second.first.vendor << ":" << it.second.first.product << std::endl;
+			found.insert(it);
+		}
+	}
+
+	return found;
 }
 
+struct Device *DeviceManager::findDevice(const char *vendor, const char *product) {
+	if (!vendor || !product) {
+		return nullptr;
+	}
+
+	for (auto &device : devices_) {
+		if (device.vendor == vendor && device.product == product) {
+			return &device;
+		}
+	}
+
+	return nullptr;
+}
+
+/*
+ * Disconnected keyboards are parked for the reconnect grace period instead of
+ * being destroyed.
+ */
 void DeviceManager::unbind() {
+	auto grace = std::chrono::milliseconds(std::max(settings_->get()->reconnectGrace, 0));
+
+	for (auto it = connected_.begin(); it != connected_.end();) {
+		if (it->second->isConnected()) {
+			++it;
+			continue;
+		}
+
+		if (grace.count()) {
+			Parked &parked = parked_[it->first];
+			parked.keyboard = std::move(it->second);
+			parked.expiry = Stats::Clock::now() + grace;
+		}
+
+		it = connected_.erase(it);
+	}
+}
+
+/*
+ * Keyboards stopped by their listen thread are reopened right away instead of
+ * waiting for udev, the device hasn't gone anywhere. Unplugged devices fail
+ * to open and are parked, until udev adds them again.
+ */
+void DeviceManager::recover() {
+	for (auto &it : connected_) {
+		if (it.second->isRecovering()) {
+			it.second->recover();
+		}
+	}
+
+	unbind();
+}
+
+void DeviceManager::lockMemory() {
+	if (isMemoryLocked_) {
+		return;
+	}
+
+	for (auto &it : connected_) {
+		if (it.second->isConnected() && !it.second->isUp()) {
+			return;
+		}
+	}
+
+	isMemoryLocked_ = true;
+	Realtime::lockMemory();
+}
+
+void DeviceManager::remove(const char *devNode) {
+	if (!devNode) {
+		return;
+	}
+
 	for (auto &it : connected_) {
-		if (!it.second->isConnected()) {
-			connected_.erase(it.first);
+		if (it.second->getDevNode().hidraw == devNode) {
+			it.second->disconnect();
+		}
+	}
+}
+
+int DeviceManager::expire() {
+	auto now = Stats::Clock::now();
+	int timeout = -1;
+
+	for (auto it = parked_.begin(); it != parked_.end();) {
+		if (it->second.expiry <= now) {
+			std::clog << "Dropping disconnected device " << it->first << std::endl;
+			it = parked_.erase(it);
+			continue;
 		}
+
+		// round up, so poll() doesn't return right before expiry
+		auto left = std::chrono::duration_cast<std::chrono::milliseconds>(it->second.expiry - now).count() + 1;
+
+		if (timeout < 0 || left < timeout) {
+			timeout = left;
+		}
+
+		++it;
 	}
+
+	return timeout;
 }
 
-DeviceManager::DeviceManager(libconfig::Config *config, Process *process) {
+DeviceManager::DeviceManager(SettingsStore *settings, Process *process) : output_{settings->get(), process}, layers_{settings->get()->sharedLayers} {
 	// list of supported devices
 	devices_ = {
 		{VENDOR_MICROSOFT, "074b", "Microsoft SideWinder X6",
@@ -204,14 +531,18 @@ DeviceManager::DeviceManager(libconfig::Config *config, Process *process) {
 			Device::Driver::LogitechG710}
 	};
 
-	config_ = config;
+	settings_ = settings;
 	process_ = process;
+	sharedDevice_ = -1;
+	isMemoryLocked_ = false;
+	Realtime::configure(settings_->get()->realtime, process_);
 	udev_ = nullptr;
 	monitor_ = nullptr;
 }
 
 DeviceManager::~DeviceManager() {
-	unbind();
+	parked_.clear();
+	connected_.clear();
 
 	if (udev_) {
 		udev_unref(udev_);
@@ -10,36 +10,94 @@
 
 #include <map>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <libudev.h>
 #include <poll.h>
 
-#include <libconfig.h++>
-
 #include <device_data.hpp>
 #include <process.hpp>
 #include <core/device.hpp>
 #include <core/keyboard.hpp>
+#include <core/output_mux.hpp>
+#include <core/profile_bundle.hpp>
+#include <core/profile_policy.hpp>
+#include <core/realtime.hpp>
+#include <core/settings.hpp>
+#include <core/shared_layers.hpp>
+#include <core/state_file.hpp>
+#include <core/stats.hpp>
 
 class DeviceManager {
 	public:
 		int monitor();
-		DeviceManager(libconfig::Config *config, Process *process);
+		DeviceManager(SettingsStore *settings, Process *process);
 		~DeviceManager();
 
 	private:
 		int fd_;
+		int sharedDevice_;
+		bool isMemoryLocked_;
+		OutputMux output_; /**< must outlive all keyboards */
+		StateFile state_; /**< must outlive all keyboards */
+		SharedLayers layers_; /**< must outlive all keyboards */
+		/**
+		 * Struct holding a disconnected keyboard, which gets resumed, if
+		 * it comes back before expiry.
+		 */
+		struct Parked {
+			std::unique_ptr<Keyboard> keyboard;
+			Stats::Clock::time_point expiry;
+		};
+
 		std::map<std::string, std::unique_ptr<Keyboard>> connected_;
+		std::map<std::string, Parked> parked_;
 		std::vector<Device> devices_;
-		struct pollfd pfd_;
+		struct pollfd pfds_[5];
 		struct udev *udev_;
 		struct udev_monitor *monitor_;
-		libconfig::Config *config_;
+		SettingsStore *settings_;
 		Process *process_;
+		ProfilePolicy policy_;
+		std::shared_ptr<const ProfileBundle> bundle_;
 		void discover();
-		int probe(struct Device *device, struct sidewinderd::DevNode *devNode);
+		void switchProfile();
+		void reload();
+		void attachProfiles();
+
+		/**
+		 * Locks memory once, after the keyboards found on startup have
+		 * been brought up by their listen threads.
+		 */
+		void lockMemory();
+
+		/**
+		 * Maps the profile bundle of the working directory, if it has
+		 * been replaced, and hands it to all keyboards.
+		 */
+		void openBundle();
+		std::map<std::string, std::pair<Device, sidewinderd::DevNode>> probe();
+		struct Device *findDevice(const char *vendor, const char *product);
 		void unbind();
+
+		/**
+		 * Reopens keyboards, which have stopped after I/O errors, and
+		 * parks the ones, which can't be recovered.
+		 */
+		void recover();
+
+		/**
+		 * Marks keyboards as disconnected, which use the removed hidraw
+		 * node, in case their listen thread hasn't noticed yet.
+		 */
+		void remove(const char *devNode);
+
+		/**
+		 * Drops expired parked keyboards.
+		 * @return milliseconds until the next expiry or -1
+		 */
+		int expire();
 };
 
 #endif
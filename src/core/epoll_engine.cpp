@@ -0,0 +1,124 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+
+#include <core/epoll_engine.hpp>
+
+int EpollEngine::addReader(int fd, std::size_t size) {
+	/* readers are drained after epoll_wait(), which must never block */
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	return addSlot(fd, size, false);
+}
+
+int EpollEngine::addWatcher(int fd) {
+	return addSlot(fd, 0, true);
+}
+
+void EpollEngine::removeReader(int slot) {
+	if (slot < 0 || slot >= IO_MAX_SLOTS || slots_[slot].fd < 0) {
+		return;
+	}
+
+	epoll_ctl(epfd_, EPOLL_CTL_DEL, slots_[slot].fd, nullptr);
+	slots_[slot].fd = -1;
+}
+
+int EpollEngine::wait(struct IoCompletion *completions, int max, int timeout) {
+	struct epoll_event events[IO_MAX_SLOTS];
+	int nEvents = epoll_wait(epfd_, events, max < IO_MAX_SLOTS ? max : IO_MAX_SLOTS, timeout);
+	int count = 0;
+
+	for (int i = 0; i < nEvents; i++) {
+		int slot = events[i].data.u32;
+
+		if (slots_[slot].fd < 0) {
+			continue;
+		}
+
+		if (slots_[slot].isWatcher) {
+			completions[count].slot = slot;
+			completions[count].result = events[i].events;
+			completions[count].data = nullptr;
+			count++;
+			continue;
+		}
+
+		int nBytes = read(slots_[slot].fd, buffers_[slot], slots_[slot].size);
+
+		if (nBytes < 0 && (errno == EAGAIN || errno == EINTR)) {
+			continue;
+		}
+
+		completions[count].slot = slot;
+		completions[count].result = nBytes < 0 ? -errno : nBytes;
+		completions[count].data = buffers_[slot];
+		count++;
+	}
+
+	return count;
+}
+
+void EpollEngine::queueWrite(int fd, const void *data, std::size_t size, int *result) {
+	ssize_t written = write(fd, data, size);
+
+	if (result) {
+		*result = written < 0 ? -errno : written;
+	}
+}
+
+void EpollEngine::flushWrites() {
+	/* writes are done immediately */
+}
+
+int EpollEngine::addSlot(int fd, std::size_t size, bool isWatcher) {
+	for (int slot = 0; slot < IO_MAX_SLOTS; slot++) {
+		if (slots_[slot].fd >= 0) {
+			continue;
+		}
+
+		struct epoll_event event = epoll_event();
+		event.events = isWatcher ? EPOLLOUT : EPOLLIN;
+		event.data.u32 = slot;
+
+		if (epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &event) < 0) {
+			return -1;
+		}
+
+		slots_[slot].fd = fd;
+		slots_[slot].size = size < IO_BUFFER_SIZE ? size : IO_BUFFER_SIZE;
+		slots_[slot].isWatcher = isWatcher;
+
+		return slot;
+	}
+
+	return -1;
+}
+
+std::string EpollEngine::getName() {
+	return "epoll";
+}
+
+EpollEngine::EpollEngine() {
+	epfd_ = epoll_create1(EPOLL_CLOEXEC);
+
+	for (auto &slot : slots_) {
+		slot.fd = -1;
+		slot.size = 0;
+		slot.isWatcher = false;
+	}
+}
+
+EpollEngine::~EpollEngine() {
+	close(epfd_);
+}
@@ -0,0 +1,42 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef EPOLL_ENGINE_CLASS_H
+#define EPOLL_ENGINE_CLASS_H
+
+#include <core/io_engine.hpp>
+
+/**
+ * I/O engine based on epoll and plain read() / write() calls. Available on
+ * every kernel, used as fallback for UringEngine.
+ */
+class EpollEngine : public IoEngine {
+	public:
+		int addReader(int fd, std::size_t size);
+		int addWatcher(int fd);
+		void removeReader(int slot);
+		int wait(struct IoCompletion *completions, int max, int timeout);
+		void queueWrite(int fd, const void *data, std::size_t size, int *result = nullptr);
+		void flushWrites();
+		std::string getName();
+		EpollEngine();
+		~EpollEngine();
+
+	private:
+		struct Slot {
+			int fd;
+			std::size_t size;
+			bool isWatcher;
+		};
+
+		int epfd_;
+		int addSlot(int fd, std::size_t size, bool isWatcher);
+		struct Slot slots_[IO_MAX_SLOTS];
+		unsigned char buffers_[IO_MAX_SLOTS][IO_BUFFER_SIZE];
+};
+
+#endif
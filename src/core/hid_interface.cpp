@@ -5,44 +5,107 @@
  * MIT License. For more information, see LICENSE file.
  */
 
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
 #include <iostream>
+#include <thread>
 
 #include <linux/hidraw.h>
 
 #include <sys/ioctl.h>
 
 #include <core/hid_interface.hpp>
+#include <core/stats.hpp>
 
-unsigned char HidInterface::getReport(unsigned char report) {
+/* constants */
+constexpr auto HID_RETRIES =	4;
+constexpr auto HID_BACKOFF =	1;
+
+HidStatus HidInterface::getReport(unsigned char report, unsigned char *value) {
 	unsigned char buf[2] {};
-	buf[0] = report;
-	int ret = ioctl(*fd_, HIDIOCGFEATURE(sizeof(buf)), buf);
+	HidStatus status = request(HIDIOCGFEATURE(sizeof(buf)), buf, report);
 
-	if (ret < 0) {
+	if (status != HidStatus::Ok) {
 		std::cerr << "Error getting HID feature report." << std::endl;
 	} else {
-		std::cout << "getFeatureReport(" << static_cast<int>(report)
-			  << ") returned: " << std::hex
-			  << static_cast<int>(buf[0]) << " "
-			  << static_cast<int>(buf[1]) <<  std::endl;
+		*value = buf[1];
 	}
 
-	return buf[1];
+	return status;
 }
 
-void HidInterface::setReport(unsigned char report, unsigned char value) {
+HidStatus HidInterface::setReport(unsigned char report, unsigned char value) {
 	unsigned char buf[2];
 	/* buf[0] is Report ID, buf[1] is value */
-	buf[0] = report;
 	buf[1] = value;
-	/* TODO: check return value */
-	int ret = ioctl(*fd_, HIDIOCSFEATURE(sizeof(buf)), buf);
+	HidStatus status = request(HIDIOCSFEATURE(sizeof(buf)), buf, report);
 
-	if (ret < 0) {
+	if (status != HidStatus::Ok) {
 		std::cerr << "Error setting HID feature report." << std::endl;
 	}
+
+	return status;
+}
+
+HidStatus HidInterface::takeError() {
+	HidStatus error = error_;
+	error_ = HidStatus::Ok;
+
+	return error;
+}
+
+/*
+ * EPIPE is a USB stall, the device has rejected the request.
+ */
+HidStatus HidInterface::classify(int error) {
+	switch (error) {
+		case EAGAIN:
+		case EINTR:
+		case EBUSY:
+		case EIO:
+		case EPROTO:
+		case ETIMEDOUT:
+			return HidStatus::Transient;
+		case ENODEV:
+		case ENXIO:
+		case ESHUTDOWN:
+			return HidStatus::Gone;
+		default:
+			return HidStatus::Fatal;
+	}
+}
+
+/*
+ * Transient errors are retried with exponential backoff. Requests are sent by
+ * the listen thread, so all retries together take 15 ms at most.
+ */
+HidStatus HidInterface::request(unsigned long command, unsigned char *buf, unsigned char report) {
+	int delay = HID_BACKOFF;
+
+	for (int i = 0; ; i++) {
+		buf[0] = report;
+
+		if (ioctl(*fd_, command, buf) >= 0) {
+			return HidStatus::Ok;
+		}
+
+		HidStatus status = classify(errno);
+
+		if (status != HidStatus::Transient || i == HID_RETRIES) {
+			Stats::increment(Counter::HidFailed);
+			error_ = std::max(error_, status);
+
+			return status;
+		}
+
+		Stats::increment(Counter::HidRetried);
+		std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+		delay *= 2;
+	}
 }
 
 HidInterface::HidInterface(int *fd) {
 	fd_ = fd;
+	error_ = HidStatus::Ok;
 }
@@ -10,14 +10,46 @@
 
 #include <string>
 
+/**
+ * Enum class of HID request results, ordered by severity.
+ *
+ * @var Ok request succeeded
+ * @var Fatal request can't succeed, e.g. an unsupported report, but the
+ * device is still usable
+ * @var Transient request failed after retries, e.g. a wedged hidraw node
+ * @var Gone device has been unplugged
+ */
+enum class HidStatus {
+	Ok,
+	Fatal,
+	Transient,
+	Gone
+};
+
 class HidInterface {
 	public:
-		unsigned char getReport(unsigned char report);
-		void setReport(unsigned char report, unsigned char value);
+		/**
+		 * Reads a feature report. value is left untouched, if the
+		 * request fails.
+		 */
+		HidStatus getReport(unsigned char report, unsigned char *value);
+		HidStatus setReport(unsigned char report, unsigned char value);
+
+		/**
+		 * Returns the most severe error since the last call.
+		 */
+		HidStatus takeError();
+
+		/**
+		 * Classifies an errno value of a hidraw request or read.
+		 */
+		static HidStatus classify(int error);
 		HidInterface(int *fd);
 
 	private:
 		int *fd_;
+		HidStatus error_;
+		HidStatus request(unsigned long command, unsigned char *buf, unsigned char report);
 };
 
 #endif
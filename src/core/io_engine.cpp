@@ -0,0 +1,26 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <iostream>
+
+#include <core/epoll_engine.hpp>
+#include <core/io_engine.hpp>
+#include <core/uring_engine.hpp>
+
+std::unique_ptr<IoEngine> IoEngine::create(bool isUringPreferred) {
+	if (isUringPreferred) {
+		std::unique_ptr<UringEngine> uring(new UringEngine());
+
+		if (uring->isReady()) {
+			return std::unique_ptr<IoEngine>(uring.release());
+		}
+
+		std::clog << "io_uring not available, falling back to epoll" << std::endl;
+	}
+
+	return std::unique_ptr<IoEngine>(new EpollEngine());
+}
@@ -0,0 +1,95 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef IO_ENGINE_CLASS_H
+#define IO_ENGINE_CLASS_H
+
+#include <cstddef>
+#include <memory>
+#include <string>
+
+/* constants */
+const int IO_MAX_SLOTS = 8;
+const int IO_BUFFER_SIZE = 512;
+
+/**
+ * Struct describing a completed read.
+ *
+ * @var slot slot returned by IoEngine::addReader() or IoEngine::addWatcher()
+ * @var result number of bytes read or negative errno, 0 on end of file, poll
+ * events for watchers
+ * @var data read data, valid until the next call of IoEngine::wait(), nullptr
+ * for watchers
+ */
+struct IoCompletion {
+	int slot;
+	int result;
+	const unsigned char *data;
+};
+
+/**
+ * Interface of the engines doing device I/O.
+ *
+ * Readers are file descriptors, which are read continuously into buffers
+ * owned by the engine. Writes are queued and submitted together. An engine is
+ * used by a single thread only.
+ */
+class IoEngine {
+	public:
+		/**
+		 * Starts reading a file descriptor. Engines may change its file
+		 * status flags, until it is removed with removeReader().
+		 * @param size maximum number of bytes per read, at most
+		 * IO_BUFFER_SIZE
+		 * @return slot or -1, if all slots are in use
+		 */
+		virtual int addReader(int fd, std::size_t size) = 0;
+
+		/**
+		 * Waits for a file descriptor to become writable. The slot
+		 * completes on every wait(), while it is writable, until it is
+		 * removed with removeReader().
+		 * @return slot or -1, if all slots are in use
+		 */
+		virtual int addWatcher(int fd) = 0;
+
+		/**
+		 * Stops reading or watching a slot. The file descriptor may be
+		 * closed afterwards.
+		 */
+		virtual void removeReader(int slot) = 0;
+
+		/**
+		 * Waits for completed reads. There is at most one completion per
+		 * slot and call.
+		 * @param timeout timeout in milliseconds, -1 waits forever
+		 * @return number of completions, 0 on timeout
+		 */
+		virtual int wait(struct IoCompletion *completions, int max, int timeout) = 0;
+
+		/**
+		 * Queues a write. Data needs to stay valid until flushWrites().
+		 * @param result receives the number of bytes written or negative
+		 * errno, once flushWrites() returned, may be nullptr
+		 */
+		virtual void queueWrite(int fd, const void *data, std::size_t size, int *result = nullptr) = 0;
+
+		/**
+		 * Submits all queued writes and waits for them.
+		 */
+		virtual void flushWrites() = 0;
+		virtual std::string getName() = 0;
+		virtual ~IoEngine() {}
+
+		/**
+		 * Creates an I/O engine. Falls back to epoll, if io_uring isn't
+		 * preferred or not available.
+		 */
+		static std::unique_ptr<IoEngine> create(bool isUringPreferred);
+};
+
+#endif
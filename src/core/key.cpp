@@ -7,15 +7,35 @@
 
 #include <iostream>
 #include <sstream>
+#include <vector>
 
 #include "key.hpp"
 
+static std::vector<std::string> createMacroNames() {
+	std::vector<std::string> names(MAX_MACRO_KEYS + 1);
+
+	for (int index = 1; index <= MAX_MACRO_KEYS; index++) {
+		names[index] = "s" + std::to_string(index) + ".xml";
+	}
+
+	return names;
+}
+
+static const std::vector<std::string> macroNames = createMacroNames();
+
 /**
- * Assembles relative path to Macro file.
+ * Assembles relative path to Macro file. Layer 0 macros reside directly in the
+ * profile directory, other layers use a layer_<n> subdirectory.
  */
-std::string Key::getMacroPath(int profile) {
+std::string Key::getMacroPath(int profile, int layer) {
 	std::stringstream macroPath;
-	macroPath << "profile_" << profile + 1 << "/" << "s" << keyData_->index << ".xml";
+	macroPath << "profile_" << profile + 1 << "/";
+
+	if (layer) {
+		macroPath << "layer_" << layer << "/";
+	}
+
+	macroPath << "s" << keyData_->index << ".xml";
 
 	return macroPath.str();
 }
@@ -26,3 +46,11 @@ std::string Key::getMacroPath(int profile) {
 Key::Key(struct KeyData *keyData) {
 	keyData_ = keyData;
 }
+
+const char *Key::getMacroName(int index) {
+	if (index < 1 || index > MAX_MACRO_KEYS) {
+		return nullptr;
+	}
+
+	return macroNames[index].c_str();
+}
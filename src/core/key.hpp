@@ -10,6 +10,9 @@
 
 #include <string>
 
+/* constants */
+const int MAX_MACRO_KEYS = 32;
+
 /**
  * Struct for storing and passing key data.
  *
@@ -40,7 +43,15 @@ struct KeyData {
  */
 class Key {
 	public:
-		std::string getMacroPath(int profile);
+		std::string getMacroPath(int profile, int layer = 0);
+
+		/**
+		 * Returns the file name of a macro key from a precomputed table,
+		 * e.g. "s3.xml".
+		 * @param index macro key index, 1 - MAX_MACRO_KEYS
+		 * @return file name or nullptr, if the index is out of range
+		 */
+		static const char *getMacroName(int index);
 		Key(struct KeyData *keyData);
 
 	private:
@@ -0,0 +1,87 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef KEY_BITMAP_CLASS_H
+#define KEY_BITMAP_CLASS_H
+
+#include <cstdint>
+
+#include <linux/input.h>
+
+/* constants */
+constexpr int KEY_BITMAP_WORDS = (KEY_CNT + 63) / 64;
+
+/**
+ * Struct for storing a set of keycodes, e.g. the key capabilities of a virtual
+ * input device.
+ */
+struct KeyBitmap {
+	uint64_t words[KEY_BITMAP_WORDS];
+
+	void set(int key) {
+		if (key >= 0 && key < KEY_CNT) {
+			words[key / 64] |= 1ULL << (key % 64);
+		}
+	}
+
+	bool test(int key) const {
+		return key >= 0 && key < KEY_CNT && (words[key / 64] >> (key % 64)) & 1;
+	}
+
+	/**
+	 * Checks, whether all keys of another bitmap are part of this one.
+	 */
+	bool contains(const KeyBitmap &other) const {
+		for (int i = 0; i < KEY_BITMAP_WORDS; i++) {
+			if (other.words[i] & ~words[i]) {
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	KeyBitmap &operator|=(const KeyBitmap &other) {
+		for (int i = 0; i < KEY_BITMAP_WORDS; i++) {
+			words[i] |= other.words[i];
+		}
+
+		return *this;
+	}
+};
+
+/**
+ * Returns the bits of the keycode range [first, last], which fall into the
+ * given 64 bit word of a KeyBitmap.
+ */
+constexpr uint64_t getRangeWord(int word, int first, int last) {
+	return (last < word * 64 || first >= (word + 1) * 64) ? 0 :
+		(~0ULL << ((first > word * 64 ? first : word * 64) - word * 64))
+		& (~0ULL >> (63 - ((last < word * 64 + 63 ? last : word * 64 + 63) - word * 64)));
+}
+
+/**
+ * Keys and mouse buttons, which can be captured by macro recording. All of
+ * them are advertised by default, so newly recorded macros work on a virtual
+ * input device, whose keys are fixed once it has been created.
+ */
+constexpr uint64_t getDefaultWord(int word) {
+	return getRangeWord(word, KEY_ESC, KEY_KPDOT)
+		| getRangeWord(word, BTN_MOUSE, BTN_TASK)
+		| getRangeWord(word, KEY_ZENKAKUHANKAKU, KEY_F24)
+		| getRangeWord(word, KEY_PLAYCD, KEY_MICMUTE);
+}
+
+static_assert(KEY_BITMAP_WORDS == 12, "DEFAULT_KEYS needs to be updated for KEY_CNT");
+
+constexpr KeyBitmap DEFAULT_KEYS = {{
+	getDefaultWord(0), getDefaultWord(1), getDefaultWord(2), getDefaultWord(3),
+	getDefaultWord(4), getDefaultWord(5), getDefaultWord(6), getDefaultWord(7),
+	getDefaultWord(8), getDefaultWord(9), getDefaultWord(10), getDefaultWord(11)
+}};
+
+#endif
@@ -5,10 +5,11 @@
  * MIT License. For more information, see LICENSE file.
  */
 
+#include <algorithm>
+#include <chrono>
 #include <cstdio>
 #include <ctime>
 #include <iostream>
-#include <sstream>
 #include <thread>
 
 #include <fcntl.h>
@@ -18,116 +19,687 @@
 #include <linux/hidraw.h>
 #include <linux/input.h>
 
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 
 #include "keyboard.hpp"
 
-constexpr auto TIMEOUT =	5000;
+/* constants */
+constexpr auto GRAB_RETRIES =	200;
+constexpr auto GRAB_INTERVAL =	10;
+constexpr auto MAX_RECOVERIES =	3;
+constexpr auto RECOVERY_WINDOW =	60;
+constexpr auto MAX_PLAYERS =	8;
+constexpr auto RECORD_EVENTS =	4096;
 
 bool Keyboard::isConnected() {
 	return isConnected_;
 }
 
+bool Keyboard::isUp() {
+	return isUp_;
+}
+
 void Keyboard::connect() {
 	isConnected_ = true;
+	isUp_ = false;
 	listenThread_ = std::thread(&Keyboard::listen, this);
 }
 
 void Keyboard::disconnect() {
-	isConnected_ = false;
-}
-
-void Keyboard::setupPoll() {
-	fds[0].fd = fd_;
-	fds[0].events = POLLIN;
-	/* ignore second fd for now */
-	fds[1].fd = -1;
-	fds[1].events = POLLIN;
-}
-
-/* TODO: interrupt and exit play_macro when any macro_key has been pressed */
-void Keyboard::playMacro(std::string macroPath, VirtualInput *virtInput) {
-	tinyxml2::XMLDocument xmlDoc;
-	xmlDoc.LoadFile(macroPath.c_str());
-
-	if(!xmlDoc.ErrorID()) {
-		tinyxml2::XMLElement* root = xmlDoc.FirstChildElement("Macro");
-
-		for (tinyxml2::XMLElement* child = root->FirstChildElement(); child; child = child->NextSiblingElement()) {
-			if (child->Name() == std::string("KeyBoardEvent")) {
-				bool isPressed;
-				int key = std::atoi(child->GetText());
-				child->QueryBoolAttribute("Down", &isPressed);
-				virtInput->sendEvent(EV_KEY, key, isPressed);
-			} else if (child->Name() == std::string("DelayEvent")) {
-				int delay = std::atoi(child->GetText());
-				struct timespec request, remain;
-				/*
-				 * value is given in milliseconds, so we need to split it into
-				 * seconds and nanoseconds. nanosleep() is interruptable and saves
-				 * the remaining sleep time.
-				 */
-				request.tv_sec = delay / 1000;
-				delay = delay - (request.tv_sec * 1000);
-				request.tv_nsec = 1000000L * delay;
-				nanosleep(&request, &remain);
+	if (isConnected_.exchange(false)) {
+		disconnected_ = Stats::Clock::now();
+	}
+
+	/* the listen thread waits without timeout */
+	uint64_t wake = 1;
+	write(wakeFd_, &wake, sizeof(wake));
+
+	/* wake up macros waiting for a key release */
+	std::lock_guard<std::mutex> lock(playMutex_);
+	playCond_.notify_all();
+}
+
+/*
+ * Runs in the monitor thread. The listen thread has left its loop already, it
+ * only gets joined here. Keys held while disconnecting have been released by
+ * the device.
+ */
+bool Keyboard::reconnect(sidewinderd::DevNode *devNode) {
+	if (listenThread_.joinable()) {
+		listenThread_.join();
+	}
+
+	io_.reset();
+	close(fd_);
+	devNode_ = *devNode;
+	setHeldKeys(0);
+	resetBindings();
+	/* a replugged keyboard gets another chance */
+	if (!isRecovering_) {
+		recoveries_ = 0;
+	}
+
+	isRecovering_ = false;
+	isFailed_ = false;
+	hid_.takeError();
+
+	if (!openDevice()) {
+		return false;
+	}
+
+	setupIo();
+	isResuming_ = true;
+	connect();
+
+	return true;
+}
+
+bool Keyboard::isRecovering() {
+	return isRecovering_;
+}
+
+/*
+ * The input event node is opened again by bringUp(), if the keyboard is
+ * grabbed. Its node path doesn't change without a replug.
+ */
+bool Keyboard::recover() {
+	std::clog << "Reopening device " << device_.vendor << ":" << device_.product << std::endl;
+	sidewinderd::DevNode devNode = devNode_;
+
+	if (!reconnect(&devNode)) {
+		std::cerr << "Can't recover device " << device_.vendor << ":" << device_.product << std::endl;
+		setHealth(Health::Failed);
+
+		return false;
+	}
+
+	Stats::increment(Counter::DeviceRecovered);
+
+	return true;
+}
+
+const sidewinderd::DevNode &Keyboard::getDevNode() {
+	return devNode_;
+}
+
+/*
+ * Profile directories are created on demand, when recording a macro.
+ */
+void Keyboard::setupProfiles() {
+	const Settings *settings = settings_->get();
+	DeviceSettings device = settings->getDevice(device_.product);
+	/* cache size is given in KiB */
+	profiles_ = std::unique_ptr<ProfileCache>(new ProfileCache(device.profiles, device.layers, settings->macroCacheSize * 1024, settings->optimizer, settings->text));
+	if (process_->isWorkdirReady()) {
+		profiles_->attach();
+	}
+
+	remap_ = std::unique_ptr<RemapTable>(new RemapTable(device.profiles, device.layers, device.remaps));
+	bindings_ = std::unique_ptr<BindingAutomaton>(new BindingAutomaton(device.profiles, device.bindings,
+		settings->tapTimeout, settings->sequenceTimeout));
+	pacer_.configure(device.outputRate, device.outputBurst);
+}
+
+/*
+ * The hidraw interface, the wakeup eventfd and the binding timer are read
+ * during the whole lifetime, the input event node only while recording or
+ * grabbing.
+ */
+bool Keyboard::openDevice() {
+	/* open file descriptor with root privileges */
+	auto start = Stats::Clock::now();
+	fd_ = process_->openPrivileged(devNode_.hidraw, O_RDWR | O_NONBLOCK);
+	Stats::addTiming("device.hidraw", Stats::Clock::now() - start);
+
+	/* TODO: destruct, if interface can't be accessed */
+	if (fd_ < 0) {
+		std::cout << "Can't open hidraw interface" << std::endl;
+
+		return false;
+	}
+
+	return true;
+}
+
+void Keyboard::setupIo() {
+	io_ = IoEngine::create(settings_->get()->isUringPreferred);
+	hidSlot_ = io_->addReader(fd_, MAX_BUF);
+	/* wakes up the listen thread on requested profile switches */
+	wakeSlot_ = io_->addReader(wakeFd_, sizeof(uint64_t));
+	timerSlot_ = io_->addReader(timerFd_, sizeof(uint64_t));
+	/* picks up macro files, which have been added or edited */
+	watchSlot_ = profiles_->getWatchFd() >= 0 ? io_->addReader(profiles_->getWatchFd(), IO_BUFFER_SIZE) : -1;
+	evSlot_ = -1;
+}
+
+void Keyboard::setProfile(int profile) {
+	profile_ = profile;
+	getState()->profile.store(profile, std::memory_order_relaxed);
+	updateProfileLed();
+}
+
+int Keyboard::getLayer() {
+	int layer = layer_;
+
+	if (!layer && sharedSlot_ >= 0) {
+		layer = sharedLayers_->getLayer(sharedSlot_);
+	}
+
+	return layer;
+}
+
+struct DeviceState *Keyboard::getState() {
+	return state_.load(std::memory_order_acquire);
+}
+
+void Keyboard::setHealth(Health health) {
+	Stats::setHealth(device_.vendor + ":" + device_.product, health);
+}
+
+/*
+ * Runs in the listen thread. The monitor thread joins it, before it reopens
+ * the device nodes. Once the limit has been reached, the keyboard isn't
+ * recovered anymore, until it gets replugged.
+ */
+bool Keyboard::requestRecovery() {
+	auto now = Stats::Clock::now();
+
+	if (!recoveries_ || (recoveries_ < MAX_RECOVERIES && now - recoveryStart_ > std::chrono::seconds(RECOVERY_WINDOW))) {
+		recoveries_ = 0;
+		recoveryStart_ = now;
+	}
+
+	if (recoveries_ >= MAX_RECOVERIES) {
+		return false;
+	}
+
+	recoveries_++;
+	isRecovering_ = true;
+	setHealth(Health::Recovering);
+	disconnect();
+	Process::wake();
+
+	return true;
+}
+
+/*
+ * Failed requests have been retried already. Requests, which can't succeed,
+ * only cost the LEDs, so the keyboard keeps running. Transient errors, which
+ * didn't go away, are taken as a wedged hidraw node.
+ */
+void Keyboard::checkHid() {
+	switch (hid_.takeError()) {
+		case HidStatus::Ok:
+			break;
+		case HidStatus::Fatal:
+			setHealth(Health::Degraded);
+			break;
+		case HidStatus::Transient:
+			if (!requestRecovery()) {
+				setHealth(Health::Degraded);
 			}
+
+			break;
+		case HidStatus::Gone:
+			disconnect();
+			break;
+	}
+}
+
+void Keyboard::setState(struct DeviceState *state) {
+	if (!state) {
+		return;
+	}
+
+	int profile = state->profile;
+
+	if (profile >= 0 && profile < profiles_->getProfileCount()) {
+		profile_ = profile;
+	}
+
+	state->profile = profile_.load();
+	state_ = state;
+}
+
+/*
+ * The state of this run replaces the one of the last run, so the keyboard
+ * doesn't switch profiles all of a sudden.
+ */
+void Keyboard::attachState(struct DeviceState *state) {
+	if (!state) {
+		return;
+	}
+
+	struct DeviceState *current = getState();
+	state->profile.store(profile_, std::memory_order_relaxed);
+	state->mode.store(current->mode, std::memory_order_relaxed);
+	state_.store(state, std::memory_order_release);
+}
+
+void Keyboard::requestProfile(int profile) {
+	if (profile < 0 || profile >= profiles_->getProfileCount() || profile == profile_) {
+		return;
+	}
+
+	profile_ = profile;
+	getState()->profile.store(profile, std::memory_order_relaxed);
+	isLedDirty_ = true;
+	uint64_t wake = 1;
+	write(wakeFd_, &wake, sizeof(wake));
+}
+
+/*
+ * Runs in the listen thread. No matter how many profile switches have been
+ * requested since the last wakeup, LEDs only get updated once.
+ */
+void Keyboard::applyPendingProfile() {
+	if (isLedDirty_.exchange(false)) {
+		updateProfileLed();
+	}
+}
+
+void Keyboard::attachProfiles() {
+	profiles_->attach();
+}
+
+void Keyboard::setBundle(std::shared_ptr<const ProfileBundle> bundle) {
+	profiles_->setBundle(bundle);
+}
+
+void Keyboard::rescanProfiles() {
+	profiles_->rescan();
+}
+
+void Keyboard::warmProfiles(std::set<int> profiles) {
+	warmTargets_ = profiles;
+}
+
+void Keyboard::startMacro(int key) {
+	// keys bound to shared layers don't run macros
+	if (sharedSlot_ >= 0 && ((sharedLayers_->getKeys(sharedSlot_) >> (key - 1)) & 1)) {
+		return;
+	}
+
+	if (!bindings_->isBound(profile_)) {
+		runMacro(key, key);
+	}
+}
+
+void Keyboard::runMacro(int macroKey, int key) {
+	auto macro = profiles_->getMacro(profile_, getLayer(), macroKey);
+
+	if (macro) {
+		KeyBitmap known = outputKeys_;
+		known |= missingKeys_;
+
+		if (!known.contains(macro->getKeys())) {
+			missingKeys_ |= macro->getKeys();
+			std::cerr << "Macro " << macroKey << " sends keys, which the virtual input device doesn't advertise."
+				  << " They are skipped until sidewinderd is restarted." << std::endl;
+		}
+
+		if (!hasOutputMotion_ && !isMotionMissing_ && macro->hasMotion()) {
+			isMotionMissing_ = true;
+			std::cerr << "Macro " << macroKey << " moves the pointer, which the virtual input device doesn't"
+				  << " advertise. Motion is skipped until sidewinderd is restarted." << std::endl;
+		}
+
+		std::unique_lock<std::mutex> lock(playMutex_);
+
+		if (playCount_ == PLAY_QUEUE_SIZE) {
+			std::cerr << "Too many macros playing, skipping macro " << macroKey << std::endl;
+
+			return;
+		}
+
+		PlayRequest &request = playQueue_[(playHead_ + playCount_++) % PLAY_QUEUE_SIZE];
+		request.macro = macro;
+		request.key = key;
+
+		if (idlePlayers_ < playCount_ && players_.size() < MAX_PLAYERS) {
+			startPlayer();
+		}
+
+		lock.unlock();
+		queueCond_.notify_one();
+	}
+}
+
+/*
+ * Presses and releases are taken from the held keys, as HID reports only tell
+ * the lowest pressed key. Timeouts, which expired before the automaton moved
+ * on, are stale and ignored.
+ */
+void Keyboard::stepBindings() {
+	int profile = profile_;
+	uint32_t held = heldKeys_;
+	uint32_t released = steppedKeys_ & ~held, pressed = held & ~steppedKeys_;
+	steppedKeys_ = held;
+
+	if (!bindings_->isBound(profile)) {
+		isTimerExpired_ = false;
+
+		return;
+	}
+
+	if (isTimerExpired_) {
+		isTimerExpired_ = false;
+
+		if (deadline_ && OutputMux::getTimestamp() >= deadline_) {
+			feedBindings(profile, BindingAutomaton::getTimeout());
+		}
+	}
+
+	for (; released; released &= released - 1) {
+		feedBindings(profile, BindingAutomaton::getRelease(__builtin_ffs(released)));
+	}
+
+	for (; pressed; pressed &= pressed - 1) {
+		feedBindings(profile, BindingAutomaton::getPress(__builtin_ffs(pressed)));
+	}
+}
+
+void Keyboard::feedBindings(int profile, int symbol) {
+	struct BindingAction actions[MAX_BINDING_ACTIONS];
+	int timeout;
+	int count = bindings_->step(profile, symbol, actions, &timeout);
+
+	if (timeout >= 0) {
+		armTimer(timeout);
+	}
+
+	for (int i = 0; i < count; i++) {
+		runMacro(actions[i].macro, actions[i].key);
+	}
+}
+
+void Keyboard::resetBindings() {
+	/* the automaton starts over, once it sees another profile */
+	struct BindingAction actions[MAX_BINDING_ACTIONS];
+	int timeout;
+	bindings_->step(-1, BindingAutomaton::getTimeout(), actions, &timeout);
+	armTimer(0);
+	steppedKeys_ = heldKeys_;
+	isTimerExpired_ = false;
+}
+
+/*
+ * The timer is read by the I/O engine like any other file descriptor, so
+ * pending bindings never need a sleeping thread.
+ */
+void Keyboard::armTimer(int timeout) {
+	struct itimerspec spec = itimerspec();
+	spec.it_value.tv_sec = timeout / 1000;
+	spec.it_value.tv_nsec = timeout % 1000 * 1000000L;
+	deadline_ = timeout ? OutputMux::getTimestamp() + timeout * 1000000ULL : 0;
+	timerfd_settime(timerFd_, 0, &spec, nullptr);
+}
+
+KeyBitmap Keyboard::getOutputKeys(bool isScanning, bool *hasMotion) {
+	bool isMotion = !settings_->get()->getDevice(device_.product).pointer.empty();
+	KeyBitmap keys = DEFAULT_KEYS;
+	keys |= isScanning ? profiles_->scanKeys(&isMotion) : profiles_->getKeys();
+
+	if (hasMotion) {
+		*hasMotion |= isMotion;
+	}
+
+	if (!settings_->get()->getDevice(device_.product).isGrabbed) {
+		return keys;
+	}
+
+	int fd = evfd_ >= 0 ? evfd_ : process_->openPrivileged(devNode_.inputEvent, O_RDONLY | O_NONBLOCK);
+
+	if (fd < 0) {
+		return keys;
+	}
+
+	KeyBitmap physical = KeyBitmap();
+	ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(physical.words)), physical.words);
+	keys |= physical;
+	keys |= remap_->getTargets(physical);
+
+	if (fd != evfd_) {
+		close(fd);
+	}
+
+	return keys;
+}
+
+void Keyboard::setOutput(OutputMux *output, int device) {
+	output_ = output;
+	outputDevice_ = device;
+	isOutputOwner_ = device < 0;
+}
+
+void Keyboard::setSharedLayers(SharedLayers *layers) {
+	sharedLayers_ = layers;
+	sharedSlot_ = layers->getSlot(device_.product);
+}
+
+void Keyboard::play() {
+	Realtime::setupThread(ThreadRole::Playback);
+	std::unique_lock<std::mutex> lock(playMutex_);
+
+	while (true) {
+		idlePlayers_++;
+		queueCond_.wait(lock, [&] { return isStopping_ || playCount_; });
+		idlePlayers_--;
+
+		if (isStopping_) {
+			return;
 		}
+
+		PlayRequest request = std::move(playQueue_[playHead_]);
+		playHead_ = (playHead_ + 1) % PLAY_QUEUE_SIZE;
+		playCount_--;
+		lock.unlock();
+
+		{
+			HotPath hotPath;
+			MacroVm vm(this, request.key);
+			vm.run(request.macro);
+		}
+
+		request.macro.reset();
+		lock.lock();
+	}
+}
+
+/*
+ * Must be called with playMutex_ held.
+ */
+void Keyboard::startPlayer() {
+	players_.push_back(std::thread(&Keyboard::play, this));
+}
+
+/*
+ * Keys bound to shared layers are hidden from bindings and playback, as they
+ * never run macros.
+ */
+void Keyboard::setHeldKeys(uint32_t keys) {
+	if (sharedSlot_ >= 0) {
+		sharedLayers_->setHeld(sharedSlot_, keys);
+		keys &= ~sharedLayers_->getKeys(sharedSlot_);
+	}
+
+	if (heldKeys_.exchange(keys) == keys) {
+		return;
 	}
+
+	std::lock_guard<std::mutex> lock(playMutex_);
+	playCond_.notify_all();
+}
+
+void Keyboard::emit(const struct input_event *events, int count) {
+	static_assert(VM_FRAME_EVENTS <= MAX_FRAME_EVENTS, "macro frames don't fit into output frames");
+	struct OutputFrame frame;
+	frame.timestamp = OutputMux::getTimestamp();
+	frame.device = outputDevice_;
+	frame.count = count;
+	frame.isPassthrough = false;
+	std::copy(events, events + count, frame.events);
+	output_->submit(&frame);
+}
+
+int Keyboard::getProfile() {
+	return profile_;
+}
+
+void Keyboard::waitRelease(int key) {
+	std::unique_lock<std::mutex> lock(playMutex_);
+	playCond_.wait(lock, [&] {
+		return !((heldKeys_ >> (key - 1)) & 1) || !isActive();
+	});
+}
+
+bool Keyboard::isActive() {
+	return process_->isActive() && isConnected_;
+}
+
+std::shared_ptr<const Macro> Keyboard::getMacro(int profile, int key) {
+	return profiles_->getMacro(profile, getLayer(), key);
+}
+
+TokenBucket *Keyboard::getPacer() {
+	return &pacer_;
 }
 
 /*
  * Macro recording captures delays by default. Use the configuration to disable
- * capturing delays.
+ * capturing delays. Events of the keyboard and the pointer device are
+ * collected first and merged by their timestamps afterwards, both use
+ * CLOCK_MONOTONIC. With a pointer device, delays are written in microseconds.
  */
-void Keyboard::recordMacro(std::string path, Led *ledRecord, const int keyRecord) {
+void Keyboard::recordMacro(int key, Led *ledRecord, const int keyRecord) {
+	struct KeyData macroKey = KeyData();
+	macroKey.index = key;
+	macroKey.type = KeyData::KeyType::Macro;
+	int profile = profile_, layer = getLayer();
+	std::string path = Key(&macroKey).getMacroPath(profile, layer);
 	struct timeval prev;
 	struct KeyData keyData;
 	prev.tv_usec = 0;
 	prev.tv_sec = 0;
+	/* read once, the recording loop doesn't touch the configuration */
+	const Settings *settings = settings_->get();
+	bool isCapturingDelays = settings->isCapturingDelays;
+	std::string pointer = settings->getDevice(device_.product).pointer;
+	int clock = CLOCK_MONOTONIC;
 	std::cout << "Start Macro Recording on " << devNode_.inputEvent << std::endl;
-	process_->privilege();
-	evfd_ = open(devNode_.inputEvent.c_str(), O_RDONLY | O_NONBLOCK);
-	process_->unprivilege();
+	isRecording_ = true;
 
-	if (evfd_ < 0) {
-		std::cout << "Can't open input event file" << std::endl;
+	/* a grabbed input event node is read already, recording gets remapped keys */
+	if (!isGrabbed_) {
+		evfd_ = process_->openPrivileged(devNode_.inputEvent, O_RDONLY | O_NONBLOCK);
+
+		if (evfd_ < 0) {
+			std::cout << "Can't open input event file" << std::endl;
+		} else {
+			/* additionally read /dev/input/event*, whole events only */
+			ioctl(evfd_, EVIOCSCLOCKID, &clock);
+			evSlot_ = io_->addReader(evfd_, IO_BUFFER_SIZE / sizeof(struct input_event) * sizeof(struct input_event));
+		}
 	}
 
-	/* additionally monitor /dev/input/event* with poll */
-	fds[1].fd = evfd_;
-	tinyxml2::XMLDocument doc;
-	tinyxml2::XMLNode* root = doc.NewElement("Macro");
-	/* start root element "Macro" */
-	doc.InsertFirstChild(root);
+	if (!pointer.empty()) {
+		pointerFd_ = process_->openPrivileged(pointer, O_RDONLY | O_NONBLOCK);
+
+		if (pointerFd_ < 0) {
+			std::cout << "Can't open pointer device " << pointer << std::endl;
+		} else {
+			std::cout << "Recording pointer device " << pointer << std::endl;
+			ioctl(pointerFd_, EVIOCSCLOCKID, &clock);
+			pointerSlot_ = io_->addReader(pointerFd_, IO_BUFFER_SIZE / sizeof(struct input_event) * sizeof(struct input_event));
+		}
+	}
 
+	bool isPrecise = pointerFd_ >= 0;
 	bool isRecordMode = true;
 
-	while (isRecordMode) {
-		keyData = pollDevice(2);
+	while (isRecordMode && isConnected()) {
+		keyData = pollDevice();
 
 		if (keyData.index == keyRecord && keyData.type == KeyData::KeyType::Extra) {
 			ledRecord->off();
 			isRecordMode = false;
 		}
+	}
+
+	std::vector<struct input_event> recorded(events_.size() + pointerEvents_.size());
+	std::merge(events_.begin(), events_.end(), pointerEvents_.begin(), pointerEvents_.end(), recorded.begin(),
+		[](const struct input_event &a, const struct input_event &b) { return timercmp(&a.time, &b.time, <); });
+
+	tinyxml2::XMLDocument doc;
+	tinyxml2::XMLNode* root = doc.NewElement("Macro");
+	/* start root element "Macro" */
+	doc.InsertFirstChild(root);
+
+	for (std::size_t i = 0; i < recorded.size(); i++) {
+		auto &inev = recorded[i];
+		bool isMotion = inev.type == EV_REL && (inev.code == REL_X || inev.code == REL_Y);
+		bool isWheel = inev.type == EV_REL && (inev.code == REL_WHEEL || inev.code == REL_HWHEEL);
+
+		if ((inev.type != EV_KEY || inev.value == 2) && !isMotion && !isWheel) {
+			continue;
+		}
 
-		struct input_event inev;
-		read(evfd_, &inev, sizeof(struct input_event));
+		/* only capturing delays, if capture_delays is set to true */
+		if (prev.tv_usec && isCapturingDelays) {
+			auto diff = (inev.time.tv_usec + 1000000 * inev.time.tv_sec) - (prev.tv_usec + 1000000 * prev.tv_sec);
 
-		if (inev.type == EV_KEY && inev.value != 2) {
-			/* only capturing delays, if capture_delays is set to true */
-			if (prev.tv_usec && config_->lookup("capture_delays")) {
-				auto diff = (inev.time.tv_usec + 1000000 * inev.time.tv_sec) - (prev.tv_usec + 1000000 * prev.tv_sec);
-				auto delay = diff / 1000;
+			/* pointer motion of a single frame shares its timestamp */
+			if (!isPrecise || diff) {
 				/* start element "DelayEvent" */
 				tinyxml2::XMLElement* DelayEvent = doc.NewElement("DelayEvent");
-				DelayEvent->SetText(static_cast<int>(delay));
+
+				if (isPrecise) {
+					DelayEvent->SetAttribute("Unit", "us");
+					DelayEvent->SetText(static_cast<int>(diff));
+				} else {
+					DelayEvent->SetText(static_cast<int>(diff / 1000));
+				}
+
 				root->InsertEndChild(DelayEvent);
 			}
+		}
+
+		prev = inev.time;
+
+		if (isMotion) {
+			int x = 0, y = 0;
+
+			/* collect both axes of the frame */
+			for (;; i++) {
+				(recorded[i].code == REL_X ? x : y) += recorded[i].value;
+
+				if (i + 1 == recorded.size() || recorded[i + 1].type != EV_REL
+						|| (recorded[i + 1].code != REL_X && recorded[i + 1].code != REL_Y)
+						|| timercmp(&recorded[i + 1].time, &inev.time, !=)) {
+					break;
+				}
+			}
+
+			tinyxml2::XMLElement* MouseMoveEvent = doc.NewElement("MouseMoveEvent");
+			MouseMoveEvent->SetAttribute("X", x);
+			MouseMoveEvent->SetAttribute("Y", y);
+			root->InsertEndChild(MouseMoveEvent);
+		} else if (isWheel) {
+			tinyxml2::XMLElement* MouseWheelEvent = doc.NewElement("MouseWheelEvent");
+
+			if (inev.code == REL_HWHEEL) {
+				MouseWheelEvent->SetAttribute("Horizontal", true);
+			}
 
-			/* start element "KeyBoardEvent" */
-			tinyxml2::XMLElement* KeyBoardEvent = doc.NewElement("KeyBoardEvent");
+			MouseWheelEvent->SetText(inev.value);
+			root->InsertEndChild(MouseWheelEvent);
+		} else {
+			bool isButton = inev.code >= BTN_MOUSE && inev.code <= BTN_TASK;
+			/* start element "KeyBoardEvent" or "MouseButtonEvent" */
+			tinyxml2::XMLElement* KeyBoardEvent = doc.NewElement(isButton ? "MouseButtonEvent" : "KeyBoardEvent");
 
 			if (inev.value) {
 				KeyBoardEvent->SetAttribute("Down", true);
@@ -137,55 +709,412 @@ void Keyboard::recordMacro(std::string path, Led *ledRecord, const int keyRecord
 
 			KeyBoardEvent->SetText(inev.code);
 			root->InsertEndChild(KeyBoardEvent);
-			prev = inev.time;
 		}
 	}
 
-	/* write XML document */
-	if (doc.SaveFile(path.c_str())) {
+	/* create profile and layer directories on demand */
+	for (auto pos = path.find('/'); pos != std::string::npos; pos = path.find('/', pos + 1)) {
+		mkdir(path.substr(0, pos).c_str(), S_IRWXU);
+	}
+
+	/* incomplete recordings of disconnected devices are discarded */
+	if (!isConnected()) {
+		std::cout << "Discarding Macro Recording" << std::endl;
+	} else if (doc.SaveFile(path.c_str())) {
+		/* write XML document */
 		std::cout << "Error XML SaveFile" << std::endl;
 	}
 
 	std::cout << "Exit Macro Recording" << std::endl;
-	/* remove event file from poll fds */
-	fds[1].fd = -1;
+	profiles_->reload(profile, layer, key);
+	isRecording_ = false;
+	events_.clear();
+	pointerEvents_.clear();
+
+	/* stop reading the event files */
+	if (!isGrabbed_) {
+		io_->removeReader(evSlot_);
+		evSlot_ = -1;
+		close(evfd_);
+		evfd_ = -1;
+	}
+
+	if (pointerFd_ >= 0) {
+		io_->removeReader(pointerSlot_);
+		pointerSlot_ = -1;
+		close(pointerFd_);
+		pointerFd_ = -1;
+	}
+}
+
+bool Keyboard::openGrab() {
+	evfd_ = process_->openPrivileged(devNode_.inputEvent, O_RDONLY | O_NONBLOCK);
+
+	if (evfd_ < 0) {
+		std::cerr << "Can't open input event file for grabbing" << std::endl;
+
+		return false;
+	}
+
+	/* event timestamps are compared with OutputMux::getTimestamp() */
+	int clock = CLOCK_MONOTONIC;
+	ioctl(evfd_, EVIOCSCLOCKID, &clock);
+
+	return true;
+}
+
+/*
+ * Keys held down while grabbing would never be released for other readers of
+ * the input event node, so wait until all keys have been released.
+ */
+void Keyboard::startGrab() {
+	for (int i = 0; i < GRAB_RETRIES && isActive(); i++) {
+		KeyBitmap held = KeyBitmap();
+		ioctl(evfd_, EVIOCGKEY(sizeof(held.words)), held.words);
+
+		if (KeyBitmap().contains(held)) {
+			break;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(GRAB_INTERVAL));
+	}
+
+	if (ioctl(evfd_, EVIOCGRAB, 1)) {
+		std::cerr << "Can't grab input event file" << std::endl;
+		close(evfd_);
+		evfd_ = -1;
+
+		return;
+	}
+
+	evSlot_ = io_->addReader(evfd_, IO_BUFFER_SIZE / sizeof(struct input_event) * sizeof(struct input_event));
+	isGrabbed_ = true;
+	std::clog << "Grabbed " << devNode_.inputEvent << std::endl;
+}
+
+void Keyboard::stopGrab() {
+	if (!isGrabbed_) {
+		return;
+	}
+
+	syncHeld(KeyBitmap());
+	io_->removeReader(evSlot_);
+	evSlot_ = -1;
+	ioctl(evfd_, EVIOCGRAB, 0);
 	close(evfd_);
+	evfd_ = -1;
+	isGrabbed_ = false;
+}
+
+/*
+ * Events are sent per SYN_REPORT, like they have been reported by the input
+ * device. After SYN_DROPPED, events are discarded up to the next SYN_REPORT
+ * and held keys are synchronized with the device state.
+ */
+void Keyboard::passthrough(const struct input_event *events, int count) {
+	for (int i = 0; i < count; i++) {
+		auto &event = events[i];
+
+		if (event.type == EV_SYN && event.code == SYN_DROPPED) {
+			isDropping_ = true;
+			passFrame_.count = 0;
+		} else if (event.type == EV_SYN && event.code == SYN_REPORT) {
+			if (isDropping_) {
+				KeyBitmap held = KeyBitmap();
+				ioctl(evfd_, EVIOCGKEY(sizeof(held.words)), held.words);
+				isDropping_ = false;
+				syncHeld(held);
+			} else {
+				submitPassthrough();
+			}
+		} else if (!isDropping_ && event.type == EV_KEY && event.code < KEY_CNT) {
+			remapEvent(event);
+		}
+	}
+}
+
+/*
+ * Keys remember the action they have been pressed with, so switching
+ * profiles or layers never leaves keys stuck.
+ */
+void Keyboard::remapEvent(const struct input_event &event) {
+	uint16_t action = heldActions_[event.code];
+
+	if (event.value == 1) {
+		action = remap_->lookup(profile_, getLayer(), event.code);
+		heldActions_[event.code] = action;
+	} else if (!event.value) {
+		heldActions_[event.code] = 0;
+	}
+
+	if (RemapTable::isLayer(action)) {
+		int layer = RemapTable::getLayer(action);
+
+		if (event.value == 1) {
+			layer_ = layer;
+		} else if (!event.value && layer_ == layer) {
+			layer_ = 0;
+		}
+
+		return;
+	}
+
+	if (!action) {
+		return;
+	}
+
+	struct input_event &output = passFrame_.events[passFrame_.count++];
+	output = event;
+	output.code = action;
+
+	if (isRecording_) {
+		events_.push_back(output);
+	}
+
+	/* larger frames are split, the parts share their timestamp and SYN_REPORT */
+	if (passFrame_.count == MAX_FRAME_EVENTS) {
+		submitPassthrough();
+	}
+}
+
+void Keyboard::submitPassthrough() {
+	if (!passFrame_.count) {
+		return;
+	}
+
+	auto &time = passFrame_.events[0].time;
+	passFrame_.timestamp = time.tv_sec * 1000000000ULL + time.tv_usec * 1000ULL;
+	passFrame_.device = outputDevice_;
+	passFrame_.isPassthrough = true;
+	output_->submit(&passFrame_);
+	passFrame_.count = 0;
+}
+
+void Keyboard::syncHeld(const KeyBitmap &held) {
+	uint64_t now = OutputMux::getTimestamp();
+	struct input_event release = input_event();
+	release.time.tv_sec = now / 1000000000ULL;
+	release.time.tv_usec = now % 1000000000ULL / 1000;
+	release.type = EV_KEY;
+	passFrame_.count = 0;
+
+	for (int key = 0; key < KEY_CNT; key++) {
+		if (heldActions_[key] && !held.test(key)) {
+			release.code = key;
+			remapEvent(release);
+		}
+	}
+
+	submitPassthrough();
 }
 
-struct KeyData Keyboard::pollDevice(nfds_t nfds) {
+struct KeyData Keyboard::pollDevice() {
+	struct IoCompletion completions[IO_MAX_SLOTS];
+	struct KeyData keyData = KeyData();
+
 	/*
-	 * poll() checks the device for any activities and blocks the loop,
-	 * either until an event has occured, or the timeout has been reached.
-	 * This leads to a very efficient polling mechanism.
+	 * Blocks, until any reader has completed, there is no timeout. Each
+	 * reader completes at most once per call.
 	 */
-	poll(fds, nfds, TIMEOUT);
+	int count = io_->wait(completions, IO_MAX_SLOTS, -1);
+
+	/* dropping changed profiles allocates, so it's done before the hot path */
+	for (int i = 0; i < count; i++) {
+		if (completions[i].slot == watchSlot_ && completions[i].result > 0) {
+			Stats::increment(Counter::WakeupProfiles);
+			profiles_->update(completions[i].data, completions[i].result);
+		}
+	}
 
-	// check, if device has been disconnected
-	if (fds->revents & POLLHUP || fds->revents & POLLERR) {
-		disconnect();
+	HotPath hotPath;
 
-		return KeyData();
+	if (!count) {
+		Stats::increment(Counter::WakeupSpurious);
 	}
 
-	struct KeyData keyData = getInput();
+	for (int i = 0; i < count; i++) {
+		auto &completion = completions[i];
+
+		if (completion.slot == hidSlot_) {
+			Stats::increment(Counter::WakeupHid);
+
+			// check, if device has been disconnected or has failed
+			if (completion.result <= 0) {
+				if (!completion.result || HidInterface::classify(-completion.result) == HidStatus::Gone) {
+					disconnect();
+				} else if (!requestRecovery()) {
+					std::cerr << "Giving up on device " << device_.vendor << ":" << device_.product << std::endl;
+					isFailed_ = true;
+					disconnect();
+					Process::wake();
+				}
+
+				return KeyData();
+			}
+
+			keyData = getInput(completion.data, completion.result);
+		} else if (completion.slot == wakeSlot_) {
+			Stats::increment(Counter::WakeupRequest);
+			applyPendingProfile();
+		} else if (completion.slot == timerSlot_) {
+			Stats::increment(Counter::WakeupTimer);
+			isTimerExpired_ = true;
+		} else if (completion.slot == evSlot_ && completion.result < 0 && isGrabbed_) {
+			// passthrough depends on the grabbed input event node
+			if (HidInterface::classify(-completion.result) != HidStatus::Gone && !requestRecovery()) {
+				stopGrab();
+			}
+		} else if (completion.slot == evSlot_ && completion.result > 0) {
+			Stats::increment(Counter::WakeupInputEvent);
+			auto events = reinterpret_cast<const struct input_event *>(completion.data);
+			int count = completion.result / sizeof(struct input_event);
+
+			if (isGrabbed_) {
+				passthrough(events, count);
+			} else {
+				events_.insert(events_.end(), events, events + count);
+			}
+		} else if (completion.slot == pointerSlot_ && completion.result > 0) {
+			Stats::increment(Counter::WakeupInputEvent);
+			auto events = reinterpret_cast<const struct input_event *>(completion.data);
+			pointerEvents_.insert(pointerEvents_.end(), events, events + completion.result / sizeof(struct input_event));
+		}
+	}
 
 	return keyData;
 }
 
+/*
+ * Expensive device setup is done here instead of in the constructor, so all
+ * devices are brought up concurrently in their own listen threads.
+ */
+void Keyboard::bringUp() {
+	auto start = Stats::Clock::now();
+
+	if (!warmTargets_.empty()) {
+		// load profiles, which might get switched to by focus events
+		for (auto profile : warmTargets_) {
+			profiles_->warm(profile);
+		}
+
+		warmTargets_.clear();
+		Stats::addTiming("device.warm", Stats::Clock::now() - start);
+		start = Stats::Clock::now();
+	}
+
+	/* the first macro doesn't wait for a thread */
+	{
+		std::lock_guard<std::mutex> lock(playMutex_);
+
+		if (players_.empty()) {
+			startPlayer();
+		}
+	}
+
+	bool isGrabbing = settings_->get()->getDevice(device_.product).isGrabbed && openGrab();
+
+	/*
+	 * Keys are advertised once, recreating the device would look like a
+	 * replug. A resumed keyboard keeps its virtual input device.
+	 */
+	bool isCreating = isOutputOwner_ && outputDevice_ < 0;
+	bool hasMotion = false;
+	KeyBitmap keys = getOutputKeys(isCreating, &hasMotion);
+
+	if (isCreating) {
+		outputDevice_ = output_->addDevice(&device_, keys, hasMotion);
+	}
+
+	outputKeys_ = output_->getKeys(outputDevice_);
+	hasOutputMotion_ = output_->hasMotion(outputDevice_);
+
+	if (!outputKeys_.contains(keys)) {
+		std::cerr << "Device " << device_.vendor << ":" << device_.product << " sends keys, which the virtual"
+			  << " input device doesn't advertise. They are skipped until sidewinderd is restarted." << std::endl;
+	}
+
+	if (hasMotion && !hasOutputMotion_) {
+		std::cerr << "Device " << device_.vendor << ":" << device_.product << " records pointer motion, which the"
+			  << " virtual input device doesn't advertise. It is skipped until sidewinderd is restarted." << std::endl;
+	}
+
+	auto uinputDone = Stats::Clock::now();
+	setup();
+
+	if (isGrabbing) {
+		startGrab();
+	}
+
+	auto setupDone = Stats::Clock::now();
+
+	Stats::addTiming("device.uinput", uinputDone - start);
+	setHealth(Health::Ready);
+	Stats::addTiming("device.setup", setupDone - uinputDone);
+
+	if (isResuming_) {
+		isResuming_ = false;
+		Stats::addTiming("device.resume", setupDone - start);
+		std::clog << "Device " << device_.vendor << ":" << device_.product
+			  << " resumed on profile " << profile_ + 1 << " after "
+			  << Stats::toMs(setupDone - disconnected_) << " ms" << std::endl;
+
+		return;
+	}
+
+	Stats::addTiming("device.ready", Stats::getUptime());
+	std::clog << "Device " << device_.vendor << ":" << device_.product
+		  << " ready after " << Stats::toMs(Stats::getUptime()) << " ms (uinput "
+		  << Stats::toMs(uinputDone - start) << " ms, setup "
+		  << Stats::toMs(setupDone - uinputDone) << " ms)" << std::endl;
+}
+
 void Keyboard::listen() {
+	bringUp();
+	isUp_ = true;
+
+	/* memory gets locked, once all keyboards are up */
+	if (Realtime::isEnabled()) {
+		Process::wake();
+	}
+
+	Realtime::setupThread(ThreadRole::Input);
+
+	checkHid();
+
 	while (process_->isActive() && isConnected()) {
-		struct KeyData keyData = pollDevice(1);
+		struct KeyData keyData = pollDevice();
+		stepBindings();
 		handleKey(&keyData);
+		checkHid();
+	}
+
+	// don't leave layers of other keyboards active while disconnected
+	setHeldKeys(0);
+	stopGrab();
+
+	if (isFailed_) {
+		setHealth(Health::Failed);
+	} else if (!isConnected() && !isRecovering_) {
+		setHealth(Health::Disconnected);
 	}
 }
 
 void Keyboard::handleRecordMode(Led *ledRecord, const int keyRecord) {
 	bool isRecordMode = true;
+
+	/* macros are stored relative to the working directory */
+	if (!profiles_->isAttached()) {
+		std::cerr << "Can't record macros, the working directory isn't available yet" << std::endl;
+
+		return;
+	}
+
+	resetBindings();
 	/* record LED solid light */
 	ledRecord->on();
 
-	while (isRecordMode) {
-		struct KeyData keyData = pollDevice(1);
+	while (isRecordMode && isConnected()) {
+		struct KeyData keyData = pollDevice();
 
 		if (keyData.type == KeyData::KeyType::Unknown
 				|| !keyData.index) {
@@ -195,8 +1124,7 @@ void Keyboard::handleRecordMode(Led *ledRecord, const int keyRecord) {
 			/* record LED should blink */
 			ledRecord->blink();
 			isRecordMode = false;
-			Key key(&keyData);
-			recordMacro(key.getMacroPath(profile_), ledRecord, keyRecord);
+			recordMacro(keyData.index, ledRecord, keyRecord);
 		} else if (keyData.type == KeyData::KeyType::Extra) {
 			/* deactivate Record LED */
 			ledRecord->off();
@@ -207,47 +1135,97 @@ void Keyboard::handleRecordMode(Led *ledRecord, const int keyRecord) {
 			}
 		}
 	}
+
+	/* keys pressed while recording don't count as presses */
+	resetBindings();
 }
 
 Keyboard::Keyboard(struct Device *device,
-		sidewinderd::DevNode *devNode, libconfig::Config *config,
+		sidewinderd::DevNode *devNode, SettingsStore *settings,
 		Process *process) : hid_{&fd_} {
-	config_ = config;
+	settings_ = settings;
 	process_ = process;
 	device_ = *device;
 	devNode_ = *devNode;
-	virtInput_ = new VirtualInput(&device_, &devNode_, process_);
+	output_ = nullptr;
+	outputDevice_ = -1;
+	isOutputOwner_ = false;
+	outputKeys_ = KeyBitmap();
+	missingKeys_ = KeyBitmap();
+	hasOutputMotion_ = false;
+	isMotionMissing_ = false;
 	profile_ = 0;
+	layer_ = 0;
+	sharedLayers_ = nullptr;
+	sharedSlot_ = -1;
+	isLedDirty_ = false;
+	localState_.id[0] = '\0';
+	localState_.profile = 0;
+	localState_.mode = 0;
+	state_ = &localState_;
 	isConnected_ = true;
-
-	for (int i = MIN_PROFILE; i < MAX_PROFILE; i++) {
-		std::stringstream profileFolderPath;
-		profileFolderPath << "profile_" << i + 1;
-		mkdir(profileFolderPath.str().c_str(), S_IRWXU);
-	}
-
-	/* open file descriptor with root privileges */
-	process_->privilege();
-	fd_ = open(devNode->hidraw.c_str(), O_RDWR | O_NONBLOCK);
-	process_->unprivilege();
-
-	/* TODO: destruct, if interface can't be accessed */
-	if (fd_ < 0) {
-		std::cout << "Can't open hidraw interface" << std::endl;
-	}
-
-	setupPoll();
+	isUp_ = false;
+	heldKeys_ = 0;
+	playHead_ = 0;
+	playCount_ = 0;
+	idlePlayers_ = 0;
+	isStopping_ = false;
+	players_.reserve(MAX_PLAYERS);
+	events_.reserve(RECORD_EVENTS);
+	pointerEvents_.reserve(RECORD_EVENTS);
+	evfd_ = -1;
+	pointerFd_ = -1;
+	pointerSlot_ = -1;
+	watchSlot_ = -1;
+	isGrabbed_ = false;
+	isRecording_ = false;
+	isDropping_ = false;
+	heldActions_.resize(KEY_CNT, 0);
+	passFrame_.count = 0;
+	setupProfiles();
+	wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	timerFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	isTimerExpired_ = false;
+	isResuming_ = false;
+	isRecovering_ = false;
+	isFailed_ = false;
+	recoveries_ = 0;
+	deadline_ = 0;
+	steppedKeys_ = 0;
+	openDevice();
+	setupIo();
 
 	std::cerr << "Keyboard Constructor" << std::endl;
 }
 
 Keyboard::~Keyboard() {
 	std::cerr << "Keyboard Destructor" << std::endl;
+	disconnect();
 
 	if (listenThread_.joinable()) {
 		listenThread_.join();
 	}
 
-	delete virtInput_;
+	/* playing macros stop, as the keyboard isn't active anymore */
+	{
+		std::lock_guard<std::mutex> lock(playMutex_);
+		isStopping_ = true;
+		playCond_.notify_all();
+	}
+
+	queueCond_.notify_all();
+
+	for (auto &player : players_) {
+		player.join();
+	}
+
+	if (isOutputOwner_ && outputDevice_ >= 0) {
+		output_->removeDevice(outputDevice_);
+	}
+
+	Stats::removeHealth(device_.vendor + ":" + device_.product);
+	io_.reset();
+	close(timerFd_);
+	close(wakeFd_);
 	close(fd_);
 }
@@ -8,52 +8,345 @@
 #ifndef KEYBOARD_CLASS_H
 #define KEYBOARD_CLASS_H
 
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
 #include <thread>
+#include <vector>
 
-#include <poll.h>
-
-#include <libconfig.h++>
+#include <linux/input.h>
 
 #include <process.hpp>
 #include <device_data.hpp>
+#include <core/binding_automaton.hpp>
 #include <core/device.hpp>
 #include <core/hid_interface.hpp>
+#include <core/io_engine.hpp>
 #include <core/key.hpp>
 #include <core/led.hpp>
-#include <core/virtual_input.hpp>
+#include <core/macro.hpp>
+#include <core/macro_vm.hpp>
+#include <core/profile_cache.hpp>
+#include <core/realtime.hpp>
+#include <core/remap_table.hpp>
+#include <core/report_decoder.hpp>
+#include <core/settings.hpp>
+#include <core/shared_layers.hpp>
+#include <core/state_file.hpp>
+#include <core/stats.hpp>
+#include <core/output_mux.hpp>
 
 /* constants */
 const int MAX_BUF = 8;
-const int MIN_PROFILE = 0;
-const int MAX_PROFILE = 3;
+const int PLAY_QUEUE_SIZE = 16; /**< macros waiting for a playback thread */
 
-class Keyboard {
+class Keyboard : public MacroContext {
 	public:
 		bool isConnected();
+
+		/**
+		 * Checks, whether the listen thread has brought up the keyboard
+		 * since connect(). It wakes up the monitor, once it's done.
+		 */
+		bool isUp();
 		void connect();
 		void disconnect();
+
+		/**
+		 * Resumes a disconnected keyboard on new device nodes. Profiles,
+		 * loaded macros and the virtual input device are kept.
+		 * @return false, if the hidraw node can't be opened
+		 */
+		bool reconnect(sidewinderd::DevNode *devNode);
+
+		/**
+		 * Checks, whether the keyboard has stopped after I/O errors and
+		 * waits for recover().
+		 */
+		bool isRecovering();
+
+		/**
+		 * Reopens the hidraw and input event nodes of a recovering
+		 * keyboard. Runs in the monitor thread.
+		 * @return false, if the nodes can't be opened
+		 */
+		bool recover();
+		const sidewinderd::DevNode &getDevNode();
 		void listen();
-		Keyboard(struct Device *device, sidewinderd::DevNode *devNode, libconfig::Config *config, Process *process);
+
+		/**
+		 * Switches the active profile from outside the listen thread.
+		 * The switch itself takes effect immediately, LED updates are
+		 * coalesced and applied by the listen thread.
+		 * @param profile profile index, counted from 0
+		 */
+		void requestProfile(int profile);
+
+		/**
+		 * Loads the macro tables of the given profiles into memory. They
+		 * are loaded by the listen thread, when the keyboard is brought
+		 * up, so keyboards don't wait for each other.
+		 */
+		void warmProfiles(std::set<int> profiles);
+
+		/**
+		 * Makes macros available, once the working directory is ready.
+		 */
+		void attachProfiles();
+
+		/**
+		 * Takes macros from a profile bundle or from the profile
+		 * directories, if bundle is nullptr.
+		 */
+		void setBundle(std::shared_ptr<const ProfileBundle> bundle);
+
+		/**
+		 * Reads all macros again, e.g. after they have been edited by
+		 * hand.
+		 */
+		void rescanProfiles();
+
+		/**
+		 * Returns all keys, which this keyboard can send: recordable keys,
+		 * keys of macros and, if it gets grabbed, keys of its input event
+		 * node after remapping.
+		 * @param isScanning also read profiles, which aren't loaded
+		 * @param hasMotion set, if a pointer device is recorded or a
+		 * scanned macro moves the pointer or wheels
+		 */
+		KeyBitmap getOutputKeys(bool isScanning = true, bool *hasMotion = nullptr);
+
+		/**
+		 * Sets the output stage. If a device handle is given, this keyboard
+		 * uses a virtual input device shared with other keyboards, else it
+		 * creates its own. Must be called before connect().
+		 */
+		void setOutput(OutputMux *output, int device = -1);
+
+		/**
+		 * Sets the layers shared with other keyboards. Must be called
+		 * before connect().
+		 */
+		void setSharedLayers(SharedLayers *layers);
+
+		/**
+		 * Restores the state of the last run from a state file slot and
+		 * keeps it updated. Must be called before connect().
+		 */
+		void setState(struct DeviceState *state);
+
+		/**
+		 * Moves the current state to a state file slot, which has become
+		 * available while running.
+		 */
+		void attachState(struct DeviceState *state);
+
+		/* MacroContext */
+		void emit(const struct input_event *events, int count);
+		int getProfile();
+		void waitRelease(int key);
+		bool isActive();
+		std::shared_ptr<const Macro> getMacro(int profile, int key);
+		TokenBucket *getPacer();
+		Keyboard(struct Device *device, sidewinderd::DevNode *devNode, SettingsStore *settings, Process *process);
 		~Keyboard();
 
 	protected:
-		bool isConnected_;
-		int profile_;
-		int fd_, evfd_;
+		std::atomic<bool> isConnected_;
+		std::atomic<bool> isUp_;
+		std::set<int> warmTargets_; /**< profiles to load on bring-up */
+		std::atomic<uint32_t> heldKeys_;
+
+		/**
+		 * Struct holding a macro, which waits for a playback thread.
+		 */
+		struct PlayRequest {
+			std::shared_ptr<const Macro> macro;
+			int key;
+		};
+
+		std::mutex playMutex_;
+		std::condition_variable playCond_;
+		std::condition_variable queueCond_; /**< signals queued macros */
+		PlayRequest playQueue_[PLAY_QUEUE_SIZE];
+		int playHead_;
+		int playCount_;
+		std::vector<std::thread> players_; /**< playback threads, never shrinks */
+		int idlePlayers_;
+		bool isStopping_; /**< playback threads exit */
+		std::atomic<int> profile_;
+		std::atomic<int> layer_;
+		SharedLayers *sharedLayers_;
+		int sharedSlot_; /**< -1 without shared layers */
+		std::atomic<bool> isLedDirty_;
+		std::atomic<struct DeviceState *> state_;
+		struct DeviceState localState_; /**< used without a state file */
+		int fd_, evfd_, wakeFd_, pointerFd_;
 		std::thread listenThread_;
 		Process *process_;
-		struct pollfd fds[2];
+		std::unique_ptr<IoEngine> io_;
+		int hidSlot_, wakeSlot_, evSlot_, timerSlot_, pointerSlot_, watchSlot_;
+		int timerFd_;
+		bool isTimerExpired_;
+		bool isResuming_;
+		std::atomic<bool> isRecovering_;
+		bool isFailed_; /**< reading failed, even after recoveries */
+		int recoveries_; /**< recoveries within the current window */
+		Stats::Clock::time_point recoveryStart_;
+		Stats::Clock::time_point disconnected_;
+		uint64_t deadline_; /**< binding timeout, CLOCK_MONOTONIC ns or 0 */
+		uint32_t steppedKeys_; /**< held keys the automaton has seen */
+		std::vector<struct input_event> events_;
+		std::vector<struct input_event> pointerEvents_; /**< recorded pointer events */
 		struct Device device_;
-		libconfig::Config *config_;
+		SettingsStore *settings_;
 		sidewinderd::DevNode devNode_;
 		HidInterface hid_;
-		VirtualInput *virtInput_;
-		virtual struct KeyData getInput() = 0;
-		void setupPoll();
-		static void playMacro(std::string macroPath, VirtualInput *virtInput);
-		void recordMacro(std::string path, Led *ledRecord, const int keyRecord);
-		struct KeyData pollDevice(nfds_t nfds);
+		OutputMux *output_;
+		int outputDevice_;
+		bool isOutputOwner_;
+		KeyBitmap outputKeys_; /**< advertised by the virtual input device */
+		KeyBitmap missingKeys_; /**< sent, but not advertised, logged once */
+		bool hasOutputMotion_; /**< virtual input device advertises relative axes */
+		bool isMotionMissing_; /**< motion sent, but not advertised, logged once */
+		std::unique_ptr<ProfileCache> profiles_;
+		std::unique_ptr<RemapTable> remap_;
+		std::unique_ptr<BindingAutomaton> bindings_;
+		TokenBucket pacer_;
+		bool isGrabbed_;
+		bool isRecording_;
+		bool isDropping_;
+		std::vector<uint16_t> heldActions_; /**< remap action per held key */
+		struct OutputFrame passFrame_;
+
+		/**
+		 * Decodes a HID report read from the hidraw interface.
+		 */
+		virtual struct KeyData getInput(const unsigned char *buf, int nBytes) = 0;
+		virtual void updateProfileLed() = 0;
+
+		/**
+		 * Device specific setup, e.g. resetting LEDs. Runs in the listen
+		 * thread, before any input is handled.
+		 */
+		virtual void setup() = 0;
+		void bringUp();
+		bool openDevice();
+		void setupIo();
+		void setupProfiles();
+		void setProfile(int profile);
+
+		/**
+		 * Returns the active layer. Layers held on this keyboard win
+		 * over layers activated by other keyboards.
+		 */
+		int getLayer();
+		struct DeviceState *getState();
+		void setHealth(Health health);
+
+		/**
+		 * Stops the listen thread and lets the monitor thread reopen
+		 * the device nodes. Recoveries are limited per time window, so
+		 * a broken device doesn't keep the monitor busy. Once the limit
+		 * has been reached, it stays reached until a replug.
+		 * @return false, if the limit has been reached
+		 */
+		bool requestRecovery();
+
+		/**
+		 * Handles errors of HID requests sent since the last call.
+		 */
+		void checkHid();
+		void applyPendingProfile();
+		/**
+		 * Opens the input event node for passthrough.
+		 */
+		bool openGrab();
+		void startGrab();
+		void stopGrab();
+
+		/**
+		 * Remaps events of the grabbed input event node and sends them
+		 * to the virtual input device.
+		 */
+		void passthrough(const struct input_event *events, int count);
+		void remapEvent(const struct input_event &event);
+		void submitPassthrough();
+
+		/**
+		 * Releases all passed through keys, which aren't part of held.
+		 */
+		void syncHeld(const KeyBitmap &held);
+
+		/**
+		 * Runs the macro of a pressed macro key. Profiles with bindings
+		 * are handled by stepBindings() instead.
+		 */
+		void startMacro(int key);
+
+		/**
+		 * Starts playing a macro.
+		 * @param macroKey macro key index of the macro
+		 * @param key macro key, which triggered it
+		 */
+		void runMacro(int macroKey, int key);
+
+		/**
+		 * Feeds macro key presses, releases and expired timeouts to the
+		 * binding automaton. Runs in the listen thread.
+		 */
+		void stepBindings();
+		void feedBindings(int profile, int symbol);
+
+		/**
+		 * Drops pending bindings, e.g. before recording a macro.
+		 */
+		void resetBindings();
+		void armTimer(int timeout);
+		/**
+		 * Playback threads are kept, so pressing a macro key doesn't
+		 * start a thread. Another one is only started, if all of them
+		 * are busy, e.g. waiting for a key release.
+		 */
+		void play();
+		void startPlayer();
+
+		/**
+		 * Updates, which macro keys are currently held down. Bit 0
+		 * represents macro key 1.
+		 */
+		void setHeldKeys(uint32_t keys);
+
+		/**
+		 * Decodes a HID report with a table-driven ReportDecoder.
+		 */
+		template <typename Decoder>
+		struct KeyData decodeInput(const unsigned char *buf, int nBytes) {
+			auto start = Stats::Clock::now();
+			struct KeyData keyData = KeyData();
+			uint32_t held = 0;
+			bool isHeldValid = false;
+			Decoder::decode(buf, nBytes, &keyData, &held, &isHeldValid);
+			Stats::record(Histogram::Decode, Stats::Clock::now() - start);
+
+			if (isHeldValid) {
+				setHeldKeys(held);
+			}
+
+			return keyData;
+		}
+		void recordMacro(int key, Led *ledRecord, const int keyRecord);
+
+		/**
+		 * Waits for I/O of the device. Events of the input event node are
+		 * collected in events_, while recording.
+		 * @return decoded HID report, if one has been read
+		 */
+		struct KeyData pollDevice();
 		virtual void handleKey(struct KeyData *keyData) = 0;
 		void handleRecordMode(Led *ledRecord, const int keyRecord);
 };
@@ -0,0 +1,158 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <linux/input.h>
+
+#include <core/keyboard_layout.hpp>
+
+/* constants */
+constexpr auto LAYOUT_KEYS =	48;
+
+/*
+ * Key order of the layout descriptions: number row, top row, home row and
+ * bottom row including the extra key of ISO keyboards.
+ */
+static const uint16_t layoutKeys[LAYOUT_KEYS] = {
+	KEY_GRAVE, KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9, KEY_0, KEY_MINUS, KEY_EQUAL,
+	KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P, KEY_LEFTBRACE, KEY_RIGHTBRACE,
+	KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_L, KEY_SEMICOLON, KEY_APOSTROPHE, KEY_BACKSLASH,
+	KEY_102ND, KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B, KEY_N, KEY_M, KEY_COMMA, KEY_DOT, KEY_SLASH
+};
+
+/*
+ * Each level holds one UTF-8 character per key, spaces mark keys without a
+ * character on that level.
+ */
+const KeyboardLayout::Description KeyboardLayout::descriptions_[] = {
+	{"us", {
+		"`1234567890-=" "qwertyuiop[]" "asdfghjkl;'\\" " zxcvbnm,./",
+		"~!@#$%^&*()_+" "QWERTYUIOP{}" "ASDFGHJKL:\"|" " ZXCVBNM<>?",
+		"             " "            " "            " "           "
+	}, ""},
+	{"de", {
+		"^1234567890ß´" "qwertzuiopü+" "asdfghjklöä#" "<yxcvbnm,.-",
+		"°!\"§$%&/()=?`" "QWERTZUIOPÜ*" "ASDFGHJKLÖÄ'" ">YXCVBNM;:_",
+		"  ²³   {[]}\\ " "@ €        ~" "            " "|      µ   "
+	}, "^´`"}
+};
+
+bool KeyboardLayout::lookup(uint32_t character, struct KeyStroke *stroke) const {
+	auto it = strokes_.find(character);
+
+	if (it == strokes_.end()) {
+		return false;
+	}
+
+	*stroke = it->second;
+
+	return true;
+}
+
+/*
+ * Layouts are built once and never freed, so pointers to them stay valid.
+ */
+const KeyboardLayout *KeyboardLayout::find(std::string name) {
+	static std::mutex mutex;
+	static std::vector<std::unique_ptr<KeyboardLayout>> layouts;
+	std::lock_guard<std::mutex> lock(mutex);
+
+	if (layouts.empty()) {
+		for (auto &description : descriptions_) {
+			layouts.push_back(std::unique_ptr<KeyboardLayout>(new KeyboardLayout(description)));
+		}
+	}
+
+	for (std::size_t i = 0; i < layouts.size(); i++) {
+		if (name == descriptions_[i].name) {
+			return layouts[i].get();
+		}
+	}
+
+	return nullptr;
+}
+
+uint32_t KeyboardLayout::decode(const char **text) {
+	auto bytes = reinterpret_cast<const unsigned char *>(*text);
+	uint32_t character = bytes[0];
+	int length = 1;
+
+	if (!character) {
+		return 0;
+	} else if ((character & 0xe0) == 0xc0) {
+		character &= 0x1f;
+		length = 2;
+	} else if ((character & 0xf0) == 0xe0) {
+		character &= 0x0f;
+		length = 3;
+	} else if ((character & 0xf8) == 0xf0) {
+		character &= 0x07;
+		length = 4;
+	} else if (character & 0x80) {
+		return 0;
+	}
+
+	for (int i = 1; i < length; i++) {
+		if ((bytes[i] & 0xc0) != 0x80) {
+			return 0;
+		}
+
+		character = (character << 6) | (bytes[i] & 0x3f);
+	}
+
+	*text += length;
+
+	return character;
+}
+
+/*
+ * Characters available on several keys or levels are typed with the first
+ * one, so plain keys win over shifted ones.
+ */
+KeyboardLayout::KeyboardLayout(const Description &description) {
+	const uint8_t levels[] = {0, LAYOUT_SHIFT, LAYOUT_ALTGR};
+
+	for (int level = 0; level < 3; level++) {
+		const char *text = description.levels[level];
+
+		for (int key = 0; key < LAYOUT_KEYS; key++) {
+			uint32_t character = decode(&text);
+
+			if (!character) {
+				break;
+			}
+
+			if (character != ' ') {
+				add(character, layoutKeys[key], levels[level]);
+			}
+		}
+	}
+
+	const char *dead = description.dead;
+
+	for (uint32_t character = decode(&dead); character; character = decode(&dead)) {
+		auto it = strokes_.find(character);
+
+		if (it != strokes_.end()) {
+			it->second.modifiers |= LAYOUT_DEAD;
+		}
+	}
+
+	add(' ', KEY_SPACE, 0);
+	add('\n', KEY_ENTER, 0);
+	add('\t', KEY_TAB, 0);
+}
+
+void KeyboardLayout::add(uint32_t character, int code, uint8_t modifiers) {
+	struct KeyStroke stroke;
+	stroke.code = code;
+	stroke.modifiers = modifiers;
+	strokes_.insert(std::make_pair(character, stroke));
+}
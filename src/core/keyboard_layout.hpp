@@ -0,0 +1,71 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef KEYBOARD_LAYOUT_CLASS_H
+#define KEYBOARD_LAYOUT_CLASS_H
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+/* constants */
+const uint8_t LAYOUT_SHIFT = 0x01;
+const uint8_t LAYOUT_ALTGR = 0x02;
+const uint8_t LAYOUT_DEAD = 0x04; /**< followed by space to type the character itself */
+
+/**
+ * Struct describing, how a character is typed.
+ *
+ * @var code keycode
+ * @var modifiers LAYOUT_SHIFT, LAYOUT_ALTGR and LAYOUT_DEAD bits
+ */
+struct KeyStroke {
+	uint16_t code;
+	uint8_t modifiers;
+};
+
+/**
+ * Class mapping characters to keys of a keyboard layout.
+ *
+ * Layouts are described by the characters of the alphanumeric block without
+ * modifiers, with shift and with AltGr, in a fixed key order. They're turned
+ * into lookup tables on first use.
+ */
+class KeyboardLayout {
+	public:
+		/**
+		 * Looks up a Unicode code point.
+		 * @return false, if the layout can't type it
+		 */
+		bool lookup(uint32_t character, struct KeyStroke *stroke) const;
+
+		/**
+		 * Returns a built-in layout, e.g. "us" or "de".
+		 * @return layout or nullptr, if there is none with that name
+		 */
+		static const KeyboardLayout *find(std::string name);
+
+		/**
+		 * Decodes the next UTF-8 character and advances text.
+		 * @return code point or 0 at the end of text or on invalid input
+		 */
+		static uint32_t decode(const char **text);
+
+	private:
+		struct Description {
+			const char *name;
+			const char *levels[3];
+			const char *dead;
+		};
+
+		std::map<uint32_t, struct KeyStroke> strokes_;
+		static const Description descriptions_[];
+		KeyboardLayout(const Description &description);
+		void add(uint32_t character, int code, uint8_t modifiers);
+};
+
+#endif
@@ -8,8 +8,17 @@
 #include <iostream>
 #include <core/led.hpp>
 
+/*
+ * LEDs share their report with other LEDs, so it's never written, if it
+ * couldn't be read.
+ */
 void Led::on() {
-	auto report = hid_->getReport(report_);
+	unsigned char report;
+
+	if (hid_->getReport(report_, &report) != HidStatus::Ok) {
+		return;
+	}
+
 	auto buf = report;
 
 	if (type_ == LedType::Profile) {
@@ -26,14 +35,24 @@ void Led::on() {
 }
 
 void Led::off() {
-	auto buf = hid_->getReport(report_);
+	unsigned char buf;
+
+	if (hid_->getReport(report_, &buf) != HidStatus::Ok) {
+		return;
+	}
+
 	buf &= ~led_;
 	hid_->setReport(report_, buf);
 }
 
 void Led::blink() {
 	if (blink_) {
-		auto buf = hid_->getReport(report_);
+		unsigned char buf;
+
+		if (hid_->getReport(report_, &buf) != HidStatus::Ok) {
+			return;
+		}
+
 		buf &= ~led_;
 		buf |= blink_;
 		hid_->setReport(report_, buf);
@@ -73,6 +92,6 @@ Led::Led(unsigned char report, unsigned char led, LedGroup *group) {
 	type_ = LedType::Common;
 	hid_ = group_->getHidInterface();
 
-	// initial LED state is off
-	off();
+	// initial LED state is set by LedGroup::reset(), once the device is set up
+	group_->addLed(report_, led_);
 }
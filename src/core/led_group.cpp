@@ -19,7 +19,36 @@ HidInterface *LedGroup::getHidInterface() {
 	return hid_;
 }
 
+/*
+ * All LEDs of a group are expected to share the same feature report, which is
+ * the case for all supported devices.
+ */
+void LedGroup::addLed(unsigned char report, unsigned char led) {
+	report_ = report;
+	mask_ |= led;
+}
+
+void LedGroup::reset() {
+	if (!mask_) {
+		return;
+	}
+
+	unsigned char report;
+
+	if (hid_->getReport(report_, &report) != HidStatus::Ok) {
+		return;
+	}
+
+	auto buf = report & ~mask_;
+
+	if (buf != report) {
+		hid_->setReport(report_, buf);
+	}
+}
+
 LedGroup::LedGroup(HidInterface *hid) {
 	hid_ = hid;
 	indicator_ = 0;
+	report_ = 0;
+	mask_ = 0;
 }
@@ -15,10 +15,22 @@ class LedGroup {
 		unsigned char getIndicatorMask();
 		void setIndicatorMask(unsigned char indicator);
 		HidInterface *getHidInterface();
+
+		/**
+		 * Registers an LED, so it gets turned off by reset().
+		 */
+		void addLed(unsigned char report, unsigned char led);
+
+		/**
+		 * Turns off all LEDs of this group with a single feature report.
+		 */
+		void reset();
 		LedGroup(HidInterface *hid);
 
 	private:
 		unsigned char indicator_;
+		unsigned char report_;
+		unsigned char mask_;
 		HidInterface *hid_;
 };
 
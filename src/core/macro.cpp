@@ -0,0 +1,300 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <cstdio>
+#include <iostream>
+
+#include <fcntl.h>
+#include <tinyxml2.h>
+#include <unistd.h>
+
+#include <linux/input.h>
+
+#include <sys/stat.h>
+
+#include <core/macro.hpp>
+#include <core/macro_compiler.hpp>
+
+/* constants */
+constexpr auto COMPILED_MAGIC =		0x434d5753; /* "SWMC" */
+constexpr auto COMPILED_VERSION =	1;
+constexpr auto MAX_COMPILED_SIZE =	1 << 24;
+
+/**
+ * Parses and compiles a macro file.
+ *
+ * @return true, if the file exists and could be compiled
+ */
+bool Macro::load(std::string path, const MacroOptimizer *optimizer, const TextSettings *text) {
+	tinyxml2::XMLDocument xmlDoc;
+	xmlDoc.LoadFile(path.c_str());
+
+	return compile(&xmlDoc, path, optimizer, text);
+}
+
+bool Macro::loadAt(int dirFd, const char *name, const MacroOptimizer *optimizer, const TextSettings *text) {
+	int fd = openat(dirFd, name, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		return false;
+	}
+
+	FILE *file = fdopen(fd, "r");
+
+	if (!file) {
+		close(fd);
+
+		return false;
+	}
+
+	tinyxml2::XMLDocument xmlDoc;
+	xmlDoc.LoadFile(file);
+	fclose(file);
+
+	return compile(&xmlDoc, name, optimizer, text);
+}
+
+/*
+ * Instructions are stored as they are in memory, compiled files are meant for
+ * the machine, which compiled them.
+ */
+bool Macro::loadCompiled(std::string path) {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		return false;
+	}
+
+	struct CompiledHeader header;
+	struct stat info;
+	bool isValid = read(fd, &header, sizeof(header)) == sizeof(header)
+		&& !fstat(fd, &info)
+		&& header.magic == COMPILED_MAGIC
+		&& header.version == COMPILED_VERSION
+		&& header.size == sizeof(header)
+		&& header.count <= MAX_COMPILED_SIZE / sizeof(Instruction)
+		&& static_cast<std::size_t>(info.st_size) == sizeof(header) + header.count * sizeof(Instruction);
+
+	if (isValid) {
+		program_.resize(header.count);
+		isValid = read(fd, program_.data(), header.count * sizeof(Instruction))
+			== static_cast<ssize_t>(header.count * sizeof(Instruction));
+	}
+
+	close(fd);
+
+	if (!isValid || !verify(program_)) {
+		std::cerr << "Invalid compiled macro " << path << std::endl;
+		program_.clear();
+
+		return false;
+	}
+
+	scanKeys();
+	report_ = OptimizerReport();
+
+	return true;
+}
+
+/*
+ * The optimizer only expects verified programs and the VM only runs verified
+ * ones, so the program is checked before and after optimizing.
+ */
+bool Macro::assign(const Instruction *program, std::size_t count, const MacroOptimizer *optimizer) {
+	program_.assign(program, program + count);
+	bool isValid = verify(program_);
+
+	if (isValid && optimizer) {
+		report_ = optimizer->optimize(&program_);
+		isValid = verify(program_);
+	} else {
+		report_ = OptimizerReport();
+	}
+
+	if (!isValid) {
+		std::cerr << "Invalid compiled macro" << std::endl;
+		program_.clear();
+
+		return false;
+	}
+
+	scanKeys();
+
+	return true;
+}
+
+bool Macro::save(std::string path) const {
+	std::string temporary = path + ".tmp";
+	FILE *file = fopen(temporary.c_str(), "wbe");
+
+	if (!file) {
+		std::cerr << "Can't write " << temporary << std::endl;
+
+		return false;
+	}
+
+	struct CompiledHeader header = CompiledHeader();
+	header.magic = COMPILED_MAGIC;
+	header.version = COMPILED_VERSION;
+	header.size = sizeof(header);
+	header.count = program_.size();
+	header.keys = keys_;
+	bool isWritten = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(program_.data(), sizeof(Instruction), program_.size(), file) == program_.size();
+	isWritten = !fclose(file) && isWritten;
+
+	if (!isWritten || rename(temporary.c_str(), path.c_str())) {
+		std::cerr << "Can't write " << path << std::endl;
+		unlink(temporary.c_str());
+
+		return false;
+	}
+
+	return true;
+}
+
+const std::vector<Instruction> &Macro::getProgram() const {
+	return program_;
+}
+
+std::size_t Macro::size() const {
+	return program_.size();
+}
+
+std::size_t Macro::getMemoryUsage() const {
+	return sizeof(Macro) + program_.capacity() * sizeof(Instruction);
+}
+
+const OptimizerReport &Macro::getReport() const {
+	return report_;
+}
+
+const KeyBitmap &Macro::getKeys() const {
+	return keys_;
+}
+
+bool Macro::hasMotion() const {
+	for (auto &instruction : program_) {
+		if (instruction.opcode == Opcode::Rel) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool Macro::compile(tinyxml2::XMLDocument *xmlDoc, std::string name, const MacroOptimizer *optimizer, const TextSettings *text) {
+	if (xmlDoc->ErrorID()) {
+		return false;
+	}
+
+	tinyxml2::XMLElement* root = xmlDoc->FirstChildElement("Macro");
+
+	if (!root) {
+		return false;
+	}
+
+	MacroCompiler compiler(text);
+
+	if (!compiler.compile(root, &program_, &keys_)) {
+		std::cerr << "Error compiling " << name << ": " << compiler.getError() << std::endl;
+
+		return false;
+	}
+
+	if (optimizer) {
+		report_ = optimizer->optimize(&program_);
+
+		if (!verify(program_)) {
+			std::cerr << "Error optimizing " << name << std::endl;
+			program_.clear();
+
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Checks everything MacroVm relies on, which the compiler guarantees. Events
+ * chained into a frame need to be followed by another event, which completes
+ * the frame.
+ */
+bool Macro::verify(const std::vector<Instruction> &program) {
+	if (program.empty() || program.back().opcode != Opcode::End) {
+		return false;
+	}
+
+	for (std::size_t i = 0; i < program.size(); i++) {
+		const Instruction &instruction = program[i];
+
+		switch (instruction.opcode) {
+			case Opcode::Set:
+			case Opcode::Add:
+				if (instruction.reg >= VM_REGISTERS) {
+					return false;
+				}
+
+				break;
+			case Opcode::JumpIfZero:
+			case Opcode::JumpIfNotZero:
+				if (instruction.reg >= VM_REGISTERS) {
+					return false;
+				}
+
+				/* fall through */
+			case Opcode::Jump:
+			case Opcode::JumpUnlessProfile:
+				if (instruction.value < 0 || static_cast<std::size_t>(instruction.value) > program.size()) {
+					return false;
+				}
+
+				break;
+			case Opcode::Delay:
+				if (instruction.value < 0) {
+					return false;
+				}
+
+				break;
+			case Opcode::Key:
+			case Opcode::Rel:
+				if (instruction.arg >= (instruction.opcode == Opcode::Key ? KEY_CNT : REL_CNT) || instruction.reg > 1
+						|| (instruction.reg && program[i + 1].opcode != Opcode::Key && program[i + 1].opcode != Opcode::Rel)) {
+					return false;
+				}
+
+				break;
+			case Opcode::End:
+			case Opcode::WaitRelease:
+			case Opcode::Call:
+			case Opcode::Rate:
+				break;
+			default:
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/*
+ * Keys of loaded programs are taken from the instructions, a stored bitmap
+ * could miss keys, which the virtual device then can't send.
+ */
+void Macro::scanKeys() {
+	keys_ = KeyBitmap();
+
+	for (auto &instruction : program_) {
+		if (instruction.opcode == Opcode::Key) {
+			keys_.set(instruction.arg);
+		}
+	}
+}
+
+Macro::Macro() : keys_(), report_() {
+}
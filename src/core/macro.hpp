@@ -0,0 +1,112 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef MACRO_CLASS_H
+#define MACRO_CLASS_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <tinyxml2.h>
+
+#include <core/key_bitmap.hpp>
+#include <core/macro_optimizer.hpp>
+#include <core/macro_vm.hpp>
+
+/**
+ * Class representing a macro, which has been loaded into memory.
+ *
+ * Macro files are compiled to bytecode once in load(), so playing a macro
+ * doesn't need any disk access or XML handling. Use MacroVm to play it.
+ * Passing an optimizer runs it over the compiled program. Compiled programs can
+ * be saved and loaded again without the XML step.
+ */
+class Macro {
+	public:
+		/**
+		 * @param text settings for TextEvent elements or nullptr for
+		 * defaults
+		 */
+		bool load(std::string path, const MacroOptimizer *optimizer, const TextSettings *text = nullptr);
+
+		/**
+		 * Parses and compiles a macro file relative to a directory file
+		 * descriptor, which may be an O_PATH descriptor.
+		 */
+		bool loadAt(int dirFd, const char *name, const MacroOptimizer *optimizer, const TextSettings *text = nullptr);
+
+		/**
+		 * Compiles a parsed macro file.
+		 * @param name file name used in error messages
+		 */
+		bool compile(tinyxml2::XMLDocument *xmlDoc, std::string name, const MacroOptimizer *optimizer, const TextSettings *text = nullptr);
+
+		/**
+		 * Loads a program saved by save(). Programs are verified, so
+		 * broken files can't make the VM jump out of the program.
+		 */
+		bool loadCompiled(std::string path);
+
+		/**
+		 * Takes a compiled program, e.g. from a profile bundle. Programs
+		 * are verified like in loadCompiled(), keys are taken from the
+		 * program.
+		 */
+		bool assign(const Instruction *program, std::size_t count, const MacroOptimizer *optimizer);
+
+		/**
+		 * Saves the compiled program. An existing file is replaced
+		 * atomically.
+		 */
+		bool save(std::string path) const;
+		const std::vector<Instruction> &getProgram() const;
+		std::size_t size() const;
+
+		/**
+		 * Returns, what the optimizer changed while loading.
+		 */
+		const OptimizerReport &getReport() const;
+
+		/**
+		 * Returns an estimate of the heap memory used by this macro.
+		 */
+		std::size_t getMemoryUsage() const;
+
+		/**
+		 * Returns all keys, which are sent by this macro.
+		 */
+		const KeyBitmap &getKeys() const;
+
+		/**
+		 * Returns, whether this macro moves the pointer or wheels.
+		 */
+		bool hasMotion() const;
+		Macro();
+
+	private:
+		KeyBitmap keys_;
+		std::vector<Instruction> program_;
+		OptimizerReport report_;
+
+		/**
+		 * Header of compiled macro files, followed by the program.
+		 */
+		struct CompiledHeader {
+			uint32_t magic;
+			uint16_t version;
+			uint16_t size; /**< of the header */
+			uint32_t count; /**< instructions */
+			uint32_t reserved;
+			KeyBitmap keys; /**< written for older versions, ignored */
+		};
+
+		static bool verify(const std::vector<Instruction> &program);
+		void scanKeys();
+};
+
+#endif
@@ -0,0 +1,376 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <core/key.hpp>
+#include <core/macro_compiler.hpp>
+
+/* constants */
+constexpr auto MAX_KEYCODE =	0xffff;
+
+bool MacroCompiler::compile(const tinyxml2::XMLElement *root, std::vector<Instruction> *program, KeyBitmap *keys) {
+	program_ = program;
+	keys_ = keys;
+	loopDepth_ = 0;
+	error_.clear();
+	program_->clear();
+	*keys_ = KeyBitmap();
+
+	if (!compileRate(root)) {
+		return false;
+	}
+
+	if (!compileBlock(root)) {
+		program_->clear();
+
+		return false;
+	}
+
+	emit(Opcode::End, 0, 0, 0);
+	program_->shrink_to_fit();
+
+	return true;
+}
+
+std::string MacroCompiler::getError() {
+	return error_;
+}
+
+bool MacroCompiler::compileBlock(const tinyxml2::XMLElement *parent) {
+	for (auto child = parent->FirstChildElement(); child; child = child->NextSiblingElement()) {
+		if (!compileElement(child)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool MacroCompiler::compileElement(const tinyxml2::XMLElement *element) {
+	const char *name = element->Name();
+	int reg, value;
+
+	if (!std::strcmp(name, "KeyBoardEvent")) {
+		bool isPressed = false;
+		element->QueryBoolAttribute("Down", &isPressed);
+
+		if (!queryText(element, &value) || value < 0 || value > MAX_KEYCODE) {
+			return fail(element, "invalid keycode");
+		}
+
+		keys_->set(value);
+		emit(Opcode::Key, 0, value, isPressed);
+	} else if (!std::strcmp(name, "MouseButtonEvent")) {
+		bool isPressed = false;
+		element->QueryBoolAttribute("Down", &isPressed);
+
+		if (!queryText(element, &value) || value < BTN_MOUSE || value > BTN_TASK) {
+			return fail(element, "invalid button");
+		}
+
+		keys_->set(value);
+		emit(Opcode::Key, 0, value, isPressed);
+	} else if (!std::strcmp(name, "MouseMoveEvent")) {
+		int x = 0, y = 0;
+		element->QueryIntAttribute("X", &x);
+		element->QueryIntAttribute("Y", &y);
+
+		/* both axes are reported in the same frame */
+		if (x) {
+			emit(Opcode::Rel, y != 0, REL_X, x);
+		}
+
+		if (y) {
+			emit(Opcode::Rel, 0, REL_Y, y);
+		}
+	} else if (!std::strcmp(name, "MouseWheelEvent")) {
+		bool isHorizontal = false;
+		element->QueryBoolAttribute("Horizontal", &isHorizontal);
+
+		if (!queryText(element, &value)) {
+			return fail(element, "invalid wheel movement");
+		}
+
+		emit(Opcode::Rel, 0, isHorizontal ? REL_HWHEEL : REL_WHEEL, value);
+	} else if (!std::strcmp(name, "DelayEvent")) {
+		/* delays are given in milliseconds, recorded pointer motion uses microseconds */
+		const char *unit = element->Attribute("Unit");
+		int scale = unit && !std::strcmp(unit, "us") ? 1 : 1000;
+
+		if (!queryText(element, &value) || value < 0 || value > INT32_MAX / scale
+				|| (unit && scale != 1 && std::strcmp(unit, "ms"))) {
+			return fail(element, "invalid delay");
+		}
+
+		emit(Opcode::Delay, 0, 0, value * scale);
+	} else if (!std::strcmp(name, "Set") || !std::strcmp(name, "Add")) {
+		if (!queryRegister(element, &reg) || !queryText(element, &value)) {
+			return fail(element, "invalid register or value");
+		}
+
+		emit(name[0] == 'S' ? Opcode::Set : Opcode::Add, reg, 0, value);
+	} else if (!std::strcmp(name, "TextEvent")) {
+		return compileText(element);
+	} else if (!std::strcmp(name, "Loop")) {
+		return compileLoop(element);
+	} else if (!std::strcmp(name, "While")) {
+		if (!queryRegister(element, &reg)) {
+			return fail(element, "invalid register");
+		}
+
+		int start = program_->size();
+		emit(Opcode::JumpIfZero, reg, 0, 0);
+
+		if (!compileBlock(element)) {
+			return false;
+		}
+
+		emit(Opcode::Jump, 0, 0, start);
+		(*program_)[start].value = program_->size();
+	} else if (!std::strcmp(name, "If")) {
+		int check = program_->size();
+
+		if (element->QueryIntAttribute("Profile", &value) == tinyxml2::XML_SUCCESS) {
+			/* profiles are counted from 1 in macro files */
+			if (value < 1 || value > MAX_KEYCODE) {
+				return fail(element, "invalid profile");
+			}
+
+			emit(Opcode::JumpUnlessProfile, 0, value - 1, 0);
+		} else if (queryRegister(element, &reg)) {
+			emit(Opcode::JumpIfZero, reg, 0, 0);
+		} else {
+			return fail(element, "missing condition");
+		}
+
+		if (!compileBlock(element)) {
+			return false;
+		}
+
+		(*program_)[check].value = program_->size();
+	} else if (!std::strcmp(name, "WaitRelease")) {
+		emit(Opcode::WaitRelease, 0, 0, 0);
+	} else if (!std::strcmp(name, "Call")) {
+		int profile = 0;
+
+		if (element->QueryIntAttribute("Key", &value) != tinyxml2::XML_SUCCESS || value < 1 || value > MAX_MACRO_KEYS) {
+			return fail(element, "invalid key");
+		}
+
+		if (element->Attribute("Profile")
+				&& (element->QueryIntAttribute("Profile", &profile) != tinyxml2::XML_SUCCESS
+				|| profile < 1 || profile > 0xff)) {
+			return fail(element, "invalid profile");
+		}
+
+		emit(Opcode::Call, profile, value, 0);
+	} else {
+		return fail(element, "unknown element");
+	}
+
+	return true;
+}
+
+/*
+ * <Macro Rate="200" Burst="8"> limits the events of the macro per second.
+ * Without Burst, events are spread evenly.
+ */
+bool MacroCompiler::compileRate(const tinyxml2::XMLElement *root) {
+	int rate = 0, burst = 1;
+
+	if (!root->Attribute("Rate")) {
+		return true;
+	}
+
+	if (root->QueryIntAttribute("Rate", &rate) != tinyxml2::XML_SUCCESS || rate < 1) {
+		return fail(root, "invalid rate");
+	}
+
+	if (root->Attribute("Burst")
+			&& (root->QueryIntAttribute("Burst", &burst) != tinyxml2::XML_SUCCESS
+			|| burst < 1 || burst > UINT16_MAX)) {
+		return fail(root, "invalid burst");
+	}
+
+	emit(Opcode::Rate, 0, burst, rate);
+
+	return true;
+}
+
+/*
+ * Each character becomes two input frames, pressing its modifiers and key, and
+ * releasing them again. Dead keys are followed by space. The rate is turned
+ * into delays between characters.
+ */
+bool MacroCompiler::compileText(const tinyxml2::XMLElement *element) {
+	std::string layoutName = text_.layout;
+	int rate = text_.rate;
+
+	if (element->Attribute("Layout")) {
+		layoutName = element->Attribute("Layout");
+	}
+
+	if (element->Attribute("Rate")
+			&& (element->QueryIntAttribute("Rate", &rate) != tinyxml2::XML_SUCCESS || rate < 0)) {
+		return fail(element, "invalid rate");
+	}
+
+	const KeyboardLayout *layout = KeyboardLayout::find(layoutName);
+
+	if (!layout) {
+		return fail(element, "unknown layout " + layoutName);
+	}
+
+	const char *text = element->GetText();
+
+	if (!text) {
+		return true;
+	}
+
+	bool isFirst = true;
+
+	for (uint32_t character = KeyboardLayout::decode(&text); character; character = KeyboardLayout::decode(&text)) {
+		struct KeyStroke stroke;
+
+		if (!layout->lookup(character, &stroke)) {
+			char code[16];
+			std::snprintf(code, sizeof(code), "U+%04X", character);
+
+			return fail(element, std::string("can't type ") + code + " with layout " + layoutName);
+		}
+
+		if (rate > 0 && !isFirst) {
+			emit(Opcode::Delay, 0, 0, 1000000 / rate);
+		}
+
+		isFirst = false;
+
+		emitStroke(stroke);
+
+		if (stroke.modifiers & LAYOUT_DEAD) {
+			struct KeyStroke space;
+			space.code = KEY_SPACE;
+			space.modifiers = 0;
+			emitStroke(space);
+		}
+	}
+
+	if (*text) {
+		return fail(element, "invalid UTF-8");
+	}
+
+	return true;
+}
+
+/*
+ * Frames are chained with reg = 1, see Opcode::Key.
+ */
+void MacroCompiler::emitStroke(const struct KeyStroke &stroke) {
+	int codes[3], count = 0;
+
+	if (stroke.modifiers & LAYOUT_SHIFT) {
+		codes[count++] = KEY_LEFTSHIFT;
+	}
+
+	if (stroke.modifiers & LAYOUT_ALTGR) {
+		codes[count++] = KEY_RIGHTALT;
+	}
+
+	codes[count++] = stroke.code;
+
+	for (int i = 0; i < count; i++) {
+		keys_->set(codes[i]);
+		emit(Opcode::Key, i + 1 < count, codes[i], 1);
+	}
+
+	for (int i = count - 1; i >= 0; i--) {
+		emit(Opcode::Key, i > 0, codes[i], 0);
+	}
+}
+
+/*
+ * Loop counters use the upper half of the registers, one per nesting level,
+ * so they never collide with user registers.
+ */
+bool MacroCompiler::compileLoop(const tinyxml2::XMLElement *element) {
+	int count;
+
+	if (element->QueryIntAttribute("Count", &count) != tinyxml2::XML_SUCCESS || count < 0) {
+		return fail(element, "invalid count");
+	}
+
+	if (loopDepth_ >= VM_REGISTERS - VM_USER_REGISTERS) {
+		return fail(element, "loops nested too deeply");
+	}
+
+	int reg = VM_USER_REGISTERS + loopDepth_++;
+	emit(Opcode::Set, reg, 0, count);
+	int check = program_->size();
+	emit(Opcode::JumpIfZero, reg, 0, 0);
+	int start = program_->size();
+
+	if (!compileBlock(element)) {
+		return false;
+	}
+
+	emit(Opcode::Add, reg, 0, -1);
+	emit(Opcode::JumpIfNotZero, reg, 0, start);
+	(*program_)[check].value = program_->size();
+	loopDepth_--;
+
+	return true;
+}
+
+bool MacroCompiler::queryRegister(const tinyxml2::XMLElement *element, int *reg) {
+	return element->QueryIntAttribute("Register", reg) == tinyxml2::XML_SUCCESS
+		&& *reg >= 0 && *reg < VM_USER_REGISTERS;
+}
+
+bool MacroCompiler::queryText(const tinyxml2::XMLElement *element, int *value) {
+	const char *text = element->GetText();
+	char *end;
+
+	if (!text) {
+		return false;
+	}
+
+	*value = std::strtol(text, &end, 10);
+
+	return end != text;
+}
+
+void MacroCompiler::emit(Opcode opcode, int reg, int arg, int value) {
+	struct Instruction instruction;
+	instruction.opcode = opcode;
+	instruction.reg = reg;
+	instruction.arg = arg;
+	instruction.value = value;
+	program_->push_back(instruction);
+}
+
+bool MacroCompiler::fail(const tinyxml2::XMLElement *element, std::string message) {
+	error_ = std::string(element->Name()) + ": " + message;
+
+	return false;
+}
+
+MacroCompiler::MacroCompiler(const TextSettings *text) {
+	if (text) {
+		text_ = *text;
+	} else {
+		text_.layout = "us";
+		text_.rate = 0;
+	}
+
+	loopDepth_ = 0;
+	program_ = nullptr;
+	keys_ = nullptr;
+}
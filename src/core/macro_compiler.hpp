@@ -0,0 +1,87 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef MACRO_COMPILER_CLASS_H
+#define MACRO_COMPILER_CLASS_H
+
+#include <string>
+#include <vector>
+
+#include <tinyxml2.h>
+
+#include <core/key_bitmap.hpp>
+#include <core/keyboard_layout.hpp>
+#include <core/macro_vm.hpp>
+#include <core/settings.hpp>
+
+/**
+ * Class compiling the XML macro format into bytecode for MacroVm.
+ *
+ * Macro recording writes KeyBoardEvent and DelayEvent elements, with a
+ * pointer device also the following ones:
+ *
+ * <MouseButtonEvent Down="true">272</MouseButtonEvent>
+ * 					presses a mouse button, e.g. BTN_LEFT
+ * <MouseMoveEvent X="5" Y="-3"/>	moves the pointer
+ * <MouseWheelEvent>-1</MouseWheelEvent>
+ * 					turns the wheel, Horizontal="true" turns
+ * 					the horizontal one
+ * <DelayEvent Unit="us">1500</DelayEvent>
+ * 					delays in microseconds instead of
+ * 					milliseconds
+ *
+ * Additionally, the following elements are understood:
+ *
+ * <Set Register="0">5</Set>		sets a register (0 - 7)
+ * <Add Register="0">-1</Add>		adds to a register
+ * <Loop Count="3">...</Loop>		repeats its children
+ * <While Register="0">...</While>	repeats its children, while the register
+ * 					isn't 0
+ * <If Register="0">...</If>		runs its children, if the register isn't 0
+ * <If Profile="2">...</If>		runs its children, if profile 2 is active
+ * <WaitRelease/>			waits, until the macro key is released
+ * <Call Key="3" Profile="1"/>		runs another macro, Profile is optional
+ * <TextEvent Layout="de" Rate="20">Hi</TextEvent>
+ * 					types text, Layout and Rate (characters
+ * 					per second) default to the text settings
+ */
+class MacroCompiler {
+	public:
+		/**
+		 * Compiles the children of a Macro element.
+		 * @param root Macro element
+		 * @param program receives the bytecode
+		 * @param keys receives all keys, which can be sent by the program
+		 * @return false on errors, see getError()
+		 */
+		bool compile(const tinyxml2::XMLElement *root, std::vector<Instruction> *program, KeyBitmap *keys);
+		std::string getError();
+		/**
+		 * @param text settings for TextEvent elements or nullptr for
+		 * defaults
+		 */
+		MacroCompiler(const TextSettings *text = nullptr);
+
+	private:
+		int loopDepth_;
+		std::string error_;
+		std::vector<Instruction> *program_;
+		KeyBitmap *keys_;
+		TextSettings text_;
+		bool compileBlock(const tinyxml2::XMLElement *parent);
+		bool compileElement(const tinyxml2::XMLElement *element);
+		bool compileLoop(const tinyxml2::XMLElement *element);
+		bool compileRate(const tinyxml2::XMLElement *root);
+		bool compileText(const tinyxml2::XMLElement *element);
+		void emitStroke(const struct KeyStroke &stroke);
+		bool queryRegister(const tinyxml2::XMLElement *element, int *reg);
+		bool queryText(const tinyxml2::XMLElement *element, int *value);
+		void emit(Opcode opcode, int reg, int arg, int value);
+		bool fail(const tinyxml2::XMLElement *element, std::string message);
+};
+
+#endif
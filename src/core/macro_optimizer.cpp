@@ -0,0 +1,160 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <algorithm>
+#include <set>
+
+#include <core/macro_optimizer.hpp>
+
+OptimizerReport MacroOptimizer::optimize(std::vector<Instruction> *program) const {
+	OptimizerReport report = OptimizerReport();
+
+	if (!settings_.isEnabled) {
+		return report;
+	}
+
+	std::vector<bool> targets = findTargets(*program);
+	/* keys pressed outside of the macro may be released by it, if it loops or calls other macros */
+	bool isStraight = std::none_of(program->begin(), program->end(), [](const Instruction &instruction) {
+		return isJump(instruction.opcode) || instruction.opcode == Opcode::Call;
+	});
+	std::vector<Instruction> optimized;
+	std::vector<std::size_t> positions(program->size() + 1);
+	std::set<int> pressed;
+	/* a Delay may only be merged into the previous one, if nothing jumps in between */
+	bool isMergeable = false;
+	optimized.reserve(program->size());
+
+	for (std::size_t i = 0; i < program->size(); i++) {
+		Instruction instruction = (*program)[i];
+		positions[i] = optimized.size();
+		isMergeable = isMergeable && !targets[i];
+
+		if (instruction.opcode == Opcode::Delay) {
+			int delay = quantize(instruction.value);
+			report.delay += delay - instruction.value;
+
+			if (!delay) {
+				report.sleeps++;
+			} else if (isMergeable && optimized.back().value <= INT32_MAX - delay) {
+				optimized.back().value += delay;
+				report.sleeps++;
+			} else {
+				instruction.value = delay;
+				optimized.push_back(instruction);
+				isMergeable = true;
+			}
+
+			continue;
+		}
+
+		if (instruction.opcode == Opcode::Key && isStraight) {
+			if (instruction.value) {
+				pressed.insert(instruction.arg);
+			} else if (!pressed.erase(instruction.arg)) {
+				report.events++;
+
+				continue;
+			}
+		}
+
+		optimized.push_back(instruction);
+		isMergeable = false;
+	}
+
+	positions[program->size()] = optimized.size();
+
+	for (auto &instruction : optimized) {
+		if (isJump(instruction.opcode) && instruction.value >= 0
+				&& static_cast<std::size_t>(instruction.value) < positions.size()) {
+			instruction.value = positions[instruction.value];
+		}
+	}
+
+	if (settings_.isCollapsingFrames) {
+		report.frames = collapseFrames(&optimized);
+	}
+
+	program->swap(optimized);
+	program->shrink_to_fit();
+
+	return report;
+}
+
+bool MacroOptimizer::isJump(Opcode opcode) {
+	return opcode == Opcode::Jump || opcode == Opcode::JumpIfZero
+			|| opcode == Opcode::JumpIfNotZero || opcode == Opcode::JumpUnlessProfile;
+}
+
+/*
+ * The returned vector has one more entry than the program, jumps to its end
+ * are valid.
+ */
+std::vector<bool> MacroOptimizer::findTargets(const std::vector<Instruction> &program) {
+	std::vector<bool> targets(program.size() + 1, false);
+
+	for (auto &instruction : program) {
+		if (isJump(instruction.opcode) && instruction.value >= 0
+				&& static_cast<std::size_t>(instruction.value) < targets.size()) {
+			targets[instruction.value] = true;
+		}
+	}
+
+	return targets;
+}
+
+/*
+ * The resolution is given in milliseconds, delays are microseconds. A
+ * resolution of 1 keeps sub-millisecond delays of recorded pointer motion.
+ */
+int MacroOptimizer::quantize(int delay) const {
+	if (settings_.resolution <= 1) {
+		return delay;
+	}
+
+	int64_t resolution = settings_.resolution * 1000LL;
+
+	return std::min<int64_t>((delay + resolution / 2) / resolution * resolution, INT32_MAX / resolution * resolution);
+}
+
+/*
+ * A frame ends before a key, which is already part of it, otherwise a press
+ * and its release would be reported at the same time and get lost.
+ */
+int MacroOptimizer::collapseFrames(std::vector<Instruction> *program) {
+	std::vector<bool> targets = findTargets(*program);
+	int codes[VM_FRAME_EVENTS];
+	int count = 0, collapsed = 0;
+
+	for (std::size_t i = 0; i < program->size(); i++) {
+		Instruction &instruction = (*program)[i];
+
+		if (instruction.opcode != Opcode::Key) {
+			count = 0;
+
+			continue;
+		}
+
+		codes[count++] = instruction.arg;
+		bool isLast = count == VM_FRAME_EVENTS || i + 1 == program->size()
+				|| targets[i + 1] || (*program)[i + 1].opcode != Opcode::Key
+				|| std::find(codes, codes + count, (*program)[i + 1].arg) != codes + count;
+
+		if (isLast) {
+			count = 0;
+		} else {
+			instruction.reg = 1;
+			collapsed++;
+		}
+	}
+
+	return collapsed;
+}
+
+MacroOptimizer::MacroOptimizer(const OptimizerSettings &settings) {
+	settings_ = settings;
+}
@@ -0,0 +1,57 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef MACRO_OPTIMIZER_CLASS_H
+#define MACRO_OPTIMIZER_CLASS_H
+
+#include <cstdint>
+#include <vector>
+
+#include <core/macro_vm.hpp>
+#include <core/settings.hpp>
+
+/**
+ * Struct describing, what the optimizer changed.
+ *
+ * @var events removed Key instructions
+ * @var sleeps removed Delay instructions, each one saves a system call and
+ * its timer slack
+ * @var delay change of the total delay in microseconds, caused by
+ * quantization, negative if playback got faster
+ * @var frames Key instructions, which now share an input frame with the next
+ * one
+ */
+struct OptimizerReport {
+	int events;
+	int sleeps;
+	int64_t delay;
+	int frames;
+};
+
+/**
+ * Class optimizing compiled macro programs.
+ *
+ * Delays are quantized, merged and dropped, if they end up being 0. In
+ * programs without any control flow, releases of keys, which haven't been
+ * pressed by the macro, are removed. Optionally, consecutive key events are
+ * collapsed into a single input frame. Instructions, which are jump targets,
+ * are never merged into their predecessors.
+ */
+class MacroOptimizer {
+	public:
+		OptimizerReport optimize(std::vector<Instruction> *program) const;
+		MacroOptimizer(const OptimizerSettings &settings);
+
+	private:
+		OptimizerSettings settings_;
+		static bool isJump(Opcode opcode);
+		static std::vector<bool> findTargets(const std::vector<Instruction> &program);
+		int quantize(int delay) const;
+		static int collapseFrames(std::vector<Instruction> *program);
+};
+
+#endif
@@ -0,0 +1,206 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+
+#include <linux/input.h>
+
+#include <core/macro.hpp>
+#include <core/macro_vm.hpp>
+#include <core/stats.hpp>
+
+/* TODO: interrupt and exit run() when any macro_key has been pressed */
+void MacroVm::run(std::shared_ptr<const Macro> macro) {
+	int depth = 0;
+	stack_[0].macro = macro;
+	stack_[0].pc = 0;
+
+	while (depth >= 0) {
+		Frame &frame = stack_[depth];
+		auto &program = frame.macro->getProgram();
+
+		if (frame.pc >= program.size()) {
+			frame.macro.reset();
+			depth--;
+			continue;
+		}
+
+		const Instruction &instruction = program[frame.pc++];
+
+		switch (instruction.opcode) {
+			case Opcode::End:
+				frame.pc = program.size();
+				break;
+			case Opcode::Key:
+				queue(EV_KEY, instruction.arg, instruction.value, instruction.reg);
+				break;
+			case Opcode::Rel:
+				queue(EV_REL, instruction.arg, instruction.value, instruction.reg);
+				break;
+			case Opcode::Delay:
+				flush();
+				sleep(instruction.value);
+				break;
+			case Opcode::Set:
+				registers_[instruction.reg] = instruction.value;
+				break;
+			case Opcode::Add:
+				registers_[instruction.reg] += instruction.value;
+				break;
+			case Opcode::Jump:
+				/* keeps While loops without a delay from spinning */
+				if (instruction.value < static_cast<int32_t>(frame.pc)) {
+					if (!hasWaited_) {
+						sleep(VM_MIN_LOOP_DELAY);
+					}
+
+					hasWaited_ = false;
+				}
+
+				frame.pc = instruction.value;
+				break;
+			case Opcode::JumpIfZero:
+				if (!registers_[instruction.reg]) {
+					frame.pc = instruction.value;
+				}
+
+				break;
+			case Opcode::JumpIfNotZero:
+				if (registers_[instruction.reg]) {
+					frame.pc = instruction.value;
+				}
+
+				break;
+			case Opcode::JumpUnlessProfile:
+				if (context_->getProfile() != instruction.arg) {
+					frame.pc = instruction.value;
+				}
+
+				break;
+			case Opcode::WaitRelease:
+				flush();
+				context_->waitRelease(key_);
+				/* delays after waiting count from now */
+				deadline_ = 0;
+				break;
+			case Opcode::Call: {
+				flush();
+
+				if (depth + 1 >= VM_MAX_CALL_DEPTH) {
+					break;
+				}
+
+				int profile = instruction.reg ? instruction.reg - 1 : context_->getProfile();
+				auto callee = context_->getMacro(profile, instruction.arg);
+
+				if (callee) {
+					depth++;
+					stack_[depth].macro = callee;
+					stack_[depth].pc = 0;
+				}
+
+				break;
+			}
+			case Opcode::Rate:
+				pacer_.configure(instruction.value, instruction.arg);
+				break;
+		}
+
+		/* endless loops need to end, when the keyboard goes away */
+		if (!context_->isActive()) {
+			break;
+		}
+	}
+
+	for (auto &frame : stack_) {
+		frame.macro.reset();
+	}
+
+	flush();
+}
+
+/*
+ * Input frames are sent, once they are complete or reach VM_FRAME_EVENTS.
+ */
+void MacroVm::queue(int type, int code, int value, bool isChained) {
+	struct input_event &event = frame_[frameCount_++];
+	event = input_event();
+	event.type = type;
+	event.code = code;
+	event.value = value;
+
+	if (!isChained || frameCount_ == VM_FRAME_EVENTS) {
+		flush();
+	}
+}
+
+/*
+ * Sends a pending frame, e.g. one left incomplete by a chained event before a
+ * Delay.
+ */
+void MacroVm::flush() {
+	if (frameCount_) {
+		pace(frameCount_);
+		context_->emit(frame_, frameCount_);
+		frameCount_ = 0;
+	}
+}
+
+/*
+ * Sleeps until an absolute deadline, so recorded pointer motion keeps its
+ * timing, even if sending events or waking up takes a while. After a stall,
+ * which is longer than the delay, the deadline starts over from now, so
+ * later delays aren't skipped to catch up.
+ */
+void MacroVm::sleep(int delay) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	uint64_t current = static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+	uint64_t duration = static_cast<uint64_t>(delay) * 1000;
+
+	if (!deadline_ || deadline_ + duration <= current) {
+		deadline_ = current;
+	}
+
+	deadline_ += duration;
+	hasWaited_ = hasWaited_ || delay > 0;
+	struct timespec request;
+	request.tv_sec = deadline_ / 1000000000ULL;
+	request.tv_nsec = deadline_ % 1000000000ULL;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &request, nullptr) == EINTR) {
+	}
+}
+
+/*
+ * Both the limits of the macro and the device apply, the longer wait wins.
+ */
+void MacroVm::pace(int count) {
+	TokenBucket *device = context_->getPacer();
+	uint64_t wait = pacer_.take(count);
+
+	if (device) {
+		wait = std::max(wait, device->take(count));
+	}
+
+	if (wait) {
+		Stats::increment(Counter::OutputThrottled, count);
+		TokenBucket::wait(wait);
+		deadline_ = 0;
+		hasWaited_ = true;
+	}
+}
+
+MacroVm::MacroVm(MacroContext *context, int key) : registers_() {
+	context_ = context;
+	key_ = key;
+	frameCount_ = 0;
+	deadline_ = 0;
+	hasWaited_ = false;
+}
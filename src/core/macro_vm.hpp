@@ -0,0 +1,139 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef MACRO_VM_CLASS_H
+#define MACRO_VM_CLASS_H
+
+#include <cstdint>
+#include <memory>
+
+#include <linux/input.h>
+
+#include <core/token_bucket.hpp>
+
+/* constants */
+const int VM_REGISTERS = 16;
+const int VM_USER_REGISTERS = 8;
+const int VM_MAX_CALL_DEPTH = 8;
+const int VM_FRAME_EVENTS = 8;
+const int VM_MIN_LOOP_DELAY = 1000; /**< microseconds per loop without a delay */
+
+class Macro;
+
+/**
+ * Enum class of all bytecode instructions.
+ *
+ * @var End stops the current macro
+ * @var Key sends key or button arg with state value, if reg is 1, the next
+ * Key or Rel belongs to the same input frame
+ * @var Rel moves relative axis arg by value, e.g. REL_X or REL_WHEEL, reg
+ * works like for Key
+ * @var Delay sleeps for value microseconds, measured from the scheduled time
+ * of the previous Delay, so delays don't add up
+ * @var Set sets register reg to value
+ * @var Add adds value to register reg
+ * @var Jump continues at instruction value, jumping back sleeps for
+ * VM_MIN_LOOP_DELAY, if nothing has been waited for since the last one
+ * @var JumpIfZero continues at instruction value, if register reg is 0
+ * @var JumpIfNotZero continues at instruction value, if register reg isn't 0
+ * @var JumpUnlessProfile continues at instruction value, if profile arg isn't
+ * active
+ * @var WaitRelease blocks, until the key, which started the macro, is released
+ * @var Call runs the macro of key arg, reg holds its profile + 1 or 0 for the
+ * active profile
+ * @var Rate limits the events sent from now on to value per second with a
+ * burst of arg events, on top of the limit of the device
+ */
+enum class Opcode : uint8_t {
+	End,
+	Key,
+	Delay,
+	Set,
+	Add,
+	Jump,
+	JumpIfZero,
+	JumpIfNotZero,
+	JumpUnlessProfile,
+	WaitRelease,
+	Call,
+	Rate,
+	Rel
+};
+
+/**
+ * Struct for storing a single bytecode instruction. Instructions have a fixed
+ * size of 8 bytes, so programs are compact and can be stored as they are.
+ */
+struct Instruction {
+	Opcode opcode;
+	uint8_t reg;
+	uint16_t arg;
+	int32_t value;
+};
+
+/**
+ * Interface, which connects a running macro to its keyboard.
+ */
+class MacroContext {
+	public:
+
+		/**
+		 * Sends events, which are reported together with a single
+		 * SYN_REPORT.
+		 * @param count number of events, at most VM_FRAME_EVENTS
+		 */
+		virtual void emit(const struct input_event *events, int count) = 0;
+		virtual int getProfile() = 0;
+		virtual void waitRelease(int key) = 0;
+		virtual bool isActive() = 0;
+		virtual std::shared_ptr<const Macro> getMacro(int profile, int key) = 0;
+
+		/**
+		 * Returns the rate limit shared by all macros of the device.
+		 */
+		virtual TokenBucket *getPacer() = 0;
+		virtual ~MacroContext() {}
+};
+
+/**
+ * Class representing the register based virtual machine, which runs compiled
+ * macros.
+ *
+ * All state lives inside the object, so running a macro doesn't allocate.
+ */
+class MacroVm {
+	public:
+		void run(std::shared_ptr<const Macro> macro);
+
+		/**
+		 * @param context keyboard the macro runs on
+		 * @param key macro key index, which started the macro
+		 */
+		MacroVm(MacroContext *context, int key);
+
+	private:
+		struct Frame {
+			std::shared_ptr<const Macro> macro;
+			std::size_t pc;
+		};
+
+		MacroContext *context_;
+		int key_;
+		int32_t registers_[VM_REGISTERS];
+		Frame stack_[VM_MAX_CALL_DEPTH];
+		struct input_event frame_[VM_FRAME_EVENTS];
+		int frameCount_;
+		TokenBucket pacer_;
+		uint64_t deadline_; /**< CLOCK_MONOTONIC ns of the last Delay or 0 */
+		bool hasWaited_; /**< slept or throttled since the last backward Jump */
+		void queue(int type, int code, int value, bool isChained);
+		void flush();
+		void sleep(int delay);
+		void pace(int count);
+};
+
+#endif
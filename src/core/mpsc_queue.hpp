@@ -0,0 +1,98 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef MPSC_QUEUE_CLASS_H
+#define MPSC_QUEUE_CLASS_H
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+/**
+ * Bounded, lock-free queue for multiple producers and a single consumer.
+ *
+ * Based on Dmitry Vyukov's bounded queue: every cell carries a sequence
+ * number, which tells producers and the consumer, whether the cell is free or
+ * holds data. All memory is allocated up front.
+ */
+template <typename T>
+class MpscQueue {
+	public:
+		/**
+		 * Adds an element. Safe to call from any thread.
+		 * @return false, if the queue is full
+		 */
+		bool push(const T &value) {
+			std::size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+			Cell *cell;
+
+			for (;;) {
+				cell = &cells_[pos & mask_];
+				std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+				auto diff = static_cast<std::ptrdiff_t>(seq) - static_cast<std::ptrdiff_t>(pos);
+
+				if (diff == 0) {
+					if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+						break;
+					}
+				} else if (diff < 0) {
+					return false;
+				} else {
+					pos = enqueuePos_.load(std::memory_order_relaxed);
+				}
+			}
+
+			cell->value = value;
+			cell->sequence.store(pos + 1, std::memory_order_release);
+
+			return true;
+		}
+
+		/**
+		 * Removes the oldest element. Must only be called by the consumer.
+		 * @return false, if the queue is empty
+		 */
+		bool pop(T *value) {
+			Cell *cell = &cells_[dequeuePos_ & mask_];
+			std::size_t seq = cell->sequence.load(std::memory_order_acquire);
+
+			if (seq != dequeuePos_ + 1) {
+				return false;
+			}
+
+			*value = cell->value;
+			cell->sequence.store(dequeuePos_ + mask_ + 1, std::memory_order_release);
+			dequeuePos_++;
+
+			return true;
+		}
+
+		/**
+		 * @param capacity number of elements, must be a power of 2
+		 */
+		MpscQueue(std::size_t capacity) : cells_(new Cell[capacity]), mask_(capacity - 1) {
+			for (std::size_t i = 0; i < capacity; i++) {
+				cells_[i].sequence.store(i, std::memory_order_relaxed);
+			}
+
+			enqueuePos_.store(0, std::memory_order_relaxed);
+			dequeuePos_ = 0;
+		}
+
+	private:
+		struct Cell {
+			std::atomic<std::size_t> sequence;
+			T value;
+		};
+
+		std::unique_ptr<Cell[]> cells_;
+		const std::size_t mask_;
+		std::atomic<std::size_t> enqueuePos_;
+		std::size_t dequeuePos_;
+};
+
+#endif
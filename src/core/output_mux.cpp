@@ -0,0 +1,414 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <algorithm>
+#include <cerrno>
+#include <ctime>
+
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include <core/output_mux.hpp>
+#include <core/realtime.hpp>
+#include <core/stats.hpp>
+
+/* constants */
+constexpr auto QUEUE_SIZE =	1024;
+constexpr auto MAX_BACKLOG =	4096;
+
+int OutputMux::addDevice(struct Device *device, const KeyBitmap &keys, bool hasMotion) {
+	std::unique_ptr<VirtualInput> virtInput(new VirtualInput(device, keys, hasMotion, process_));
+	std::lock_guard<std::mutex> lock(devicesMutex_);
+	int handle = nextHandle_++;
+	devices_[handle] = std::move(virtInput);
+
+	return handle;
+}
+
+/*
+ * Frames, which are still queued for a removed device, are dropped by the
+ * writer.
+ */
+void OutputMux::removeDevice(int handle) {
+	std::lock_guard<std::mutex> lock(devicesMutex_);
+	devices_.erase(handle);
+}
+
+KeyBitmap OutputMux::getKeys(int handle) {
+	std::lock_guard<std::mutex> lock(devicesMutex_);
+	auto it = devices_.find(handle);
+
+	return it != devices_.end() ? it->second->getKeys() : KeyBitmap();
+}
+
+bool OutputMux::hasMotion(int handle) {
+	std::lock_guard<std::mutex> lock(devicesMutex_);
+	auto it = devices_.find(handle);
+
+	return it != devices_.end() && it->second->hasMotion();
+}
+
+/*
+ * A full queue blocks the producer instead of spinning, a spinning producer
+ * with a higher priority could keep the writer from ever draining the queue.
+ * isFull_ is set, before pushing again, so the writer either sees it after
+ * its next pop or the push succeeds.
+ */
+void OutputMux::submit(struct OutputFrame *frame) {
+	if (!queue_.push(*frame)) {
+		std::unique_lock<std::mutex> lock(spaceMutex_);
+
+		while (true) {
+			isFull_ = true;
+
+			if (queue_.push(*frame)) {
+				break;
+			}
+
+			/* a stopped writer never drains the queue again */
+			if (!isRunning_) {
+				Stats::increment(Counter::OutputDropped, frame->count);
+
+				return;
+			}
+
+			wake();
+			spaceCond_.wait(lock);
+		}
+	}
+
+	/* pairs with the fence in run(), so no wakeup gets lost */
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+
+	if (isSleeping_) {
+		wake();
+	}
+}
+
+void OutputMux::sendEvent(int handle, short type, short code, int value) {
+	struct OutputFrame frame;
+	frame.timestamp = getTimestamp();
+	frame.device = handle;
+	frame.count = 1;
+	frame.isPassthrough = false;
+	frame.events[0] = input_event();
+	frame.events[0].type = type;
+	frame.events[0].code = code;
+	frame.events[0].value = value;
+	submit(&frame);
+}
+
+uint64_t OutputMux::getTimestamp() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+}
+
+void OutputMux::start() {
+	isRunning_ = true;
+	writer_ = std::thread(&OutputMux::run, this);
+}
+
+void OutputMux::stop() {
+	isRunning_ = false;
+	wake();
+
+	{
+		/* blocked producers drop their frames */
+		std::lock_guard<std::mutex> lock(spaceMutex_);
+		spaceCond_.notify_all();
+	}
+
+	if (writer_.joinable()) {
+		writer_.join();
+	}
+}
+
+void OutputMux::run() {
+	struct OutputFrame frame;
+	/* the writer is part of the input path */
+	Realtime::setupThread(ThreadRole::Input);
+
+	while (isRunning_) {
+		while (batch_.size() < QUEUE_SIZE && queue_.pop(&frame)) {
+			batch_.push_back(frame);
+		}
+
+		notifySpace();
+
+		if (!batch_.empty()) {
+			flush();
+
+			/* devices with backlogs are checked without waiting */
+			if (!backlogs_.empty()) {
+				waitIo(0);
+			}
+
+			continue;
+		}
+
+		isSleeping_ = true;
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+
+		/* check again, a producer might have missed isSleeping_ */
+		if (queue_.pop(&frame)) {
+			isSleeping_ = false;
+			batch_.push_back(frame);
+			notifySpace();
+			continue;
+		}
+
+		waitIo(-1);
+		isSleeping_ = false;
+	}
+}
+
+/*
+ * Frames of one producer are queued in order already, sorting merges frames of
+ * different producers. Each run of frames for the same device is written with
+ * a single write. buffer_ and writes_ never reallocate, as they have been
+ * reserved for a full batch, so queued writes can point into them until they
+ * are flushed. Backlogs may allocate, they are handled after the hot path.
+ */
+void OutputMux::flush() {
+	std::lock_guard<std::mutex> lock(devicesMutex_);
+
+	{
+		HotPath hotPath;
+		sortBatch();
+		queueWrites();
+		io_->flushWrites();
+	}
+
+	for (auto &write : writes_) {
+		if (write.fd < 0) {
+			append(&backlogs_[write.device], write.events, write.count);
+		} else {
+			complete(write);
+		}
+	}
+
+	uint64_t now = getTimestamp();
+
+	for (auto &frame : batch_) {
+		if (frame.isPassthrough) {
+			Stats::record(Histogram::Passthrough, std::chrono::nanoseconds(now - frame.timestamp));
+		}
+	}
+
+	buffer_.clear();
+	batch_.clear();
+	writes_.clear();
+}
+
+/*
+ * Batches are nearly sorted, so an insertion sort is fast, doesn't allocate
+ * and keeps frames with the same timestamp in order.
+ */
+void OutputMux::sortBatch() {
+	for (std::size_t i = 1; i < batch_.size(); i++) {
+		if (batch_[i].timestamp >= batch_[i - 1].timestamp) {
+			continue;
+		}
+
+		struct OutputFrame frame = batch_[i];
+		std::size_t j = i;
+
+		for (; j > 0 && batch_[j - 1].timestamp > frame.timestamp; j--) {
+			batch_[j] = batch_[j - 1];
+		}
+
+		batch_[j] = frame;
+	}
+}
+
+/*
+ * Must be called with devicesMutex_ held. Events of devices with a backlog
+ * aren't written, they get a write without file descriptor, which is appended
+ * to the backlog instead, so the order is kept.
+ */
+void OutputMux::queueWrites() {
+	std::size_t runStart = 0;
+
+	for (std::size_t i = 0; i < batch_.size(); i++) {
+		auto &current = batch_[i];
+		buffer_.insert(buffer_.end(), current.events, current.events + std::min(current.count, MAX_FRAME_EVENTS));
+
+		bool isLast = i + 1 == batch_.size();
+		bool isSameDevice = !isLast && batch_[i + 1].device == current.device;
+
+		/* frames with the same timestamp share a single SYN_REPORT */
+		if (!isSameDevice || batch_[i + 1].timestamp != current.timestamp) {
+			struct input_event syn = input_event();
+			syn.type = EV_SYN;
+			syn.code = SYN_REPORT;
+			buffer_.push_back(syn);
+		}
+
+		if (!isSameDevice) {
+			auto it = devices_.find(current.device);
+			auto backlog = backlogs_.find(current.device);
+
+			if (backlog != backlogs_.end() || it != devices_.end()) {
+				struct PendingWrite write;
+				write.device = current.device;
+				write.fd = backlog != backlogs_.end() ? -1 : it->second->getFd();
+				write.events = buffer_.data() + runStart;
+				write.count = buffer_.size() - runStart;
+				write.result = 0;
+				writes_.push_back(write);
+
+				if (write.fd >= 0) {
+					io_->queueWrite(write.fd, write.events, write.count * sizeof(struct input_event), &writes_.back().result);
+				}
+			}
+
+			runStart = buffer_.size();
+		}
+	}
+}
+
+/*
+ * uinput takes whole events only. Events of writes, which failed with EAGAIN
+ * or have been cut short, go to the backlog of their device. Events of other
+ * failed writes are dropped.
+ */
+void OutputMux::complete(const PendingWrite &write) {
+	int result = write.result;
+	std::size_t written = std::max(result, 0) / sizeof(struct input_event);
+
+	if (written == write.count) {
+		return;
+	}
+
+	if (result < 0 && result != -EAGAIN && result != -EINTR) {
+		Stats::increment(Counter::OutputDropped, write.count - written);
+
+		return;
+	}
+
+	auto it = backlogs_.find(write.device);
+
+	if (it == backlogs_.end()) {
+		int slot = io_->addWatcher(write.fd);
+
+		if (slot < 0) {
+			Stats::increment(Counter::OutputDropped, write.count - written);
+
+			return;
+		}
+
+		it = backlogs_.insert(std::make_pair(write.device, Backlog())).first;
+		it->second.fd = write.fd;
+		it->second.slot = slot;
+	}
+
+	Stats::increment(Counter::OutputRetried);
+	append(&it->second, write.events + written, write.count - written);
+}
+
+void OutputMux::waitIo(int timeout) {
+	struct IoCompletion completions[IO_MAX_SLOTS];
+	int count = io_->wait(completions, IO_MAX_SLOTS, timeout);
+
+	for (int i = 0; i < count; i++) {
+		if (completions[i].slot == wakeSlot_) {
+			Stats::increment(Counter::WakeupOutput);
+		} else {
+			drain(completions[i].slot);
+		}
+	}
+}
+
+/*
+ * Writes as much of a backlog as the device takes. Backlogs of removed devices
+ * are dropped, so their file descriptors aren't used anymore.
+ */
+void OutputMux::drain(int slot) {
+	auto it = backlogs_.begin();
+
+	while (it != backlogs_.end() && it->second.slot != slot) {
+		++it;
+	}
+
+	if (it == backlogs_.end()) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(devicesMutex_);
+	Backlog &backlog = it->second;
+	auto device = devices_.find(it->first);
+	int result = -ENODEV;
+
+	if (device != devices_.end() && device->second->getFd() == backlog.fd) {
+		ssize_t size = ::write(backlog.fd, backlog.events.data(), backlog.events.size() * sizeof(struct input_event));
+		result = size < 0 ? -errno : size;
+	}
+
+	if (result < 0 && result != -EAGAIN && result != -EINTR) {
+		Stats::increment(Counter::OutputDropped, backlog.events.size());
+		backlog.events.clear();
+	} else if (result > 0) {
+		backlog.events.erase(backlog.events.begin(), backlog.events.begin() + result / sizeof(struct input_event));
+	}
+
+	if (backlog.events.empty()) {
+		io_->removeReader(slot);
+		backlogs_.erase(it);
+	}
+}
+
+/*
+ * Backlogs are limited, events beyond the limit are dropped.
+ */
+void OutputMux::append(Backlog *backlog, const struct input_event *events, std::size_t count) {
+	std::size_t space = MAX_BACKLOG - std::min<std::size_t>(backlog->events.size(), MAX_BACKLOG);
+	std::size_t kept = std::min(count, space);
+	backlog->events.insert(backlog->events.end(), events, events + kept);
+
+	if (kept < count) {
+		Stats::increment(Counter::OutputDropped, count - kept);
+	}
+}
+
+/*
+ * Wakes up producers blocked on a full queue, after frames have been popped.
+ */
+void OutputMux::notifySpace() {
+	if (isFull_) {
+		std::lock_guard<std::mutex> lock(spaceMutex_);
+		isFull_ = false;
+		spaceCond_.notify_all();
+	}
+}
+
+void OutputMux::wake() {
+	uint64_t wake = 1;
+	write(wakeFd_, &wake, sizeof(wake));
+}
+
+OutputMux::OutputMux(const Settings *settings, Process *process) : queue_(QUEUE_SIZE) {
+	process_ = process;
+	nextHandle_ = 0;
+	isRunning_ = false;
+	isSleeping_ = false;
+	isFull_ = false;
+	wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	batch_.reserve(QUEUE_SIZE);
+	buffer_.reserve(QUEUE_SIZE * (MAX_FRAME_EVENTS + 1));
+	writes_.reserve(QUEUE_SIZE);
+	io_ = IoEngine::create(settings->isUringPreferred);
+	/* wakes up the writer, which waits on the I/O engine */
+	wakeSlot_ = io_->addReader(wakeFd_, sizeof(uint64_t));
+}
+
+OutputMux::~OutputMux() {
+	stop();
+	close(wakeFd_);
+}
@@ -0,0 +1,162 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef OUTPUT_MUX_CLASS_H
+#define OUTPUT_MUX_CLASS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <linux/input.h>
+
+#include <process.hpp>
+#include <core/device.hpp>
+#include <core/io_engine.hpp>
+#include <core/key_bitmap.hpp>
+#include <core/mpsc_queue.hpp>
+#include <core/settings.hpp>
+#include <core/virtual_input.hpp>
+
+/* constants */
+const int MAX_FRAME_EVENTS = 8;
+
+/**
+ * Struct for passing a group of events to the output stage.
+ *
+ * Events of a frame are reported together, followed by a single SYN_REPORT.
+ * Consecutive frames for the same device with the same timestamp share their
+ * SYN_REPORT.
+ *
+ * @var timestamp CLOCK_MONOTONIC time in nanoseconds, used for ordering
+ * @var device handle returned by OutputMux::addDevice()
+ * @var count number of valid entries in events
+ * @var isPassthrough events come from a grabbed input device, timestamp is
+ * their input time and the latency until they are written is recorded
+ */
+struct OutputFrame {
+	uint64_t timestamp;
+	int device;
+	int count;
+	bool isPassthrough;
+	struct input_event events[MAX_FRAME_EVENTS];
+};
+
+/**
+ * Class representing the central output stage.
+ *
+ * All producers, e.g. macro playback threads of any keyboard, submit frames to
+ * a lock-free queue. A single writer thread merges them in timestamp order and
+ * writes them to the virtual input devices it owns, using one write per
+ * device and batch. Writes of a batch are submitted together by the I/O engine.
+ * Events of a device, which isn't writable, are kept back, until the I/O
+ * engine reports it writable again, so other devices keep draining.
+ */
+class OutputMux {
+	public:
+		/**
+		 * Creates a virtual input device owned by the output stage.
+		 * @param device device to mimic or nullptr for a shared device
+		 * @param hasMotion advertise relative axes for pointer motion
+		 * and wheels
+		 * @return device handle
+		 */
+		int addDevice(struct Device *device, const KeyBitmap &keys, bool hasMotion);
+		void removeDevice(int handle);
+
+		/**
+		 * Returns the keys advertised by a device. Events of other keys
+		 * are skipped by the kernel.
+		 */
+		KeyBitmap getKeys(int handle);
+
+		/**
+		 * Returns, whether a device advertises relative axes.
+		 */
+		bool hasMotion(int handle);
+
+		/**
+		 * Submits a frame. Blocks, while the queue is full, until the
+		 * writer has made room. Frames are dropped, once the writer has
+		 * been stopped.
+		 */
+		void submit(struct OutputFrame *frame);
+
+		/**
+		 * Convenience wrapper, submitting a frame with a single event.
+		 */
+		void sendEvent(int handle, short type, short code, int value);
+		static uint64_t getTimestamp();
+		void start();
+		void stop();
+		OutputMux(const Settings *settings, Process *process);
+		~OutputMux();
+
+	private:
+		/**
+		 * Struct describing a write of a batch.
+		 */
+		struct PendingWrite {
+			int device;
+			int fd; /**< -1, if the events go to the backlog */
+			const struct input_event *events;
+			std::size_t count;
+			int result; /**< see IoEngine::queueWrite() */
+		};
+
+		/**
+		 * Struct holding the events of a device, which weren't written
+		 * yet. Newer events of the device are appended, so the order is
+		 * kept.
+		 */
+		struct Backlog {
+			int fd;
+			int slot; /**< watcher slot of the I/O engine */
+			std::vector<struct input_event> events;
+		};
+
+		int wakeFd_;
+		int wakeSlot_;
+		int nextHandle_;
+		std::atomic<bool> isRunning_;
+		std::atomic<bool> isSleeping_;
+		std::atomic<bool> isFull_; /**< producers are waiting for room */
+		std::mutex spaceMutex_;
+		std::condition_variable spaceCond_;
+		std::thread writer_;
+		std::mutex devicesMutex_;
+		std::map<int, std::unique_ptr<VirtualInput>> devices_;
+		MpscQueue<OutputFrame> queue_;
+		std::vector<OutputFrame> batch_;
+		std::vector<struct input_event> buffer_;
+		std::vector<PendingWrite> writes_;
+		std::map<int, Backlog> backlogs_; /**< by device handle */
+		std::unique_ptr<IoEngine> io_;
+		Process *process_;
+		void run();
+		void flush();
+		void sortBatch();
+		void queueWrites();
+		void complete(const PendingWrite &write);
+
+		/**
+		 * Waits for a wakeup or writable devices with backlogs.
+		 * @param timeout timeout in milliseconds, -1 waits forever
+		 */
+		void waitIo(int timeout);
+		void drain(int slot);
+		void append(Backlog *backlog, const struct input_event *events, std::size_t count);
+		void notifySpace();
+		void wake();
+};
+
+#endif
@@ -0,0 +1,267 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <core/key.hpp>
+#include <core/profile.hpp>
+#include <core/stats.hpp>
+
+typedef std::pair<uint32_t, std::shared_ptr<const Macro>> Entry;
+
+static bool compareSlot(const Entry &entry, uint32_t slot) {
+	return entry.first < slot;
+}
+
+std::shared_ptr<const Macro> Profile::getMacro(int layer, int key) const {
+	auto slot = getSlot(layer, key);
+	auto it = std::lower_bound(macros_.begin(), macros_.end(), slot, compareSlot);
+
+	if (it == macros_.end() || it->first != slot) {
+		return nullptr;
+	}
+
+	return it->second;
+}
+
+bool Profile::isBound(int layer, int key) const {
+	if (key < 1 || key > MAX_MACRO_KEYS) {
+		return false;
+	}
+
+	return !isScanned_ || (bound_[layer] >> (key - 1)) & 1;
+}
+
+void Profile::load() {
+	unload();
+
+	for (int layer = 0; layer < layers_; layer++) {
+		loadLayer(layer);
+	}
+
+	std::sort(macros_.begin(), macros_.end(),
+		[](const Entry &a, const Entry &b) { return a.first < b.first; });
+	macros_.shrink_to_fit();
+	isLoaded_ = true;
+	isScanned_ = true;
+}
+
+void Profile::unload() {
+	macros_.clear();
+	macros_.shrink_to_fit();
+	memoryUsage_ = 0;
+	isLoaded_ = false;
+}
+
+void Profile::reload(int layer, int key) {
+	if (bundle_) {
+		std::clog << "Macro " << Key::getMacroName(key) << " overrides the profile bundle until it is packed again." << std::endl;
+	}
+
+	/* unloaded profiles read the file on next load, just forget it's unbound */
+	if (!isLoaded_) {
+		bound_[layer] |= Key::getMacroName(key) ? 1U << (key - 1) : 0;
+
+		return;
+	}
+
+	openDir(layer);
+	auto slot = getSlot(layer, key);
+	auto it = std::lower_bound(macros_.begin(), macros_.end(), slot, compareSlot);
+
+	if (it != macros_.end() && it->first == slot) {
+		memoryUsage_ -= it->second->getMemoryUsage();
+		macros_.erase(it);
+	}
+
+	if (loadMacro(layer, key, false)) {
+		std::sort(macros_.begin(), macros_.end(),
+			[](const Entry &a, const Entry &b) { return a.first < b.first; });
+		const OptimizerReport &report = getMacro(layer, key)->getReport();
+
+		if (report.events || report.sleeps) {
+			std::clog << "Optimized macro " << Key::getMacroName(key) << ": removed " << report.events
+					<< " key events and " << report.sleeps << " delays" << std::endl;
+		}
+	}
+}
+
+bool Profile::isLoaded() const {
+	return isLoaded_;
+}
+
+KeyBitmap Profile::getKeys() const {
+	KeyBitmap keys = KeyBitmap();
+
+	for (auto &entry : macros_) {
+		keys |= entry.second->getKeys();
+	}
+
+	return keys;
+}
+
+bool Profile::hasMotion() const {
+	for (auto &entry : macros_) {
+		if (entry.second->hasMotion()) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+std::size_t Profile::getMemoryUsage() const {
+	return sizeof(Profile) + memoryUsage_ + macros_.capacity() * sizeof(Entry);
+}
+
+/*
+ * Directories, which have been removed since they were opened, are opened
+ * again. Missing directories are retried on the next call.
+ */
+int Profile::openDir(int layer) {
+	struct stat st;
+
+	if (dirFds_[layer] >= 0 && (fstatat(dirFds_[layer], "", &st, AT_EMPTY_PATH) || !st.st_nlink)) {
+		close(dirFds_[layer]);
+		dirFds_[layer] = -1;
+	}
+
+	if (dirFds_[layer] < 0) {
+		std::string path = "profile_" + std::to_string(index_ + 1);
+
+		if (layer) {
+			path += "/layer_" + std::to_string(layer);
+		}
+
+		dirFds_[layer] = openat(AT_FDCWD, path.c_str(), O_PATH | O_DIRECTORY | O_CLOEXEC);
+	}
+
+	return dirFds_[layer];
+}
+
+/*
+ * Loads a macro file or a macro of the bundle and updates the bound keys.
+ * Macros, which can't be compiled, count as unbound.
+ */
+bool Profile::loadMacro(int layer, int key, bool isBundled) {
+	const char *name = Key::getMacroName(key);
+	uint32_t bit = name ? 1U << (key - 1) : 0;
+	bound_[layer] &= ~bit;
+	auto macro = std::make_shared<Macro>();
+
+	if (!name) {
+		return false;
+	} else if (isBundled) {
+		std::string source = bundle_->getSource(index_, layer, key);
+
+		/*
+		 * Text depends on the keyboard layout of the daemon's text
+		 * settings, so it's compiled from the source instead.
+		 */
+		if (source.find("<TextEvent") != std::string::npos) {
+			tinyxml2::XMLDocument xmlDoc;
+			xmlDoc.Parse(source.c_str(), source.size());
+
+			if (!macro->compile(&xmlDoc, name, &optimizer_, &text_)) {
+				return false;
+			}
+		} else if (!bundle_->getMacro(index_, layer, key, macro.get(), &optimizer_)) {
+			return false;
+		}
+	} else {
+		struct stat st;
+
+		if (dirFds_[layer] < 0 || fstatat(dirFds_[layer], name, &st, 0) || !S_ISREG(st.st_mode)) {
+			return false;
+		}
+
+		if (!macro->loadAt(dirFds_[layer], name, &optimizer_, &text_)) {
+			return false;
+		}
+	}
+
+	const OptimizerReport &report = macro->getReport();
+
+	if (report.events) {
+		Stats::increment(Counter::MacroEventsRemoved, report.events);
+	}
+
+	if (report.sleeps) {
+		Stats::increment(Counter::MacroSleepsRemoved, report.sleeps);
+	}
+
+	if (report.delay) {
+		Stats::increment(Counter::MacroDelayChanged, report.delay < 0 ? -report.delay : report.delay);
+	}
+
+	if (report.frames) {
+		Stats::increment(Counter::MacroFramesCollapsed, report.frames);
+	}
+
+	memoryUsage_ += macro->getMemoryUsage();
+	macros_.push_back(Entry(getSlot(layer, key), macro));
+	bound_[layer] |= bit;
+
+	return true;
+}
+
+/*
+ * Looks up all macro files of a profile or layer directory. Macro files are
+ * named s<index>.xml. With a bundle, only macro files recorded after packing
+ * are loaded from the directory, if it exists.
+ */
+void Profile::loadLayer(int layer) {
+	bool isDir = openDir(layer) >= 0;
+
+	for (int key = 1; key <= MAX_MACRO_KEYS; key++) {
+		loadMacro(layer, key, bundle_ && !(isDir && isRecorded(layer, key)));
+	}
+}
+
+bool Profile::isRecorded(int layer, int key) {
+	const char *name = Key::getMacroName(key);
+	const struct timespec &packed = bundle_->getMtime();
+	struct stat st;
+
+	if (!name || fstatat(dirFds_[layer], name, &st, 0) || !S_ISREG(st.st_mode)) {
+		return false;
+	}
+
+	return st.st_mtim.tv_sec > packed.tv_sec
+		|| (st.st_mtim.tv_sec == packed.tv_sec && st.st_mtim.tv_nsec > packed.tv_nsec);
+}
+
+uint32_t Profile::getSlot(int layer, int key) {
+	return (static_cast<uint32_t>(layer) << 16) | static_cast<uint16_t>(key);
+}
+
+Profile::Profile(int index, int layers, const OptimizerSettings &optimizer, const TextSettings &text, const ProfileBundle *bundle) : optimizer_(optimizer) {
+	index_ = index;
+	text_ = text;
+	bundle_ = bundle;
+	layers_ = layers;
+	isLoaded_ = false;
+	isScanned_ = false;
+	memoryUsage_ = 0;
+	dirFds_.resize(layers_, -1);
+	bound_.resize(layers_, 0);
+}
+
+Profile::~Profile() {
+	for (auto fd : dirFds_) {
+		if (fd >= 0) {
+			close(fd);
+		}
+	}
+}
@@ -0,0 +1,108 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef PROFILE_CLASS_H
+#define PROFILE_CLASS_H
+
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include <core/macro.hpp>
+#include <core/macro_optimizer.hpp>
+#include <core/profile_bundle.hpp>
+#include <core/settings.hpp>
+
+/**
+ * Class holding the in-memory macro table of a single profile.
+ *
+ * Only bound keys are stored. Entries are kept in a vector sorted by layer and
+ * key, so lookups are a binary search over contiguous memory. Profiles aren't
+ * thread-safe on their own, see ProfileCache.
+ *
+ * Profile and layer directories are opened once as O_PATH descriptors, macro
+ * files are looked up relative to them by their precomputed names. Which keys
+ * are bound is remembered across unload(), so unbound keys never cause a
+ * reload. With a profile bundle, macros are taken from the bundle instead.
+ */
+class Profile {
+	public:
+		/**
+		 * Returns the macro bound to a key or nullptr, if the key is unbound.
+		 * @param layer layer index, counted from 0
+		 * @param key macro key index
+		 */
+		std::shared_ptr<const Macro> getMacro(int layer, int key) const;
+
+		/**
+		 * Returns false, if the key is known to be unbound. Works for
+		 * unloaded profiles, once they have been loaded before.
+		 */
+		bool isBound(int layer, int key) const;
+
+		/**
+		 * Reads all macro files of this profile into memory.
+		 */
+		void load();
+
+		/**
+		 * Drops all macros of this profile.
+		 */
+		void unload();
+
+		/**
+		 * Re-reads a single macro file, e.g. after it has been re-recorded.
+		 * Unloaded profiles read it on their next load. The file is read
+		 * from the profile directory, even with a bundle.
+		 */
+		void reload(int layer, int key);
+		bool isLoaded() const;
+
+		/**
+		 * Returns all keys, which are sent by macros of this profile.
+		 */
+		KeyBitmap getKeys() const;
+
+		/**
+		 * Returns, whether any macro of this profile moves the pointer or
+		 * wheels.
+		 */
+		bool hasMotion() const;
+		std::size_t getMemoryUsage() const;
+		/**
+		 * @param bundle profile bundle or nullptr for profile directories,
+		 * must outlive the profile
+		 */
+		Profile(int index, int layers, const OptimizerSettings &optimizer, const TextSettings &text, const ProfileBundle *bundle = nullptr);
+		~Profile();
+
+	private:
+		int index_;
+		int layers_;
+		bool isLoaded_;
+		bool isScanned_;
+		std::size_t memoryUsage_;
+		MacroOptimizer optimizer_;
+		TextSettings text_;
+		const ProfileBundle *bundle_;
+		std::vector<std::pair<uint32_t, std::shared_ptr<const Macro>>> macros_;
+		std::vector<int> dirFds_; /**< O_PATH descriptors, one per layer */
+		std::vector<uint32_t> bound_; /**< bound keys, one bitmap per layer */
+		int openDir(int layer);
+		bool loadMacro(int layer, int key, bool isBundled);
+		void loadLayer(int layer);
+
+		/**
+		 * Checks, whether a macro file has been recorded after the bundle
+		 * was packed.
+		 */
+		bool isRecorded(int layer, int key);
+		static uint32_t getSlot(int layer, int key);
+};
+
+#endif
@@ -0,0 +1,267 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <core/key.hpp>
+#include <core/profile_bundle.hpp>
+
+/* constants */
+constexpr auto MAX_BUNDLE_PROFILES =	0xffff;
+constexpr auto MAX_BUNDLE_SIZE =	0xffffffffULL;
+
+bool ProfileBundle::open(std::string path) {
+	close();
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		/* bundles are optional */
+		if (errno != ENOENT) {
+			std::cerr << "Can't open profile bundle " << path << std::endl;
+		}
+
+		return false;
+	}
+
+	struct stat info;
+
+	if (fstat(fd, &info) || static_cast<std::size_t>(info.st_size) < sizeof(Header)) {
+		std::cerr << "Invalid profile bundle " << path << std::endl;
+		::close(fd);
+
+		return false;
+	}
+
+	void *data = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+
+	if (data == MAP_FAILED) {
+		std::cerr << "Can't map profile bundle " << path << std::endl;
+
+		return false;
+	}
+
+	data_ = static_cast<const uint8_t *>(data);
+	size_ = info.st_size;
+	device_ = info.st_dev;
+	inode_ = info.st_ino;
+	mtime_ = info.st_mtim;
+	header_ = reinterpret_cast<const Header *>(data_);
+	index_ = reinterpret_cast<const Entry *>(data_ + sizeof(Header));
+
+	if (!isValid()) {
+		std::cerr << "Invalid profile bundle " << path << std::endl;
+		close();
+
+		return false;
+	}
+
+	return true;
+}
+
+bool ProfileBundle::isOpen() const {
+	return data_ != nullptr;
+}
+
+bool ProfileBundle::isCurrent(std::string path) const {
+	struct stat info;
+
+	return isOpen() && !stat(path.c_str(), &info) && info.st_dev == device_ && info.st_ino == inode_;
+}
+
+const struct timespec &ProfileBundle::getMtime() const {
+	return mtime_;
+}
+
+int ProfileBundle::getProfileCount() const {
+	return isOpen() ? header_->profiles : 0;
+}
+
+int ProfileBundle::getLayerCount() const {
+	return isOpen() ? header_->layers : 0;
+}
+
+bool ProfileBundle::isBound(int profile, int layer, int key) const {
+	return find(profile, layer, key) != nullptr;
+}
+
+/*
+ * Programs are copied out of the mapping, so macros stay valid, when the
+ * bundle gets replaced while they are playing.
+ */
+bool ProfileBundle::getMacro(int profile, int layer, int key, Macro *macro, const MacroOptimizer *optimizer) const {
+	const Entry *entry = find(profile, layer, key);
+
+	if (!entry) {
+		return false;
+	}
+
+	/* the stored key bitmap is skipped, Macro takes keys from the program */
+	auto program = reinterpret_cast<const Instruction *>(data_ + entry->program + sizeof(KeyBitmap));
+
+	return macro->assign(program, entry->count, optimizer);
+}
+
+std::string ProfileBundle::getSource(int profile, int layer, int key) const {
+	const Entry *entry = find(profile, layer, key);
+
+	if (!entry) {
+		return std::string();
+	}
+
+	return std::string(reinterpret_cast<const char *>(data_ + entry->source), entry->length);
+}
+
+/*
+ * Sections are padded to 8 bytes, so programs can be used in place.
+ */
+bool ProfileBundle::write(std::string path, int profiles, int layers, const std::vector<BundleMacro> &macros) {
+	if (profiles < 1 || profiles > MAX_BUNDLE_PROFILES || layers < 1 || layers > MAX_BUNDLE_PROFILES) {
+		std::cerr << "Invalid number of profiles or layers for " << path << std::endl;
+
+		return false;
+	}
+
+	std::vector<Entry> index(static_cast<std::size_t>(profiles) * layers * MAX_MACRO_KEYS, Entry());
+	std::string body;
+	uint64_t base = sizeof(Header) + index.size() * sizeof(Entry);
+
+	for (auto &macro : macros) {
+		if (macro.profile < 0 || macro.profile >= profiles || macro.layer < 0 || macro.layer >= layers
+				|| macro.key < 1 || macro.key > MAX_MACRO_KEYS || macro.program.empty()) {
+			std::cerr << "Skipping invalid macro " << macro.key << " of profile " << macro.profile + 1 << std::endl;
+			continue;
+		}
+
+		Entry &entry = index[(static_cast<std::size_t>(macro.profile) * layers + macro.layer) * MAX_MACRO_KEYS + macro.key - 1];
+		entry.program = base + body.size();
+		entry.count = macro.program.size();
+		body.append(reinterpret_cast<const char *>(&macro.keys), sizeof(macro.keys));
+		body.append(reinterpret_cast<const char *>(macro.program.data()), macro.program.size() * sizeof(Instruction));
+		entry.source = base + body.size();
+		entry.length = macro.source.size();
+		body.append(macro.source);
+		body.resize((body.size() + 7) & ~static_cast<std::size_t>(7), '\0');
+
+		if (base + body.size() > MAX_BUNDLE_SIZE) {
+			std::cerr << "Profile bundle " << path << " gets too large." << std::endl;
+
+			return false;
+		}
+	}
+
+	struct Header header = Header();
+	header.magic = BUNDLE_MAGIC;
+	header.version = BUNDLE_VERSION;
+	header.size = sizeof(header);
+	header.profiles = profiles;
+	header.layers = layers;
+	header.keys = MAX_MACRO_KEYS;
+	header.fileSize = base + body.size();
+
+	std::string temporary = path + ".tmp";
+	FILE *file = fopen(temporary.c_str(), "wbe");
+
+	if (!file) {
+		std::cerr << "Can't write " << temporary << std::endl;
+
+		return false;
+	}
+
+	bool isWritten = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(index.data(), sizeof(Entry), index.size(), file) == index.size()
+		&& fwrite(body.data(), 1, body.size(), file) == body.size();
+	isWritten = !fclose(file) && isWritten;
+
+	if (!isWritten || rename(temporary.c_str(), path.c_str())) {
+		std::cerr << "Can't write " << path << std::endl;
+		unlink(temporary.c_str());
+
+		return false;
+	}
+
+	return true;
+}
+
+const ProfileBundle::Entry *ProfileBundle::find(int profile, int layer, int key) const {
+	if (!isOpen() || profile < 0 || profile >= static_cast<int>(header_->profiles)
+			|| layer < 0 || layer >= static_cast<int>(header_->layers) || key < 1 || key > MAX_MACRO_KEYS) {
+		return nullptr;
+	}
+
+	const Entry *entry = &index_[(static_cast<std::size_t>(profile) * header_->layers + layer) * MAX_MACRO_KEYS + key - 1];
+
+	return entry->count ? entry : nullptr;
+}
+
+/*
+ * All offsets are checked once, so lookups don't need to. Programs are
+ * verified by Macro, when they're loaded.
+ */
+bool ProfileBundle::isValid() const {
+	if (header_->magic != BUNDLE_MAGIC || header_->version != BUNDLE_VERSION || header_->size != sizeof(Header)
+			|| header_->fileSize != size_ || header_->keys != MAX_MACRO_KEYS
+			|| header_->profiles < 1 || header_->profiles > MAX_BUNDLE_PROFILES
+			|| header_->layers < 1 || header_->layers > MAX_BUNDLE_PROFILES) {
+		return false;
+	}
+
+	uint64_t entries = static_cast<uint64_t>(header_->profiles) * header_->layers * MAX_MACRO_KEYS;
+
+	if (sizeof(Header) + entries * sizeof(Entry) > size_) {
+		return false;
+	}
+
+	for (uint64_t i = 0; i < entries; i++) {
+		const Entry &entry = index_[i];
+
+		if (!entry.count) {
+			continue;
+		}
+
+		if (entry.program % 8
+				|| entry.program + sizeof(KeyBitmap) + static_cast<uint64_t>(entry.count) * sizeof(Instruction) > size_
+				|| static_cast<uint64_t>(entry.source) + entry.length > size_) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+void ProfileBundle::close() {
+	if (data_) {
+		munmap(const_cast<uint8_t *>(data_), size_);
+	}
+
+	data_ = nullptr;
+	size_ = 0;
+	header_ = nullptr;
+	index_ = nullptr;
+}
+
+ProfileBundle::ProfileBundle() {
+	data_ = nullptr;
+	size_ = 0;
+	device_ = 0;
+	inode_ = 0;
+	mtime_ = timespec();
+	header_ = nullptr;
+	index_ = nullptr;
+}
+
+ProfileBundle::~ProfileBundle() {
+	close();
+}
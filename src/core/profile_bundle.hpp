@@ -0,0 +1,137 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef PROFILE_BUNDLE_CLASS_H
+#define PROFILE_BUNDLE_CLASS_H
+
+#include <cstdint>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include <sys/types.h>
+
+#include <core/key_bitmap.hpp>
+#include <core/macro.hpp>
+#include <core/macro_optimizer.hpp>
+#include <core/macro_vm.hpp>
+
+/* constants */
+const uint32_t BUNDLE_MAGIC = 0x4e425753; /**< "SWBN" */
+const uint32_t BUNDLE_VERSION = 1;
+const char BUNDLE_FILE[] = "profiles.bundle"; /**< in the working directory */
+
+/**
+ * Struct holding a macro, which gets written into a bundle.
+ *
+ * @var profile profile index, counted from 0
+ * @var layer layer index, counted from 0
+ * @var key macro key index, counted from 1
+ * @var program compiled program without optimizations, the daemon optimizes
+ * it with its own settings and compiles macros with text from the source
+ * @var source XML file, it was compiled from
+ */
+struct BundleMacro {
+	int profile;
+	int layer;
+	int key;
+	std::vector<Instruction> program;
+	KeyBitmap keys;
+	std::string source;
+};
+
+/**
+ * Class mapping a profile bundle, which holds the macros of all profiles and
+ * layers in a single file.
+ *
+ * The file starts with a header and an index with one entry per profile,
+ * layer and macro key, so looking up a key is a single array access. Entries
+ * point to the compiled program and the XML source of the macro, the source
+ * allows exporting the bundle to profile directories again. Everything is
+ * validated on open().
+ *
+ * Bundles are mapped read-only. They are replaced by renaming a new file over
+ * the old one, mappings of the old file stay valid until they are closed.
+ */
+class ProfileBundle {
+	public:
+		/**
+		 * Maps a bundle.
+		 * @return false, if it doesn't exist or is invalid
+		 */
+		bool open(std::string path);
+		bool isOpen() const;
+
+		/**
+		 * Checks, whether path still refers to the mapped file.
+		 */
+		bool isCurrent(std::string path) const;
+
+		/**
+		 * Returns the modification time of the mapped file. Macro files,
+		 * which are newer, have been recorded after packing.
+		 */
+		const struct timespec &getMtime() const;
+		int getProfileCount() const;
+		int getLayerCount() const;
+		bool isBound(int profile, int layer, int key) const;
+
+		/**
+		 * Loads the program of a key into a macro.
+		 * @return false, if the key is unbound
+		 */
+		bool getMacro(int profile, int layer, int key, Macro *macro, const MacroOptimizer *optimizer) const;
+
+		/**
+		 * Returns the XML source of a macro or an empty string, if the
+		 * key is unbound.
+		 */
+		std::string getSource(int profile, int layer, int key) const;
+
+		/**
+		 * Writes a bundle. An existing file is replaced atomically.
+		 */
+		static bool write(std::string path, int profiles, int layers, const std::vector<BundleMacro> &macros);
+		ProfileBundle();
+		~ProfileBundle();
+
+	private:
+		struct Header {
+			uint32_t magic;
+			uint16_t version;
+			uint16_t size; /**< of the header */
+			uint32_t profiles;
+			uint32_t layers;
+			uint32_t keys; /**< macro keys per layer */
+			uint32_t reserved;
+			uint64_t fileSize;
+		};
+
+		/**
+		 * Struct holding an index entry. Offsets are counted from the
+		 * start of the file, the program is preceded by its KeyBitmap.
+		 */
+		struct Entry {
+			uint32_t program;
+			uint32_t count; /**< instructions, 0 for unbound keys */
+			uint32_t source;
+			uint32_t length;
+		};
+
+		const uint8_t *data_;
+		std::size_t size_;
+		dev_t device_;
+		ino_t inode_;
+		struct timespec mtime_;
+		const Header *header_;
+		const Entry *index_;
+		const Entry *find(int profile, int layer, int key) const;
+		bool isValid() const;
+		void close();
+};
+
+#endif
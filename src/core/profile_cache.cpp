@@ -0,0 +1,335 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+
+#include <unistd.h>
+
+#include <sys/inotify.h>
+
+#include <core/profile_cache.hpp>
+
+/* constants */
+constexpr auto PROFILE_EVENTS =	IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM | IN_CLOSE_WRITE | IN_ONLYDIR;
+constexpr auto WORKDIR_EVENTS =	IN_CREATE | IN_MOVED_TO | IN_ONLYDIR;
+constexpr auto PROFILE_PREFIX =	"profile_";
+
+std::shared_ptr<const Macro> ProfileCache::getMacro(int profile, int layer, int key) {
+	if (profile < 0 || profile >= getProfileCount() || layer < 0 || layer >= layers_ || !isAttached_) {
+		return nullptr;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	/* unbound keys don't load profiles again, changed profiles are dropped by update() */
+	if (profiles_[profile] && !profiles_[profile]->isBound(layer, key)) {
+		return nullptr;
+	}
+
+	return touch(&lock, profile)->getMacro(layer, key);
+}
+
+void ProfileCache::warm(int profile) {
+	if (profile < 0 || profile >= getProfileCount()) {
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	isPinned_[profile] = true;
+
+	if (isAttached_) {
+		touch(&lock, profile);
+	}
+}
+
+void ProfileCache::attach() {
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	if (isAttached_.exchange(true)) {
+		return;
+	}
+
+	rootWatch_ = inotify_add_watch(watchFd_, ".", WORKDIR_EVENTS);
+
+	for (std::size_t profile = 0; profile < profiles_.size(); profile++) {
+		watch(profile);
+	}
+
+	for (std::size_t profile = 0; profile < profiles_.size(); profile++) {
+		if (isPinned_[profile]) {
+			touch(&lock, profile);
+		}
+	}
+}
+
+int ProfileCache::getWatchFd() {
+	return watchFd_;
+}
+
+/*
+ * Events are only used as a hint, a changed profile is dropped as a whole and
+ * read again on its next lookup. Recorded macros get dropped as well, which
+ * doesn't hurt, as recording is rare.
+ */
+void ProfileCache::update(const void *data, std::size_t size) {
+	auto buf = static_cast<const char *>(data);
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	for (std::size_t offset = 0; offset + sizeof(struct inotify_event) <= size;) {
+		/* the buffer of the I/O engine isn't aligned for inotify_event */
+		struct inotify_event event;
+		std::memcpy(&event, buf + offset, sizeof(event));
+		const char *name = buf + offset + sizeof(event);
+		offset += sizeof(event) + event.len;
+
+		if (event.mask & IN_Q_OVERFLOW) {
+			for (std::size_t profile = 0; profile < profiles_.size(); profile++) {
+				drop(profile);
+			}
+		} else if (event.wd == rootWatch_) {
+			/* a missing profile directory has been created */
+			char *end = nullptr;
+			long index = event.len && !std::strncmp(name, PROFILE_PREFIX, std::strlen(PROFILE_PREFIX))
+				? std::strtol(name + std::strlen(PROFILE_PREFIX), &end, 10) : 0;
+
+			if (index >= 1 && index <= static_cast<long>(profiles_.size()) && !*end) {
+				drop(index - 1);
+				watch(index - 1);
+			}
+		} else {
+			auto it = watches_.find(event.wd);
+
+			if (it == watches_.end()) {
+				continue;
+			}
+
+			int profile = it->second;
+			drop(profile);
+
+			/* the directory is gone, it's watched again, once it's created */
+			if (event.mask & IN_IGNORED) {
+				watches_.erase(it);
+			} else if (event.mask & IN_ISDIR) {
+				watch(profile);
+			}
+		}
+	}
+}
+
+bool ProfileCache::isAttached() {
+	return isAttached_;
+}
+
+void ProfileCache::setBundle(std::shared_ptr<const ProfileBundle> bundle) {
+	std::unique_lock<std::mutex> lock(mutex_);
+	bundle_ = bundle;
+	reset(&lock);
+}
+
+void ProfileCache::rescan() {
+	std::unique_lock<std::mutex> lock(mutex_);
+	reset(&lock);
+}
+
+void ProfileCache::reload(int profile, int layer, int key) {
+	if (profile < 0 || profile >= getProfileCount() || layer < 0 || layer >= layers_) {
+		return;
+	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	if (profiles_[profile]) {
+		profiles_[profile]->reload(layer, key);
+		evict();
+	}
+}
+
+KeyBitmap ProfileCache::getKeys() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	KeyBitmap keys = KeyBitmap();
+
+	for (auto profile : lru_) {
+		keys |= profiles_[profile]->getKeys();
+	}
+
+	return keys;
+}
+
+/*
+ * Profiles, which aren't in memory, are loaded into temporary copies outside
+ * of the lock, so macro lookups aren't blocked meanwhile.
+ */
+KeyBitmap ProfileCache::scanKeys(bool *hasMotion) {
+	KeyBitmap keys = KeyBitmap();
+
+	if (!isAttached_) {
+		return keys;
+	}
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	std::vector<int> unloaded;
+
+	for (std::size_t profile = 0; profile < profiles_.size(); profile++) {
+		if (profiles_[profile] && profiles_[profile]->isLoaded()) {
+			keys |= profiles_[profile]->getKeys();
+			*hasMotion |= profiles_[profile]->hasMotion();
+		} else {
+			unloaded.push_back(profile);
+		}
+	}
+
+	auto bundle = bundle_;
+	lock.unlock();
+
+	for (auto profile : unloaded) {
+		Profile scan(profile, layers_, optimizer_, text_, bundle.get());
+		scan.load();
+		keys |= scan.getKeys();
+		*hasMotion |= scan.hasMotion();
+	}
+
+	return keys;
+}
+
+int ProfileCache::getProfileCount() {
+	return profiles_.size();
+}
+
+int ProfileCache::getLayerCount() {
+	return layers_;
+}
+
+/*
+ * Must be called with mutex_ held. Marks a profile as most recently used and
+ * loads it, if it isn't in memory yet. Profiles are loaded outside of the
+ * lock, so lookups of other profiles, e.g. by playing macros, aren't blocked
+ * by reading files. If the profile has been dropped meanwhile, e.g. by
+ * switching bundles, the loaded copy is stale and loading is retried. If
+ * another thread has been faster, its copy is used.
+ */
+Profile *ProfileCache::touch(std::unique_lock<std::mutex> *lock, int profile) {
+	while (!profiles_[profile] || !profiles_[profile]->isLoaded()) {
+		auto bundle = bundle_;
+		unsigned int generation = generations_[profile];
+		lock->unlock();
+		std::unique_ptr<Profile> loaded(new Profile(profile, layers_, optimizer_, text_, bundle.get()));
+		loaded->load();
+		lock->lock();
+
+		if (generations_[profile] == generation && !(profiles_[profile] && profiles_[profile]->isLoaded())) {
+			profiles_[profile] = std::move(loaded);
+			lru_.remove(profile);
+			lru_.push_front(profile);
+			evict();
+		}
+	}
+
+	if (lru_.empty() || lru_.front() != profile) {
+		lru_.remove(profile);
+		lru_.push_front(profile);
+	}
+
+	return profiles_[profile].get();
+}
+
+/*
+ * Must be called with mutex_ held. Watches the profile directory and its layer
+ * directories. Missing layer directories are noticed by the watch of the
+ * profile directory, missing profile directories by the watch of the working
+ * directory.
+ */
+void ProfileCache::watch(int profile) {
+	std::string path = PROFILE_PREFIX + std::to_string(profile + 1);
+
+	for (int layer = 0; layer < layers_; layer++) {
+		std::string dir = layer ? path + "/layer_" + std::to_string(layer) : path;
+		int wd = inotify_add_watch(watchFd_, dir.c_str(), PROFILE_EVENTS);
+
+		if (wd >= 0) {
+			watches_[wd] = profile;
+		}
+	}
+}
+
+/*
+ * Must be called with mutex_ held. Macros, which are playing, aren't affected.
+ */
+void ProfileCache::drop(int profile) {
+	profiles_[profile].reset();
+	lru_.remove(profile);
+	generations_[profile]++;
+}
+
+/*
+ * Must be called with mutex_ held. Profiles are created from scratch, so keys
+ * known to be unbound are forgotten.
+ */
+void ProfileCache::reset(std::unique_lock<std::mutex> *lock) {
+	for (std::size_t profile = 0; profile < profiles_.size(); profile++) {
+		drop(profile);
+	}
+
+	if (!isAttached_) {
+		return;
+	}
+
+	for (std::size_t profile = 0; profile < profiles_.size(); profile++) {
+		if (isPinned_[profile]) {
+			touch(lock, profile);
+		}
+	}
+}
+
+/*
+ * Must be called with mutex_ held. Unloads least recently used profiles, until
+ * memory usage fits into the limit again. The most recently used profile is
+ * always kept, even if it exceeds the limit on its own.
+ */
+void ProfileCache::evict() {
+	std::size_t usage = 0;
+
+	for (auto profile : lru_) {
+		usage += profiles_[profile]->getMemoryUsage();
+	}
+
+	auto it = lru_.end();
+
+	while (usage > memoryLimit_ && it != lru_.begin() && std::prev(it) != lru_.begin()) {
+		--it;
+
+		if (isPinned_[*it]) {
+			continue;
+		}
+
+		usage -= profiles_[*it]->getMemoryUsage();
+		profiles_[*it]->unload();
+		it = lru_.erase(it);
+	}
+}
+
+ProfileCache::ProfileCache(int profiles, int layers, std::size_t memoryLimit, const OptimizerSettings &optimizer, const TextSettings &text) {
+	layers_ = std::max(layers, 1);
+	memoryLimit_ = memoryLimit;
+	isAttached_ = false;
+	optimizer_ = optimizer;
+	text_ = text;
+	profiles_.resize(std::max(profiles, 1));
+	isPinned_.resize(profiles_.size(), false);
+	generations_.resize(profiles_.size(), 0);
+	watchFd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	rootWatch_ = -1;
+}
+
+ProfileCache::~ProfileCache() {
+	if (watchFd_ >= 0) {
+		close(watchFd_);
+	}
+}
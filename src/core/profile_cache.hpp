@@ -0,0 +1,132 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef PROFILE_CACHE_CLASS_H
+#define PROFILE_CACHE_CLASS_H
+
+#include <atomic>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <core/macro.hpp>
+#include <core/profile.hpp>
+#include <core/profile_bundle.hpp>
+#include <core/settings.hpp>
+
+/**
+ * Class managing all profiles of a device.
+ *
+ * Profiles are loaded lazily on first use. Once the memory limit has been
+ * exceeded, the least recently used profiles get unloaded again. Warmed
+ * profiles are pinned and never evicted. Until the cache is attached to the
+ * working directory, all keys are unbound. Macros come from the profile
+ * directories or, if set, from a profile bundle.
+ *
+ * Profile directories are watched with inotify, so added and edited macro
+ * files are picked up without checking the file system on lookups.
+ */
+class ProfileCache {
+	public:
+		/**
+		 * Returns the macro bound to a key or nullptr, if the key is unbound.
+		 * Loads the profile, if needed.
+		 */
+		std::shared_ptr<const Macro> getMacro(int profile, int layer, int key);
+
+		/**
+		 * Loads a profile and pins it in memory. Before attach(), the
+		 * profile is loaded on attaching.
+		 */
+		void warm(int profile);
+
+		/**
+		 * Makes profiles available, must be called, once the working
+		 * directory is the current directory.
+		 */
+		void attach();
+		bool isAttached();
+
+		/**
+		 * Returns the inotify descriptor watching the profile
+		 * directories. Events read from it are passed to update().
+		 */
+		int getWatchFd();
+
+		/**
+		 * Drops profiles, whose directories have changed. They are read
+		 * again on their next lookup.
+		 * @param data inotify events
+		 */
+		void update(const void *data, std::size_t size);
+
+		/**
+		 * Switches to another profile bundle or back to the profile
+		 * directories with nullptr. All profiles are loaded again,
+		 * macros, which are playing, aren't affected.
+		 */
+		void setBundle(std::shared_ptr<const ProfileBundle> bundle);
+
+		/**
+		 * Forgets all loaded macros and bound keys, e.g. after macro
+		 * files have been edited by hand. Pinned profiles are loaded
+		 * again.
+		 */
+		void rescan();
+
+		/**
+		 * Re-reads a single macro file of a loaded profile.
+		 */
+		void reload(int profile, int layer, int key);
+
+		/**
+		 * Returns all keys, which are sent by macros of loaded profiles.
+		 */
+		KeyBitmap getKeys();
+
+		/**
+		 * Returns all keys, which are sent by macros of any profile.
+		 * Profiles, which aren't loaded, are read without being cached.
+		 * @param hasMotion set, if any macro moves the pointer or wheels
+		 */
+		KeyBitmap scanKeys(bool *hasMotion);
+		int getProfileCount();
+		int getLayerCount();
+
+		/**
+		 * @param optimizer settings of the optimizer, which runs over all
+		 * loaded macros
+		 * @param text settings for compiling TextEvent elements
+		 */
+		ProfileCache(int profiles, int layers, std::size_t memoryLimit, const OptimizerSettings &optimizer, const TextSettings &text);
+		~ProfileCache();
+
+	private:
+		int layers_;
+		std::size_t memoryLimit_;
+		OptimizerSettings optimizer_;
+		TextSettings text_;
+		std::atomic<bool> isAttached_;
+		std::shared_ptr<const ProfileBundle> bundle_;
+		std::mutex mutex_;
+		std::vector<std::unique_ptr<Profile>> profiles_;
+		std::vector<bool> isPinned_;
+		std::vector<unsigned int> generations_; /**< counts drops, to detect stale loads */
+		std::list<int> lru_;
+		int watchFd_;
+		int rootWatch_; /**< watch of the working directory */
+		std::map<int, int> watches_; /**< watch descriptor to profile */
+		Profile *touch(std::unique_lock<std::mutex> *lock, int profile);
+		void watch(int profile);
+		void drop(int profile);
+		void reset(std::unique_lock<std::mutex> *lock);
+		void evict();
+};
+
+#endif
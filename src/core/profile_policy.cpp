@@ -0,0 +1,110 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <core/profile_policy.hpp>
+
+/* constants */
+constexpr auto MAX_APP_ID =	256;
+
+void ProfilePolicy::loadRules(const Settings *settings) {
+	rules_.clear();
+
+	for (auto &rule : settings->profileRules) {
+		rules_[rule.application] = rule.profile;
+	}
+}
+
+int ProfilePolicy::open(std::string path) {
+	struct sockaddr_un addr = sockaddr_un();
+	addr.sun_family = AF_UNIX;
+
+	if (path.size() >= sizeof(addr.sun_path)) {
+		std::cerr << "Focus socket path is too long." << std::endl;
+
+		return -1;
+	}
+
+	std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+	fd_ = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+
+	if (fd_ < 0) {
+		std::cerr << "Can't create focus socket." << std::endl;
+
+		return -1;
+	}
+
+	/* remove stale socket from a previous run */
+	unlink(path.c_str());
+
+	if (bind(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+		std::cerr << "Can't bind focus socket " << path << "." << std::endl;
+		close(fd_);
+		fd_ = -1;
+
+		return -1;
+	}
+
+	path_ = path;
+
+	return fd_;
+}
+
+int ProfilePolicy::receive() {
+	char buf[MAX_APP_ID];
+	auto nBytes = recv(fd_, buf, sizeof(buf), 0);
+
+	if (nBytes <= 0) {
+		return -1;
+	}
+
+	/* strip trailing newlines, so echo can be used as a stand-in */
+	while (nBytes && (buf[nBytes - 1] == '\n' || buf[nBytes - 1] == '\0')) {
+		nBytes--;
+	}
+
+	auto it = rules_.find(std::string(buf, nBytes));
+
+	if (it == rules_.end()) {
+		return -1;
+	}
+
+	return it->second;
+}
+
+std::set<int> ProfilePolicy::getTargets() {
+	std::set<int> targets;
+
+	for (auto &it : rules_) {
+		targets.insert(it.second);
+	}
+
+	return targets;
+}
+
+int ProfilePolicy::getFd() {
+	return fd_;
+}
+
+ProfilePolicy::ProfilePolicy() {
+	fd_ = -1;
+}
+
+ProfilePolicy::~ProfilePolicy() {
+	if (fd_ >= 0) {
+		close(fd_);
+		unlink(path_.c_str());
+	}
+}
@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef PROFILE_POLICY_CLASS_H
+#define PROFILE_POLICY_CLASS_H
+
+#include <set>
+#include <string>
+#include <unordered_map>
+
+#include <core/settings.hpp>
+
+/**
+ * Class mapping application identifiers to profiles.
+ *
+ * Focus changes are fed in as datagrams over a local Unix socket, each one
+ * carrying the identifier of the newly focused application, e.g. its window
+ * class. Any helper or test stand-in can write to that socket.
+ */
+class ProfilePolicy {
+	public:
+		/**
+		 * Takes over the rule table of a settings snapshot.
+		 */
+		void loadRules(const Settings *settings);
+
+		/**
+		 * Creates and binds the focus-event socket.
+		 * @param path socket path, relative to the working directory
+		 * @return socket file descriptor or -1 on error
+		 */
+		int open(std::string path);
+
+		/**
+		 * Reads one pending focus event.
+		 * @return profile index for the focused application or -1, if
+		 * there's no matching rule
+		 */
+		int receive();
+
+		/**
+		 * Returns all profiles, which can be switched to by a rule.
+		 */
+		std::set<int> getTargets();
+		int getFd();
+		ProfilePolicy();
+		~ProfilePolicy();
+
+	private:
+		int fd_;
+		std::string path_;
+		std::unordered_map<std::string, int> rules_;
+};
+
+#endif
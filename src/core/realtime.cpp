@@ -0,0 +1,194 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <new>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+#include <core/realtime.hpp>
+#include <core/stats.hpp>
+
+/* constants */
+constexpr auto STACK_PREFAULT =		64 * 1024;
+
+/* heap allocations of the current thread, updated by operator new */
+static thread_local uint64_t threadAllocations = 0;
+/* set before any thread is started, only in real-time mode */
+static bool isCountingAllocations = false;
+
+/*
+ * Replacing the global allocation functions is the only way to notice
+ * allocations done by the standard library, e.g. by std::thread.
+ */
+void *operator new(std::size_t size) {
+	if (isCountingAllocations) {
+		threadAllocations++;
+	}
+
+	void *ptr = std::malloc(size ? size : 1);
+
+	if (!ptr) {
+		throw std::bad_alloc();
+	}
+
+	return ptr;
+}
+
+void operator delete(void *ptr) noexcept {
+	std::free(ptr);
+}
+
+bool Realtime::isEnabled_ = false;
+bool Realtime::isMemoryLockRequested_ = true;
+std::atomic<bool> Realtime::isWarned_(false);
+int Realtime::priorities_[Realtime::ROLES];
+std::vector<int> Realtime::cpus_[Realtime::ROLES];
+
+void Realtime::configure(const RealtimeSettings &settings, Process *process) {
+	isEnabled_ = settings.isEnabled;
+
+	if (!isEnabled_) {
+		return;
+	}
+
+	isCountingAllocations = true;
+	int min = sched_get_priority_min(SCHED_FIFO), max = sched_get_priority_max(SCHED_FIFO);
+	int highest = min;
+	isMemoryLockRequested_ = settings.isMemoryLocked;
+	priorities_[static_cast<int>(ThreadRole::Input)] = settings.priority;
+	priorities_[static_cast<int>(ThreadRole::Playback)] = settings.playbackPriority;
+	cpus_[static_cast<int>(ThreadRole::Input)] = settings.inputCpus;
+	cpus_[static_cast<int>(ThreadRole::Playback)] = settings.playbackCpus;
+
+	for (auto &priority : priorities_) {
+		priority = priority < min ? min : priority > max ? max : priority;
+		highest = priority > highest ? priority : highest;
+	}
+
+	/* threads run unprivileged, the limits allow them to switch themselves */
+	process->privilege();
+	struct rlimit rtprio;
+	rtprio.rlim_cur = rtprio.rlim_max = highest;
+
+	if (setrlimit(RLIMIT_RTPRIO, &rtprio)) {
+		std::cerr << "Can't raise real-time priority limit" << std::endl;
+	}
+
+	if (isMemoryLockRequested_) {
+		struct rlimit memlock;
+		memlock.rlim_cur = memlock.rlim_max = RLIM_INFINITY;
+
+		if (setrlimit(RLIMIT_MEMLOCK, &memlock)) {
+			std::cerr << "Can't raise locked memory limit" << std::endl;
+		}
+	}
+
+	process->unprivilege();
+	std::clog << "Real-time mode enabled" << std::endl;
+}
+
+bool Realtime::isEnabled() {
+	return isEnabled_;
+}
+
+void Realtime::setupThread(ThreadRole role) {
+	if (!isEnabled_) {
+		return;
+	}
+
+	int index = static_cast<int>(role);
+	struct sched_param param;
+	std::memset(&param, 0, sizeof(param));
+	param.sched_priority = priorities_[index];
+	int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+
+	if (!cpus_[index].empty()) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+
+		for (auto cpu : cpus_[index]) {
+			if (cpu < CPU_SETSIZE) {
+				CPU_SET(cpu, &cpus);
+			}
+		}
+
+		ret = ret ? ret : pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+
+	/* playback threads are started frequently, only warn once */
+	if (ret && !isWarned_.exchange(true)) {
+		std::cerr << "Can't apply real-time settings: " << std::strerror(ret) << std::endl;
+	}
+
+	prefaultStack();
+}
+
+/*
+ * Future mappings aren't locked on purpose, MCL_FUTURE would populate the
+ * whole stack of every playback thread on creation. Threads pre-fault the part
+ * of their stack they use instead.
+ */
+void Realtime::lockMemory() {
+	if (!isEnabled_ || !isMemoryLockRequested_) {
+		return;
+	}
+
+	if (mlockall(MCL_CURRENT)) {
+		std::cerr << "Can't lock memory: " << std::strerror(errno) << std::endl;
+	} else {
+		std::clog << "Locked memory after warm-up" << std::endl;
+	}
+}
+
+uint64_t Realtime::getFaults() {
+	struct rusage usage;
+	getrusage(RUSAGE_THREAD, &usage);
+
+	return usage.ru_minflt + usage.ru_majflt;
+}
+
+uint64_t Realtime::getAllocations() {
+	return threadAllocations;
+}
+
+void Realtime::prefaultStack() {
+	unsigned char stack[STACK_PREFAULT];
+	std::memset(stack, 0, sizeof(stack));
+	/* keeps the compiler from dropping the unused buffer */
+	__asm__ __volatile__("" : : "r"(stack) : "memory");
+}
+
+HotPath::HotPath() {
+	isActive_ = Realtime::isEnabled();
+	faults_ = isActive_ ? Realtime::getFaults() : 0;
+	allocations_ = isActive_ ? Realtime::getAllocations() : 0;
+}
+
+HotPath::~HotPath() {
+	if (!isActive_) {
+		return;
+	}
+
+	uint64_t faults = Realtime::getFaults() - faults_;
+	uint64_t allocations = Realtime::getAllocations() - allocations_;
+
+	if (faults) {
+		Stats::increment(Counter::HotPathFaults, faults);
+	}
+
+	if (allocations) {
+		Stats::increment(Counter::HotPathAllocations, allocations);
+	}
+}
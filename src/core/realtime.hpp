@@ -0,0 +1,95 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef REALTIME_CLASS_H
+#define REALTIME_CLASS_H
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include <process.hpp>
+#include <core/settings.hpp>
+
+/**
+ * Enum class of threads, which can be scheduled in real-time mode.
+ *
+ * @var Input listen threads of keyboards and the output writer
+ * @var Playback macro playback threads
+ */
+enum class ThreadRole {
+	Input,
+	Playback,
+	Count
+};
+
+/**
+ * Class implementing the optional real-time mode.
+ *
+ * If enabled, threads use SCHED_FIFO and can be pinned to CPUs. Memory is
+ * locked after warm-up. Page faults and heap allocations on hot paths are
+ * counted in Stats.
+ */
+class Realtime {
+	public:
+		/**
+		 * Takes over the real-time settings. Raises resource
+		 * limits with root privileges, so threads can switch themselves
+		 * to real-time scheduling later on. Must be called before any
+		 * thread is started.
+		 */
+		static void configure(const RealtimeSettings &settings, Process *process);
+		static bool isEnabled();
+
+		/**
+		 * Applies priority and CPU affinity of the role to the calling
+		 * thread and pre-faults its stack.
+		 */
+		static void setupThread(ThreadRole role);
+
+		/**
+		 * Locks all current memory, should be called after warm-up,
+		 * once all keyboards have been brought up.
+		 */
+		static void lockMemory();
+
+		/**
+		 * Returns the number of page faults of the calling thread.
+		 */
+		static uint64_t getFaults();
+
+		/**
+		 * Returns the number of heap allocations of the calling thread.
+		 */
+		static uint64_t getAllocations();
+
+	private:
+		static const int ROLES = static_cast<int>(ThreadRole::Count);
+		static bool isEnabled_;
+		static bool isMemoryLockRequested_;
+		static std::atomic<bool> isWarned_;
+		static int priorities_[ROLES];
+		static std::vector<int> cpus_[ROLES];
+		static void prefaultStack();
+};
+
+/**
+ * Scope guard marking a hot path. In real-time mode, page faults and heap
+ * allocations inside the scope are added to Stats.
+ */
+class HotPath {
+	public:
+		HotPath();
+		~HotPath();
+
+	private:
+		bool isActive_;
+		uint64_t faults_;
+		uint64_t allocations_;
+};
+
+#endif
@@ -0,0 +1,90 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <algorithm>
+#include <iostream>
+
+#include <core/remap_table.hpp>
+
+uint16_t RemapTable::lookup(int profile, int layer, int key) const {
+	if (profile < 0 || profile >= profiles_ || layer < 0 || layer >= layers_ || key < 0 || key >= KEY_CNT) {
+		return 0;
+	}
+
+	return actions_[(profile * layers_ + layer) * KEY_CNT + key];
+}
+
+KeyBitmap RemapTable::getTargets(const KeyBitmap &keys) const {
+	KeyBitmap targets = KeyBitmap();
+
+	for (int table = 0; table < profiles_ * layers_; table++) {
+		for (int key = 0; key < KEY_CNT; key++) {
+			uint16_t action = actions_[table * KEY_CNT + key];
+
+			if (keys.test(key) && !isLayer(action)) {
+				targets.set(action);
+			}
+		}
+	}
+
+	return targets;
+}
+
+bool RemapTable::isEmpty() const {
+	return isEmpty_;
+}
+
+bool RemapTable::isLayer(uint16_t action) {
+	return action & REMAP_LAYER;
+}
+
+int RemapTable::getLayer(uint16_t action) {
+	return action & ~REMAP_LAYER;
+}
+
+/*
+ * Rules for a single profile are applied after rules for all profiles, so
+ * they take precedence.
+ */
+RemapTable::RemapTable(int profiles, int layers, const std::vector<RemapRule> &rules) {
+	profiles_ = std::max(profiles, 1);
+	layers_ = std::max(layers, 1);
+	isEmpty_ = true;
+	actions_.resize(profiles_ * layers_ * KEY_CNT);
+	std::vector<RemapRule> global, local;
+
+	for (std::size_t i = 0; i < actions_.size(); i++) {
+		actions_[i] = i % KEY_CNT;
+	}
+
+	for (auto &rule : rules) {
+		if (rule.profile >= profiles_ || rule.layer < 0 || rule.layer >= layers_
+				|| rule.key <= 0 || rule.key >= KEY_CNT
+				|| rule.target >= KEY_CNT || rule.holdLayer >= layers_) {
+			std::cerr << "Ignoring remap rule for key " << rule.key << ", which is out of range." << std::endl;
+			continue;
+		}
+
+		(rule.profile < 0 ? global : local).push_back(rule);
+	}
+
+	for (auto &rule : global) {
+		for (int profile = 0; profile < profiles_; profile++) {
+			apply(profile, rule);
+		}
+	}
+
+	for (auto &rule : local) {
+		apply(rule.profile, rule);
+	}
+}
+
+void RemapTable::apply(int profile, const RemapRule &rule) {
+	uint16_t action = rule.holdLayer >= 0 ? REMAP_LAYER | rule.holdLayer : rule.target;
+	actions_[(profile * layers_ + rule.layer) * KEY_CNT + rule.key] = action;
+	isEmpty_ = false;
+}
@@ -0,0 +1,55 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef REMAP_TABLE_CLASS_H
+#define REMAP_TABLE_CLASS_H
+
+#include <cstdint>
+#include <vector>
+
+#include <linux/input.h>
+
+#include <core/key_bitmap.hpp>
+#include <core/settings.hpp>
+
+/* constants */
+const uint16_t REMAP_LAYER = 0x8000;
+
+/**
+ * Class holding the compiled remap and layer table of a device.
+ *
+ * Every profile and layer has a dense array of actions indexed by keycode, so
+ * a lookup is a single load. An action is either the keycode to send, 0 for
+ * dropping the key or REMAP_LAYER | layer for switching to a layer, while the
+ * key is held. Keys without a rule map to themselves.
+ */
+class RemapTable {
+	public:
+		/**
+		 * Returns the action of a key. Keycodes out of range are dropped.
+		 */
+		uint16_t lookup(int profile, int layer, int key) const;
+
+		/**
+		 * Returns all keycodes, which can be sent for the given physical
+		 * keys.
+		 */
+		KeyBitmap getTargets(const KeyBitmap &keys) const;
+		bool isEmpty() const;
+		static bool isLayer(uint16_t action);
+		static int getLayer(uint16_t action);
+		RemapTable(int profiles, int layers, const std::vector<RemapRule> &rules);
+
+	private:
+		int profiles_;
+		int layers_;
+		bool isEmpty_;
+		std::vector<uint16_t> actions_;
+		void apply(int profile, const RemapRule &rule);
+};
+
+#endif
@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef REPORT_DECODER_CLASS_H
+#define REPORT_DECODER_CLASS_H
+
+#include <cstdint>
+
+#include <core/key.hpp>
+
+/**
+ * Enum class describing, how a report field encodes keys.
+ *
+ * @var Bitfield one bit per key, little endian, bit 0 is key 1
+ * @var Value the field holds the key index itself
+ */
+enum class FieldEncoding {
+	Bitfield,
+	Value
+};
+
+/* constants */
+const int NO_GUARD = 0;
+
+/**
+ * Declarative description of a single HID report field.
+ *
+ * @tparam Id report ID, buf[0]
+ * @tparam Length report length in bytes, including the report ID
+ * @tparam Type key type of this field
+ * @tparam Offset first byte of the field
+ * @tparam Width field width in bytes, at most 4
+ * @tparam Shift number of low bits, which aren't part of the field
+ * @tparam Guard byte, which needs to be zero for this field to match or
+ * NO_GUARD
+ * @tparam Encoding how keys are encoded
+ */
+template <uint8_t Id, int Length, KeyData::KeyType Type, int Offset, int Width,
+	int Shift = 0, int Guard = NO_GUARD, FieldEncoding Encoding = FieldEncoding::Bitfield>
+struct ReportField {
+	static_assert(Offset > 0 && Width > 0 && Width <= 4 && Offset + Width <= Length,
+		"report field exceeds report");
+	static_assert(Guard < Length, "guard exceeds report");
+
+	/**
+	 * Decodes the field, if the report matches.
+	 * @param held receives pressed keys of Bitfield Macro fields
+	 * @return false, if the report doesn't match this field
+	 */
+	static inline bool decode(const unsigned char *buf, int nBytes, struct KeyData *keyData, uint32_t *held, bool *isHeldValid) {
+		if (nBytes != Length || buf[0] != Id || (Guard != NO_GUARD && buf[Guard])) {
+			return false;
+		}
+
+		uint32_t bits = 0;
+
+		/* Width is a constant, so this gets unrolled */
+		for (int i = 0; i < Width; i++) {
+			bits |= static_cast<uint32_t>(buf[Offset + i]) << (8 * i);
+		}
+
+		bits >>= Shift;
+
+		int index = Encoding == FieldEncoding::Bitfield ? __builtin_ffs(bits) : static_cast<int>(bits);
+		keyData->index = index;
+		keyData->type = index ? Type : KeyData::KeyType::Unknown;
+
+		if (Encoding == FieldEncoding::Bitfield && Type == KeyData::KeyType::Macro) {
+			*held = bits;
+			*isHeldValid = true;
+		}
+
+		return true;
+	}
+};
+
+/**
+ * Decoder for a list of ReportFields. Fields are tried in the given order,
+ * the first matching field wins.
+ */
+template <typename... Fields>
+struct ReportDecoder;
+
+template <>
+struct ReportDecoder<> {
+	static inline bool decode(const unsigned char *, int, struct KeyData *, uint32_t *, bool *) {
+		return false;
+	}
+};
+
+template <typename Field, typename... Fields>
+struct ReportDecoder<Field, Fields...> {
+	static inline bool decode(const unsigned char *buf, int nBytes, struct KeyData *keyData, uint32_t *held, bool *isHeldValid) {
+		return Field::decode(buf, nBytes, keyData, held, isHeldValid)
+			|| ReportDecoder<Fields...>::decode(buf, nBytes, keyData, held, isHeldValid);
+	}
+};
+
+#endif
@@ -0,0 +1,362 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <cstdlib>
+#include <iostream>
+
+#include <core/settings.hpp>
+
+/* constants */
+constexpr auto DEFAULT_PROFILES =		3;
+constexpr auto DEFAULT_LAYERS =		1;
+constexpr auto DEFAULT_OUTPUT_BURST =		32;
+constexpr auto DEFAULT_MACRO_CACHE_SIZE =	4096;
+constexpr auto DEFAULT_PRIORITY =		50;
+constexpr auto DEFAULT_PLAYBACK_PRIORITY =	45;
+constexpr auto DEFAULT_TAP_TIMEOUT =		200;
+constexpr auto DEFAULT_SEQUENCE_TIMEOUT =	1000;
+constexpr auto DEFAULT_RECONNECT_GRACE =	30000;
+constexpr auto DEFAULT_TEXT_RATE =		100;
+
+DeviceSettings Settings::getDevice(std::string product) const {
+	for (auto &device : devices) {
+		if (device.product == product) {
+			return device;
+		}
+	}
+
+	DeviceSettings device;
+	device.product = product;
+	device.profiles = DEFAULT_PROFILES;
+	device.layers = DEFAULT_LAYERS;
+	device.isGrabbed = false;
+	device.outputRate = 0;
+	device.outputBurst = DEFAULT_OUTPUT_BURST;
+
+	return device;
+}
+
+Settings::Settings() {
+	user = "root";
+	pidFile = "/var/run/sidewinderd.pid";
+	isEncryptedWorkdir = false;
+	isCapturingDelays = true;
+	isUringPreferred = false;
+	isUinputShared = false;
+	macroCacheSize = DEFAULT_MACRO_CACHE_SIZE;
+	tapTimeout = DEFAULT_TAP_TIMEOUT;
+	sequenceTimeout = DEFAULT_SEQUENCE_TIMEOUT;
+	reconnectGrace = DEFAULT_RECONNECT_GRACE;
+	focusSocket = "focus.sock";
+	realtime.isEnabled = false;
+	realtime.isMemoryLocked = true;
+	realtime.priority = DEFAULT_PRIORITY;
+	realtime.playbackPriority = DEFAULT_PLAYBACK_PRIORITY;
+	optimizer.isEnabled = true;
+	optimizer.resolution = 1;
+	optimizer.isCollapsingFrames = false;
+	text.layout = "us";
+	text.rate = DEFAULT_TEXT_RATE;
+}
+
+bool SettingsStore::load(std::string path) {
+	libconfig::Config config;
+	bool isValid = true;
+	/* the working directory changes after startup, reloads need the full path */
+	char *resolved = realpath(path.c_str(), nullptr);
+	path_ = resolved ? resolved : path;
+	std::free(resolved);
+
+	try {
+		config.readFile(path.c_str());
+	} catch (const libconfig::FileIOException &fioex) {
+		std::cerr << "I/O error while reading file." << std::endl;
+		isValid = false;
+	} catch (const libconfig::ParseException &pex) {
+		std::cerr << "Parse error at " << pex.getFile() << ":" << pex.getLine() << " - " << pex.getError() << std::endl;
+		isValid = false;
+	}
+
+	std::unique_ptr<Settings> settings;
+
+	if (isValid) {
+		try {
+			settings = parse(&config);
+		} catch (const libconfig::SettingException &sex) {
+			std::cerr << "Invalid setting " << sex.getPath() << std::endl;
+			isValid = false;
+		}
+	}
+
+	/* a broken file doesn't replace a working configuration */
+	if (!isValid && get()) {
+		return false;
+	}
+
+	publish(settings ? std::move(settings) : std::unique_ptr<Settings>(new Settings()));
+
+	return isValid;
+}
+
+bool SettingsStore::reload() {
+	return load(path_);
+}
+
+const Settings *SettingsStore::get() const {
+	return current_.load(std::memory_order_acquire);
+}
+
+void SettingsStore::publish(std::unique_ptr<Settings> settings) {
+	current_.store(settings.get(), std::memory_order_release);
+	snapshots_.push_back(std::move(settings));
+}
+
+/*
+ * Settings of the wrong type are ignored, just like missing ones.
+ */
+std::unique_ptr<Settings> SettingsStore::parse(libconfig::Config *config) {
+	std::unique_ptr<Settings> settings(new Settings());
+	config->lookupValue("user", settings->user);
+	config->lookupValue("pid-file", settings->pidFile);
+	config->lookupValue("workdir", settings->workdir);
+	config->lookupValue("encrypted_workdir", settings->isEncryptedWorkdir);
+	config->lookupValue("capture_delays", settings->isCapturingDelays);
+	config->lookupValue("io_uring", settings->isUringPreferred);
+	config->lookupValue("shared_uinput", settings->isUinputShared);
+	config->lookupValue("macro_cache_size", settings->macroCacheSize);
+	config->lookupValue("tap_timeout", settings->tapTimeout);
+	config->lookupValue("sequence_timeout", settings->sequenceTimeout);
+	config->lookupValue("reconnect_grace", settings->reconnectGrace);
+	config->lookupValue("focus_socket", settings->focusSocket);
+
+	/*
+	 * profile_rules = ( { application = "firefox"; profile = 2; } );
+	 * Profiles are counted from 1, just like on the device.
+	 */
+	if (config->exists("profile_rules")) {
+		libconfig::Setting &rules = config->lookup("profile_rules");
+
+		for (int i = 0; i < rules.getLength(); i++) {
+			struct ProfileRule rule;
+
+			if (!rules[i].lookupValue("application", rule.application)
+					|| !rules[i].lookupValue("profile", rule.profile)
+					|| rule.profile < 1) {
+				std::cerr << "Skipping invalid profile rule " << i << "." << std::endl;
+				continue;
+			}
+
+			rule.profile--;
+			settings->profileRules.push_back(rule);
+		}
+	}
+
+	/* devices = ( { product = "074b"; profiles = 8; layers = 2; } ); */
+	if (config->exists("devices")) {
+		libconfig::Setting &devices = config->lookup("devices");
+
+		for (int i = 0; i < devices.getLength(); i++) {
+			struct DeviceSettings device = settings->getDevice("");
+
+			if (devices[i].lookupValue("product", device.product)) {
+				devices[i].lookupValue("profiles", device.profiles);
+				devices[i].lookupValue("layers", device.layers);
+				devices[i].lookupValue("grab", device.isGrabbed);
+				devices[i].lookupValue("output_rate", device.outputRate);
+				devices[i].lookupValue("output_burst", device.outputBurst);
+				devices[i].lookupValue("pointer", device.pointer);
+
+				if (devices[i].exists("remap")) {
+					parseRemaps(devices[i]["remap"], &device.remaps);
+				}
+
+				if (devices[i].exists("bindings")) {
+					parseBindings(devices[i]["bindings"], &device.bindings);
+				}
+
+				settings->devices.push_back(device);
+			}
+		}
+	}
+
+	if (config->exists("shared_layers")) {
+		parseSharedLayers(config->lookup("shared_layers"), settings.get());
+	}
+
+	if (config->exists("realtime")) {
+		parseRealtime(config->lookup("realtime"), &settings->realtime);
+	}
+
+	if (config->exists("macro_optimizer")) {
+		parseOptimizer(config->lookup("macro_optimizer"), &settings->optimizer);
+	}
+
+	if (config->exists("text")) {
+		parseText(config->lookup("text"), &settings->text);
+	}
+
+	return settings;
+}
+
+/*
+ * realtime = { enabled = true; priority = 50; playback_priority = 45;
+ *	input_cpus = [ 2 ]; playback_cpus = [ 3 ]; lock_memory = true; };
+ */
+void SettingsStore::parseRealtime(libconfig::Setting &setting, RealtimeSettings *realtime) {
+	setting.lookupValue("enabled", realtime->isEnabled);
+	setting.lookupValue("lock_memory", realtime->isMemoryLocked);
+	setting.lookupValue("priority", realtime->priority);
+	setting.lookupValue("playback_priority", realtime->playbackPriority);
+	realtime->inputCpus = parseCpus(setting, "input_cpus");
+	realtime->playbackCpus = parseCpus(setting, "playback_cpus");
+}
+
+/*
+ * remap = ( { key = 58; to = 1; }, { key = 100; hold_layer = 1; profile = 2; } );
+ * Profiles are counted from 1, rules without a profile apply to all of them.
+ * Rules without a layer apply to layer 0.
+ */
+void SettingsStore::parseRemaps(libconfig::Setting &setting, std::vector<RemapRule> *remaps) {
+	for (int i = 0; i < setting.getLength(); i++) {
+		struct RemapRule rule;
+		rule.profile = 0;
+		rule.layer = 0;
+		rule.target = -1;
+		rule.holdLayer = -1;
+		setting[i].lookupValue("profile", rule.profile);
+		setting[i].lookupValue("layer", rule.layer);
+		setting[i].lookupValue("to", rule.target);
+		setting[i].lookupValue("hold_layer", rule.holdLayer);
+
+		if (!setting[i].lookupValue("key", rule.key) || (rule.target < 0) == (rule.holdLayer < 0)) {
+			std::cerr << "Skipping invalid remap rule " << i << "." << std::endl;
+			continue;
+		}
+
+		rule.profile--;
+		remaps->push_back(rule);
+	}
+}
+
+/*
+ * bindings = ( { key = 1; hold = 7; double_tap = 8; profile = 1; },
+ *	{ key = 6; sequence = [ 1, 2 ]; macro = 9; } );
+ * Profiles are counted from 1, rules without a profile apply to all of them.
+ */
+void SettingsStore::parseBindings(libconfig::Setting &setting, std::vector<BindingRule> *bindings) {
+	for (int i = 0; i < setting.getLength(); i++) {
+		struct BindingRule rule;
+		rule.profile = 0;
+		rule.tap = 0;
+		rule.hold = 0;
+		rule.doubleTap = 0;
+		rule.macro = 0;
+		setting[i].lookupValue("profile", rule.profile);
+		setting[i].lookupValue("tap", rule.tap);
+		setting[i].lookupValue("hold", rule.hold);
+		setting[i].lookupValue("double_tap", rule.doubleTap);
+		setting[i].lookupValue("macro", rule.macro);
+
+		bool isSequenceValid = true;
+
+		if (setting[i].exists("sequence")) {
+			libconfig::Setting &sequence = setting[i]["sequence"];
+
+			for (int j = 0; j < sequence.getLength(); j++) {
+				if (sequence[j].getType() != libconfig::Setting::TypeInt) {
+					isSequenceValid = false;
+					break;
+				}
+
+				int key = sequence[j];
+				rule.sequence.push_back(key);
+			}
+		}
+
+		if (!setting[i].lookupValue("key", rule.key) || !isSequenceValid || rule.sequence.empty() != !rule.macro) {
+			std::cerr << "Skipping invalid binding " << i << "." << std::endl;
+			continue;
+		}
+
+		rule.profile--;
+		bindings->push_back(rule);
+	}
+}
+
+/*
+ * shared_layers = ( { product = "c248"; key = 1; target = "074b"; layer = 1; } );
+ * Keys are macro keys of product, counted from 1. Layers need to exist on the
+ * target, so devices are parsed before.
+ */
+void SettingsStore::parseSharedLayers(libconfig::Setting &setting, Settings *settings) {
+	for (int i = 0; i < setting.getLength(); i++) {
+		struct SharedLayerRule rule;
+
+		if (!setting[i].lookupValue("product", rule.product)
+				|| !setting[i].lookupValue("key", rule.key)
+				|| !setting[i].lookupValue("target", rule.target)
+				|| !setting[i].lookupValue("layer", rule.layer)
+				|| rule.key < 1 || rule.key > 32 || rule.layer < 1) {
+			std::cerr << "Skipping invalid shared layer " << i << "." << std::endl;
+			continue;
+		}
+
+		if (rule.layer >= settings->getDevice(rule.target).layers) {
+			std::cerr << "Skipping shared layer " << i << ", device " << rule.target << " has no layer "
+				  << rule.layer << "." << std::endl;
+			continue;
+		}
+
+		settings->sharedLayers.push_back(rule);
+	}
+}
+
+/*
+ * macro_optimizer = { enabled = true; resolution = 5; collapse_frames = true; };
+ */
+void SettingsStore::parseOptimizer(libconfig::Setting &setting, OptimizerSettings *optimizer) {
+	setting.lookupValue("enabled", optimizer->isEnabled);
+	setting.lookupValue("resolution", optimizer->resolution);
+	setting.lookupValue("collapse_frames", optimizer->isCollapsingFrames);
+}
+
+/*
+ * text = { layout = "de"; rate = 50; };
+ */
+void SettingsStore::parseText(libconfig::Setting &setting, TextSettings *text) {
+	setting.lookupValue("layout", text->layout);
+	setting.lookupValue("rate", text->rate);
+}
+
+std::vector<int> SettingsStore::parseCpus(libconfig::Setting &setting, const char *name) {
+	std::vector<int> cpus;
+
+	if (!setting.exists(name)) {
+		return cpus;
+	}
+
+	libconfig::Setting &list = setting[name];
+
+	for (int i = 0; i < list.getLength(); i++) {
+		if (list[i].getType() != libconfig::Setting::TypeInt) {
+			std::cerr << "Skipping invalid CPU " << i << " of " << name << "." << std::endl;
+			continue;
+		}
+
+		int cpu = list[i];
+
+		if (cpu >= 0) {
+			cpus.push_back(cpu);
+		}
+	}
+
+	return cpus;
+}
+
+SettingsStore::SettingsStore() {
+	current_ = nullptr;
+}
@@ -0,0 +1,209 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef SETTINGS_CLASS_H
+#define SETTINGS_CLASS_H
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <libconfig.h++>
+
+/**
+ * Struct holding a single entry of a device's remap list. A rule either
+ * remaps a key or switches to a layer, while the key is held.
+ *
+ * @var profile profile index, counted from 0, or -1 for all profiles
+ * @var layer layer the rule applies to
+ * @var target keycode to send instead, 0 disables the key
+ * @var holdLayer layer to activate while the key is held or -1
+ */
+struct RemapRule {
+	int profile;
+	int layer;
+	int key;
+	int target;
+	int holdLayer;
+};
+
+/**
+ * Struct holding a single entry of a device's bindings list. Without a
+ * sequence, the rule binds tap, hold and double tap of a macro key. With a
+ * sequence, key is a leader key and macro runs, once the sequence has been
+ * pressed after it.
+ *
+ * @var profile profile index, counted from 0, or -1 for all profiles
+ * @var tap macro key to run on tap, 0 for the key itself
+ * @var hold macro key to run on hold or 0
+ * @var doubleTap macro key to run on double tap or 0
+ */
+struct BindingRule {
+	int profile;
+	int key;
+	int tap;
+	int hold;
+	int doubleTap;
+	std::vector<int> sequence;
+	int macro;
+};
+
+/**
+ * Struct holding a single entry of shared_layers. While macro key key of
+ * device product is held, device target uses layer.
+ *
+ * @var key macro key index, counted from 1
+ */
+struct SharedLayerRule {
+	std::string product;
+	int key;
+	std::string target;
+	int layer;
+};
+
+/**
+ * Struct holding per-device settings of the devices list.
+ *
+ * @var isGrabbed the input event node is grabbed and passed through remaps
+ * @var outputRate macro events per second, 0 for no limit
+ * @var outputBurst macro events, which are sent without delay
+ * @var pointer input event node of a pointer device, which is recorded
+ * along with the keyboard, or empty
+ */
+struct DeviceSettings {
+	std::string product;
+	int profiles;
+	int layers;
+	bool isGrabbed;
+	int outputRate;
+	int outputBurst;
+	std::string pointer;
+	std::vector<RemapRule> remaps;
+	std::vector<BindingRule> bindings;
+};
+
+/**
+ * Struct holding a single entry of profile_rules.
+ *
+ * @var profile profile index, counted from 0
+ */
+struct ProfileRule {
+	std::string application;
+	int profile;
+};
+
+/**
+ * Struct holding the realtime group.
+ */
+struct RealtimeSettings {
+	bool isEnabled;
+	bool isMemoryLocked;
+	int priority;
+	int playbackPriority;
+	std::vector<int> inputCpus;
+	std::vector<int> playbackCpus;
+};
+
+/**
+ * Struct holding the macro_optimizer group.
+ *
+ * @var resolution delays are rounded to multiples of it, in milliseconds
+ * @var isCollapsingFrames key events without delay in between are sent as a
+ * single input frame
+ */
+struct OptimizerSettings {
+	bool isEnabled;
+	int resolution;
+	bool isCollapsingFrames;
+};
+
+/**
+ * Struct holding the text group, used by TextEvent macro elements.
+ *
+ * @var layout keyboard layout of the host, e.g. "us" or "de"
+ * @var rate characters per second, 0 for typing without delay
+ */
+struct TextSettings {
+	std::string layout;
+	int rate;
+};
+
+/**
+ * Struct holding the parsed configuration. Missing settings hold their
+ * defaults.
+ */
+struct Settings {
+	std::string user;
+	std::string pidFile;
+	std::string workdir;
+	bool isEncryptedWorkdir;
+	bool isCapturingDelays;
+	bool isUringPreferred;
+	bool isUinputShared;
+	unsigned int macroCacheSize; /**< in KiB */
+	int tapTimeout; /**< in milliseconds */
+	int sequenceTimeout; /**< in milliseconds */
+	int reconnectGrace; /**< in milliseconds, 0 disables resuming */
+	std::string focusSocket;
+	std::vector<ProfileRule> profileRules;
+	std::vector<DeviceSettings> devices;
+	std::vector<SharedLayerRule> sharedLayers;
+	RealtimeSettings realtime;
+	OptimizerSettings optimizer;
+	TextSettings text;
+
+	/**
+	 * Returns the settings of a device or default settings, if it isn't
+	 * listed.
+	 */
+	DeviceSettings getDevice(std::string product) const;
+	Settings();
+};
+
+/**
+ * Class publishing immutable Settings snapshots.
+ *
+ * Readers get the current snapshot with a single atomic load and never take a
+ * lock or touch libconfig. Reloads parse the configuration file into a new
+ * snapshot and swap it in. Replaced snapshots are kept until the store is
+ * destroyed, so readers may hold on to a snapshot as long as they like.
+ * Loading is done by a single thread only.
+ */
+class SettingsStore {
+	public:
+		/**
+		 * Reads the configuration file and publishes it. On errors, the
+		 * current snapshot is kept. If there is none yet, defaults are
+		 * published.
+		 * @return false on errors
+		 */
+		bool load(std::string path);
+
+		/**
+		 * Reads the configuration file used by the last load() again.
+		 */
+		bool reload();
+		const Settings *get() const;
+		SettingsStore();
+
+	private:
+		std::atomic<const Settings *> current_;
+		std::vector<std::unique_ptr<const Settings>> snapshots_;
+		std::string path_;
+		void publish(std::unique_ptr<Settings> settings);
+		static std::unique_ptr<Settings> parse(libconfig::Config *config);
+		static void parseRealtime(libconfig::Setting &setting, RealtimeSettings *realtime);
+		static void parseRemaps(libconfig::Setting &setting, std::vector<RemapRule> *remaps);
+		static void parseBindings(libconfig::Setting &setting, std::vector<BindingRule> *bindings);
+		static void parseSharedLayers(libconfig::Setting &setting, Settings *settings);
+		static void parseOptimizer(libconfig::Setting &setting, OptimizerSettings *optimizer);
+		static void parseText(libconfig::Setting &setting, TextSettings *text);
+		static std::vector<int> parseCpus(libconfig::Setting &setting, const char *name);
+};
+
+#endif
@@ -0,0 +1,85 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <iostream>
+
+#include <core/shared_layers.hpp>
+
+int SharedLayers::getSlot(std::string product) const {
+	for (std::size_t slot = 0; slot < products_.size(); slot++) {
+		if (products_[slot] == product) {
+			return slot;
+		}
+	}
+
+	return -1;
+}
+
+uint32_t SharedLayers::getKeys(int slot) const {
+	return keys_[slot];
+}
+
+/*
+ * Only bits owned by the source are touched, so sources never overwrite each
+ * other and targets always see a consistent mask.
+ */
+void SharedLayers::setHeld(int slot, uint32_t keys) {
+	for (std::size_t bit = 0; bit < bindings_.size(); bit++) {
+		const Binding &binding = bindings_[bit];
+
+		if (binding.source != slot) {
+			continue;
+		}
+
+		if (keys & binding.key) {
+			active_[binding.target].fetch_or(1U << bit, std::memory_order_relaxed);
+		} else {
+			active_[binding.target].fetch_and(~(1U << bit), std::memory_order_relaxed);
+		}
+	}
+}
+
+int SharedLayers::getLayer(int slot) const {
+	uint32_t active = active_[slot].load(std::memory_order_relaxed);
+
+	return active ? layers_[__builtin_ctz(active)] : 0;
+}
+
+int SharedLayers::addSlot(std::string product) {
+	int slot = getSlot(product);
+
+	if (slot < 0) {
+		slot = products_.size();
+		products_.push_back(product);
+		keys_.push_back(0);
+	}
+
+	return slot;
+}
+
+SharedLayers::SharedLayers(const std::vector<SharedLayerRule> &rules) {
+	for (auto &rule : rules) {
+		if (bindings_.size() == MAX_SHARED_LAYERS) {
+			std::cerr << "Too many shared layers, skipping the rest." << std::endl;
+			break;
+		}
+
+		Binding binding;
+		binding.source = addSlot(rule.product);
+		binding.key = 1U << (rule.key - 1);
+		binding.target = addSlot(rule.target);
+		keys_[binding.source] |= binding.key;
+		layers_[bindings_.size()] = rule.layer;
+		bindings_.push_back(binding);
+	}
+
+	active_ = std::unique_ptr<std::atomic<uint32_t>[]>(new std::atomic<uint32_t>[products_.size()]);
+
+	for (std::size_t slot = 0; slot < products_.size(); slot++) {
+		active_[slot] = 0;
+	}
+}
@@ -0,0 +1,73 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef SHARED_LAYERS_CLASS_H
+#define SHARED_LAYERS_CLASS_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <core/settings.hpp>
+
+/* constants */
+const int MAX_SHARED_LAYERS = 32;
+
+/**
+ * Class holding layers, which keys of one keyboard activate on another.
+ *
+ * Each binding owns a bit in the mask of its target device. Source devices set
+ * and clear the bit from their listen thread, while the key is held. Targets
+ * read their active layer with a single atomic load, so no device thread ever
+ * waits for another. Bindings are fixed on construction.
+ */
+class SharedLayers {
+	public:
+		/**
+		 * Returns the slot of a device.
+		 * @return slot or -1, if the device isn't part of any binding
+		 */
+		int getSlot(std::string product) const;
+
+		/**
+		 * Returns the macro keys of a device, which are bound to layers.
+		 * Bit 0 represents macro key 1.
+		 */
+		uint32_t getKeys(int slot) const;
+
+		/**
+		 * Updates the layers bound to keys of a source device.
+		 * @param keys held macro keys, bit 0 represents macro key 1
+		 */
+		void setHeld(int slot, uint32_t keys);
+
+		/**
+		 * Returns the layer activated on a target device. If several
+		 * bindings are active, the first one in the configuration wins.
+		 * @return layer or 0, if no binding is active
+		 */
+		int getLayer(int slot) const;
+		SharedLayers(const std::vector<SharedLayerRule> &rules);
+
+	private:
+		struct Binding {
+			int source;
+			uint32_t key; /**< macro key bit */
+			int target;
+		};
+
+		std::vector<std::string> products_;
+		std::vector<uint32_t> keys_;
+		std::vector<Binding> bindings_;
+		int layers_[MAX_SHARED_LAYERS]; /**< layer per binding bit */
+		std::unique_ptr<std::atomic<uint32_t>[]> active_; /**< binding bits per target */
+		int addSlot(std::string product);
+};
+
+#endif
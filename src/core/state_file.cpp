@@ -0,0 +1,131 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <core/state_file.hpp>
+
+bool StateFile::open(std::string path) {
+	if (isOpen()) {
+		return true;
+	}
+
+	fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+
+	if (fd_ < 0) {
+		std::cerr << "Can't open state file " << path << std::endl;
+
+		return false;
+	}
+
+	struct stat info;
+	bool isSized = !fstat(fd_, &info) && info.st_size == sizeof(Layout);
+
+	if (!isSized && ftruncate(fd_, sizeof(Layout))) {
+		std::cerr << "Can't resize state file " << path << std::endl;
+		::close(fd_);
+		fd_ = -1;
+
+		return false;
+	}
+
+	void *layout = mmap(nullptr, sizeof(Layout), PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+
+	if (layout == MAP_FAILED) {
+		std::cerr << "Can't map state file " << path << std::endl;
+		::close(fd_);
+		fd_ = -1;
+
+		return false;
+	}
+
+	layout_ = static_cast<struct Layout *>(layout);
+
+	if (!isSized || !isValid()) {
+		initialize();
+	}
+
+	return true;
+}
+
+bool StateFile::isOpen() const {
+	return layout_ != nullptr;
+}
+
+/*
+ * Ids are truncated, so the last byte always terminates them. Long ids are
+ * compared in their truncated form, just like they are stored.
+ */
+struct DeviceState *StateFile::getSlot(std::string product, std::string serial) {
+	if (!isOpen() || product.empty()) {
+		return nullptr;
+	}
+
+	std::string id = serial.empty() ? product : product + ":" + serial;
+	struct DeviceState *empty = nullptr;
+
+	for (auto &device : layout_->devices) {
+		if (!strncmp(device.id, id.c_str(), MAX_STATE_ID - 1)) {
+			return &device;
+		}
+
+		if (!empty && !device.id[0]) {
+			empty = &device;
+		}
+	}
+
+	if (!empty) {
+		std::cerr << "State file is full, state of " << id << " isn't kept." << std::endl;
+
+		return nullptr;
+	}
+
+	empty->profile = 0;
+	empty->mode = 0;
+	strncpy(empty->id, id.c_str(), MAX_STATE_ID - 1);
+	empty->id[MAX_STATE_ID - 1] = '\0';
+
+	return empty;
+}
+
+bool StateFile::isValid() const {
+	return layout_->magic == STATE_MAGIC && layout_->version == STATE_VERSION && layout_->size == sizeof(Layout);
+}
+
+/*
+ * Zero is a valid initial value for all slots.
+ */
+void StateFile::initialize() {
+	layout_->magic = 0;
+	memset(static_cast<void *>(layout_->devices), 0, sizeof(layout_->devices));
+	layout_->version = STATE_VERSION;
+	layout_->size = sizeof(Layout);
+	layout_->reserved = 0;
+	layout_->magic.store(STATE_MAGIC, std::memory_order_release);
+}
+
+StateFile::StateFile() {
+	fd_ = -1;
+	layout_ = nullptr;
+}
+
+StateFile::~StateFile() {
+	if (layout_) {
+		munmap(layout_, sizeof(Layout));
+	}
+
+	if (fd_ >= 0) {
+		::close(fd_);
+	}
+}
@@ -0,0 +1,82 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef STATE_FILE_CLASS_H
+#define STATE_FILE_CLASS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+/* constants */
+const uint32_t STATE_MAGIC = 0x53445753; /**< "SWDS" */
+const uint32_t STATE_VERSION = 2;
+const int MAX_STATE_DEVICES = 16;
+const int MAX_STATE_ID = 64;
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "state file needs lock-free atomics");
+
+/**
+ * Struct holding the runtime state of a device, which survives restarts. All
+ * fields are updated with single atomic stores.
+ *
+ * @var id product id and serial number of the device, empty for unused
+ * slots
+ * @var profile active profile, counted from 0
+ * @var mode device specific mode bits, e.g. the SideWinder macro pad mode
+ */
+struct DeviceState {
+	char id[MAX_STATE_ID];
+	std::atomic<int32_t> profile;
+	std::atomic<uint32_t> mode;
+};
+
+/**
+ * Class mapping the state file of the working directory.
+ *
+ * The file holds a fixed size header and slots for MAX_STATE_DEVICES devices.
+ * It is mapped shared, so state updates are plain stores to memory, which the
+ * kernel writes back on its own and which survive crashes of the daemon.
+ * Files of another version or size are reinitialized. The magic number is
+ * written last, so interrupted initializations are detected on the next start.
+ */
+class StateFile {
+	public:
+		/**
+		 * Maps the state file, creating it if needed.
+		 * @return false on errors
+		 */
+		bool open(std::string path);
+		bool isOpen() const;
+
+		/**
+		 * Returns the slot of a device, new devices get an empty slot.
+		 * Slots are only assigned by a single thread.
+		 * @param serial serial number or physical path, tells apart
+		 * devices of the same product
+		 * @return slot or nullptr, if the file isn't open or is full
+		 */
+		struct DeviceState *getSlot(std::string product, std::string serial);
+		StateFile();
+		~StateFile();
+
+	private:
+		struct Layout {
+			std::atomic<uint32_t> magic;
+			uint32_t version;
+			uint32_t size;
+			uint32_t reserved;
+			struct DeviceState devices[MAX_STATE_DEVICES];
+		};
+
+		int fd_;
+		struct Layout *layout_;
+		bool isValid() const;
+		void initialize();
+};
+
+#endif
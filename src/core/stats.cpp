@@ -0,0 +1,158 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <algorithm>
+#include <iostream>
+
+#include <core/stats.hpp>
+
+const char *Stats::histogramNames_[] = {
+	"input.decode",
+	"input.passthrough"
+};
+
+const char *Stats::counterNames_[] = {
+	"hotpath.faults",
+	"hotpath.allocations",
+	"macro.events_removed",
+	"macro.sleeps_removed",
+	"macro.delay_changed_us",
+	"macro.frames_collapsed",
+	"wakeup.hid",
+	"wakeup.input_event",
+	"wakeup.request",
+	"wakeup.timer",
+	"wakeup.profiles",
+	"wakeup.spurious",
+	"wakeup.udev",
+	"wakeup.focus",
+	"wakeup.signal",
+	"wakeup.workdir",
+	"wakeup.expiry",
+	"wakeup.output",
+	"output.throttled",
+	"output.retried",
+	"output.dropped",
+	"hid.retried",
+	"hid.failed",
+	"device.recovered"
+};
+
+const char *Stats::healthNames_[] = {
+	"ready",
+	"degraded",
+	"recovering",
+	"disconnected",
+	"failed"
+};
+
+std::atomic<uint64_t> Stats::counters_[Stats::COUNTERS];
+std::atomic<uint64_t> Stats::buckets_[Stats::HISTOGRAMS][Stats::BUCKETS];
+std::atomic<uint64_t> Stats::max_[Stats::HISTOGRAMS];
+std::mutex Stats::mutex_;
+std::map<std::string, Stats::Timing> Stats::timings_;
+std::map<std::string, Health> Stats::health_;
+const Stats::Clock::time_point Stats::start_ = Stats::Clock::now();
+
+void Stats::addTiming(std::string name, Clock::duration duration) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto &timing = timings_[name];
+	timing.count++;
+	timing.total += duration;
+	timing.max = std::max(timing.max, duration);
+}
+
+void Stats::setHealth(std::string device, Health health) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	health_[device] = health;
+}
+
+void Stats::removeHealth(std::string device) {
+	std::lock_guard<std::mutex> lock(mutex_);
+	health_.erase(device);
+}
+
+void Stats::record(Histogram histogram, Clock::duration duration) {
+	int index = static_cast<int>(histogram);
+	uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(duration).count();
+	int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	bucket = bucket < BUCKETS ? bucket : BUCKETS - 1;
+	buckets_[index][bucket].fetch_add(1, std::memory_order_relaxed);
+	uint64_t max = max_[index].load(std::memory_order_relaxed);
+
+	while (ns > max && !max_[index].compare_exchange_weak(max, ns, std::memory_order_relaxed)) {
+	}
+}
+
+void Stats::increment(Counter counter, uint64_t count) {
+	counters_[static_cast<int>(counter)].fetch_add(count, std::memory_order_relaxed);
+}
+
+/*
+ * Returns the upper bound of the bucket, which contains the percentile.
+ */
+uint64_t Stats::getPercentile(int histogram, uint64_t count, double percentile) {
+	uint64_t target = count * percentile, seen = 0;
+
+	for (int bucket = 0; bucket < BUCKETS; bucket++) {
+		seen += buckets_[histogram][bucket].load(std::memory_order_relaxed);
+
+		if (seen > target) {
+			return bucket ? (1ULL << bucket) - 1 : 0;
+		}
+	}
+
+	return max_[histogram];
+}
+
+Stats::Clock::duration Stats::getUptime() {
+	return Clock::now() - start_;
+}
+
+double Stats::toMs(Clock::duration duration) {
+	return std::chrono::duration_cast<std::chrono::duration<double, std::milli>>(duration).count();
+}
+
+void Stats::dump() {
+	std::lock_guard<std::mutex> lock(mutex_);
+	std::clog << "Statistics after " << toMs(getUptime()) << " ms:" << std::endl;
+
+	for (auto &it : timings_) {
+		std::clog << "  " << it.first << ": " << it.second.count << " samples, "
+			  << toMs(it.second.total) << " ms total, "
+			  << toMs(it.second.max) << " ms max" << std::endl;
+	}
+
+	for (auto &it : health_) {
+		std::clog << "  device " << it.first << ": " << healthNames_[static_cast<int>(it.second)] << std::endl;
+	}
+
+	for (int counter = 0; counter < COUNTERS; counter++) {
+		uint64_t count = counters_[counter].load(std::memory_order_relaxed);
+
+		if (count) {
+			std::clog << "  " << counterNames_[counter] << ": " << count << std::endl;
+		}
+	}
+
+	for (int histogram = 0; histogram < HISTOGRAMS; histogram++) {
+		uint64_t count = 0;
+
+		for (auto &bucket : buckets_[histogram]) {
+			count += bucket.load(std::memory_order_relaxed);
+		}
+
+		if (!count) {
+			continue;
+		}
+
+		std::clog << "  " << histogramNames_[histogram] << ": " << count << " samples, p50 < "
+			  << getPercentile(histogram, count, 0.5) << " ns, p99 < "
+			  << getPercentile(histogram, count, 0.99) << " ns, max "
+			  << max_[histogram] << " ns" << std::endl;
+	}
+}
@@ -0,0 +1,179 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef STATS_CLASS_H
+#define STATS_CLASS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+
+/**
+ * Enum class of latency histograms, which are cheap enough to be recorded on
+ * hot paths.
+ *
+ * @var Decode decoding a single HID report
+ * @var Passthrough time from input of a grabbed device to output
+ */
+enum class Histogram {
+	Decode,
+	Passthrough,
+	Count
+};
+
+/**
+ * Enum class of event counters, which are cheap enough to be updated on hot
+ * paths.
+ *
+ * @var HotPathFaults page faults seen on hot paths
+ * @var HotPathAllocations heap allocations seen on hot paths
+ * @var MacroEventsRemoved key events removed by the macro optimizer
+ * @var MacroSleepsRemoved delays removed by the macro optimizer
+ * @var MacroDelayChanged microseconds of delay added or removed by quantizing
+ * @var MacroFramesCollapsed key events sharing an input frame with the next one
+ * @var WakeupHid listen thread woken up by a HID report
+ * @var WakeupInputEvent listen thread woken up by the input event node
+ * @var WakeupRequest listen thread woken up by a profile switch or disconnect
+ * @var WakeupTimer listen thread woken up by a binding timeout
+ * @var WakeupProfiles listen thread woken up by changed profile directories
+ * @var WakeupSpurious any thread woken up without a reason, e.g. by EINTR
+ * @var WakeupUdev monitor woken up by udev
+ * @var WakeupFocus monitor woken up by a focus event
+ * @var WakeupSignal monitor woken up by a signal or a device to recover
+ * @var WakeupWorkdir monitor woken up while waiting for the working directory
+ * @var WakeupExpiry monitor woken up to drop a disconnected device
+ * @var WakeupOutput output writer woken up by a producer
+ * @var OutputThrottled macro events delayed by a rate limit
+ * @var OutputRetried writes to a virtual input device retried, e.g. after
+ * EAGAIN
+ * @var OutputDropped events, which couldn't be written
+ * @var HidRetried HID requests retried after a transient error
+ * @var HidFailed HID requests, which have failed for good
+ * @var DeviceRecovered devices reopened after I/O errors
+ */
+enum class Counter {
+	HotPathFaults,
+	HotPathAllocations,
+	MacroEventsRemoved,
+	MacroSleepsRemoved,
+	MacroDelayChanged,
+	MacroFramesCollapsed,
+	WakeupHid,
+	WakeupInputEvent,
+	WakeupRequest,
+	WakeupTimer,
+	WakeupProfiles,
+	WakeupSpurious,
+	WakeupUdev,
+	WakeupFocus,
+	WakeupSignal,
+	WakeupWorkdir,
+	WakeupExpiry,
+	WakeupOutput,
+	OutputThrottled,
+	OutputRetried,
+	OutputDropped,
+	HidRetried,
+	HidFailed,
+	DeviceRecovered,
+	Count
+};
+
+/**
+ * Enum class of device health states.
+ *
+ * @var Ready device is working
+ * @var Degraded HID requests fail, e.g. LEDs can't be set, input still works
+ * @var Recovering device nodes get reopened after I/O errors
+ * @var Disconnected device has been unplugged
+ * @var Failed device couldn't be recovered
+ */
+enum class Health {
+	Ready,
+	Degraded,
+	Recovering,
+	Disconnected,
+	Failed,
+	Count
+};
+
+/**
+ * Class collecting runtime statistics of the daemon.
+ *
+ * Statistics are written to the log on SIGUSR1 and on shutdown.
+ */
+class Stats {
+	public:
+		typedef std::chrono::steady_clock Clock;
+
+		/**
+		 * Adds a sample to a named timing.
+		 */
+		static void addTiming(std::string name, Clock::duration duration);
+
+		/**
+		 * Adds a sample to a histogram. Lock-free, samples are sorted into
+		 * power of 2 nanosecond buckets.
+		 */
+		static void record(Histogram histogram, Clock::duration duration);
+
+		/**
+		 * Adds to a counter. Lock-free.
+		 */
+		static void increment(Counter counter, uint64_t count = 1);
+
+		/**
+		 * Sets the health state of a device.
+		 */
+		static void setHealth(std::string device, Health health);
+
+		/**
+		 * Forgets a device, which has been dropped.
+		 */
+		static void removeHealth(std::string device);
+
+		/**
+		 * Returns the time passed since the daemon has been started.
+		 */
+		static Clock::duration getUptime();
+
+		/**
+		 * Converts a duration to milliseconds, for printing.
+		 */
+		static double toMs(Clock::duration duration);
+
+		/**
+		 * Writes all statistics to the log.
+		 */
+		static void dump();
+
+	private:
+		struct Timing {
+			unsigned long count;
+			Clock::duration total, max;
+		};
+
+		static const int BUCKETS = 64;
+		static const int HISTOGRAMS = static_cast<int>(Histogram::Count);
+		static const int COUNTERS = static_cast<int>(Counter::Count);
+		static const char *histogramNames_[HISTOGRAMS];
+		static const char *counterNames_[COUNTERS];
+		static const char *healthNames_[static_cast<int>(Health::Count)];
+		static std::atomic<uint64_t> counters_[COUNTERS];
+		static std::atomic<uint64_t> buckets_[HISTOGRAMS][BUCKETS];
+		static std::atomic<uint64_t> max_[HISTOGRAMS];
+		static std::mutex mutex_;
+		static std::map<std::string, Timing> timings_;
+		static std::map<std::string, Health> health_;
+		static const Clock::time_point start_;
+		static uint64_t getPercentile(int histogram, uint64_t count, double percentile);
+};
+
+#endif
@@ -0,0 +1,66 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <algorithm>
+#include <ctime>
+
+#include <core/token_bucket.hpp>
+
+/* constants */
+constexpr auto NS_PER_SECOND =	1000000000ULL;
+
+void TokenBucket::configure(int rate, int burst) {
+	interval_ = rate > 0 ? NS_PER_SECOND / rate : 0;
+	capacity_ = interval_ * std::max(burst, 1);
+}
+
+bool TokenBucket::isLimited() const {
+	return interval_ != 0;
+}
+
+/*
+ * An empty bucket is full again at now + capacity. Taking tokens moves that
+ * point further into the future, waiting is needed, once it goes beyond.
+ */
+uint64_t TokenBucket::take(int count) {
+	uint64_t interval = interval_;
+
+	if (!interval || count <= 0) {
+		return 0;
+	}
+
+	uint64_t current = now();
+	uint64_t capacity = capacity_;
+	uint64_t full = full_;
+	uint64_t next;
+
+	do {
+		next = std::max(full, current) + interval * count;
+	} while (!full_.compare_exchange_weak(full, next));
+
+	return next > current + capacity ? next - current - capacity : 0;
+}
+
+void TokenBucket::wait(uint64_t nanoseconds) {
+	struct timespec request;
+	request.tv_sec = nanoseconds / NS_PER_SECOND;
+	request.tv_nsec = nanoseconds % NS_PER_SECOND;
+	nanosleep(&request, nullptr);
+}
+
+uint64_t TokenBucket::now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return static_cast<uint64_t>(now.tv_sec) * NS_PER_SECOND + now.tv_nsec;
+}
+
+TokenBucket::TokenBucket() {
+	interval_ = 0;
+	capacity_ = 0;
+	full_ = 0;
+}
@@ -0,0 +1,51 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef TOKEN_BUCKET_CLASS_H
+#define TOKEN_BUCKET_CLASS_H
+
+#include <atomic>
+#include <cstdint>
+
+/**
+ * Class limiting the rate of output events.
+ *
+ * The bucket holds up to burst tokens and refills at rate tokens per second.
+ * Instead of a token count, it stores the time at which it would be full again,
+ * so taking tokens is a single compare-and-swap and the bucket can be shared by
+ * all playback threads of a device.
+ */
+class TokenBucket {
+	public:
+		/**
+		 * @param rate events per second, 0 disables the limit
+		 * @param burst events, which can be sent without delay
+		 */
+		void configure(int rate, int burst);
+		bool isLimited() const;
+
+		/**
+		 * Takes tokens for count events. Callers wait before sending
+		 * them, tokens are taken either way.
+		 * @return nanoseconds to wait, 0 if there were enough tokens
+		 */
+		uint64_t take(int count);
+
+		/**
+		 * Sleeps for the given number of nanoseconds.
+		 */
+		static void wait(uint64_t nanoseconds);
+		TokenBucket();
+
+	private:
+		std::atomic<uint64_t> interval_; /**< nanoseconds per token */
+		std::atomic<uint64_t> capacity_; /**< nanoseconds of burst */
+		std::atomic<uint64_t> full_; /**< CLOCK_MONOTONIC nanoseconds */
+		static uint64_t now();
+};
+
+#endif
@@ -0,0 +1,464 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include <core/uring_engine.hpp>
+
+/* constants */
+constexpr auto RING_ENTRIES =	64;
+constexpr auto PROBE_OPS =	256;
+/* user_data of requests, which aren't reads, reads use their slot */
+constexpr auto TAG_TIMEOUT =	IO_MAX_SLOTS;
+constexpr auto TAG_CANCEL =	IO_MAX_SLOTS + 1;
+/* writes use TAG_WRITE + their index in writeResults_ */
+constexpr auto TAG_WRITE =	IO_MAX_SLOTS + 2;
+/* read or write at the current file position */
+constexpr auto CURRENT_POSITION =	static_cast<__u64>(-1);
+
+bool UringEngine::isReady() {
+	return ringFd_ >= 0;
+}
+
+int UringEngine::addReader(int fd, std::size_t size) {
+	for (int slot = 0; slot < IO_MAX_SLOTS; slot++) {
+		if (slots_[slot].state != SlotState::Free) {
+			continue;
+		}
+
+		/*
+		 * Reads on nonblocking files would complete with -EAGAIN. The
+		 * flags are shared with other users of the file, so they are
+		 * restored by removeReader().
+		 */
+		slots_[slot].flags = fcntl(fd, F_GETFL);
+		fcntl(fd, F_SETFL, slots_[slot].flags & ~O_NONBLOCK);
+
+		slots_[slot].fd = fd;
+		slots_[slot].size = size < IO_BUFFER_SIZE ? size : IO_BUFFER_SIZE;
+		slots_[slot].state = SlotState::Active;
+		slots_[slot].isWatcher = false;
+		slots_[slot].isReady = false;
+
+		return slot;
+	}
+
+	return -1;
+}
+
+int UringEngine::addWatcher(int fd) {
+	for (int slot = 0; slot < IO_MAX_SLOTS; slot++) {
+		if (slots_[slot].state != SlotState::Free) {
+			continue;
+		}
+
+		slots_[slot].fd = fd;
+		slots_[slot].flags = -1;
+		slots_[slot].size = 0;
+		slots_[slot].state = SlotState::Active;
+		slots_[slot].isWatcher = true;
+		slots_[slot].isReady = false;
+
+		return slot;
+	}
+
+	return -1;
+}
+
+void UringEngine::removeReader(int slot) {
+	if (slot < 0 || slot >= IO_MAX_SLOTS || slots_[slot].state == SlotState::Free) {
+		return;
+	}
+
+	slots_[slot].isReady = false;
+
+	if (slots_[slot].flags >= 0) {
+		fcntl(slots_[slot].fd, F_SETFL, slots_[slot].flags);
+	}
+
+	if (!slots_[slot].isPending) {
+		slots_[slot].state = SlotState::Free;
+
+		return;
+	}
+
+	/* the slot and its buffer are reused, once the cancelled read completed */
+	slots_[slot].state = SlotState::Closing;
+	struct io_uring_sqe *sqe = getSqe();
+
+	if (sqe) {
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = slot;
+		sqe->user_data = TAG_CANCEL;
+		enter(0);
+	}
+}
+
+/*
+ * Completed reads are kept in their slots, until they are returned. Their
+ * reads get re-armed on the next call, after the caller is done with the data.
+ */
+int UringEngine::wait(struct IoCompletion *completions, int max, int timeout) {
+	bool isReadyFound = false;
+	reap();
+
+	for (int slot = 0; slot < IO_MAX_SLOTS; slot++) {
+		if (slots_[slot].state == SlotState::Active && !slots_[slot].isPending && !slots_[slot].isReady) {
+			if (slots_[slot].isWatcher) {
+				armPoll(slot);
+			} else {
+				armRead(slot);
+			}
+		}
+
+		isReadyFound = isReadyFound || slots_[slot].isReady;
+	}
+
+	if (isReadyFound) {
+		if (toSubmit_) {
+			enter(0);
+		}
+	} else {
+		if (timeout >= 0) {
+			struct io_uring_sqe *sqe = getSqe();
+
+			if (sqe) {
+				/* completes after the timeout or with the next completion */
+				timeout_.tv_sec = timeout / 1000;
+				timeout_.tv_nsec = (timeout % 1000) * 1000000L;
+				sqe->opcode = IORING_OP_TIMEOUT;
+				sqe->fd = -1;
+				sqe->addr = reinterpret_cast<__u64>(&timeout_);
+				sqe->len = 1;
+				sqe->off = 1;
+				sqe->user_data = TAG_TIMEOUT;
+			}
+		}
+
+		enter(1);
+		reap();
+	}
+
+	int count = 0;
+
+	for (int slot = 0; slot < IO_MAX_SLOTS && count < max; slot++) {
+		if (!slots_[slot].isReady) {
+			continue;
+		}
+
+		slots_[slot].isReady = false;
+		completions[count].slot = slot;
+		completions[count].result = slots_[slot].result;
+		completions[count].data = slots_[slot].isWatcher ? nullptr : buffers_[slot];
+		count++;
+	}
+
+	return count;
+}
+
+void UringEngine::queueWrite(int fd, const void *data, std::size_t size, int *result) {
+	struct io_uring_sqe *sqe = getSqe();
+
+	if (!sqe) {
+		if (result) {
+			*result = -EAGAIN;
+		}
+
+		return;
+	}
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = fd;
+	sqe->addr = reinterpret_cast<__u64>(data);
+	sqe->len = size;
+	sqe->off = CURRENT_POSITION;
+	if (result) {
+		/* kept, if the write never completes */
+		*result = -ECANCELED;
+	}
+
+	sqe->user_data = TAG_WRITE + writeResults_.size();
+	writeResults_.push_back(result);
+	pendingWrites_++;
+}
+
+void UringEngine::flushWrites() {
+	while (pendingWrites_ > 0) {
+		if (enter(pendingWrites_) < 0 && errno != EINTR) {
+			break;
+		}
+
+		reap();
+	}
+
+	writeResults_.clear();
+}
+
+std::string UringEngine::getName() {
+	return "io_uring";
+}
+
+/*
+ * Without SQPOLL, the kernel only looks at submission entries in
+ * io_uring_enter(), so entries can be published before they're filled in.
+ */
+struct io_uring_sqe *UringEngine::getSqe() {
+	unsigned tail = *sqTail_;
+
+	if (tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_) {
+		/* submission queue is full, hand it to the kernel */
+		enter(0);
+
+		if (tail - __atomic_load_n(sqHead_, __ATOMIC_ACQUIRE) >= sqEntries_) {
+			return nullptr;
+		}
+	}
+
+	unsigned index = tail & *sqMask_;
+	struct io_uring_sqe *sqe = &sqes_[index];
+	std::memset(sqe, 0, sizeof(*sqe));
+	sqArray_[index] = index;
+	__atomic_store_n(sqTail_, tail + 1, __ATOMIC_RELEASE);
+	toSubmit_++;
+
+	return sqe;
+}
+
+void UringEngine::armRead(int slot) {
+	struct io_uring_sqe *sqe = getSqe();
+
+	if (!sqe) {
+		return;
+	}
+
+	sqe->opcode = IORING_OP_READ_FIXED;
+	sqe->fd = slots_[slot].fd;
+	sqe->addr = reinterpret_cast<__u64>(buffers_[slot]);
+	sqe->len = slots_[slot].size;
+	sqe->off = CURRENT_POSITION;
+	sqe->buf_index = slot;
+	sqe->user_data = slot;
+	slots_[slot].isPending = true;
+}
+
+/*
+ * Poll requests are one-shot, they get armed again like reads.
+ */
+void UringEngine::armPoll(int slot) {
+	struct io_uring_sqe *sqe = getSqe();
+
+	if (!sqe) {
+		return;
+	}
+
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = slots_[slot].fd;
+	sqe->poll_events = POLLOUT;
+	sqe->user_data = slot;
+	slots_[slot].isPending = true;
+}
+
+/*
+ * Submits all new entries and optionally waits for completions, with a single
+ * system call.
+ */
+int UringEngine::enter(unsigned minComplete) {
+	unsigned flags = minComplete ? IORING_ENTER_GETEVENTS : 0;
+	int submitted = syscall(__NR_io_uring_enter, ringFd_, toSubmit_, minComplete, flags, nullptr, 0);
+
+	if (submitted > 0) {
+		toSubmit_ -= submitted;
+	}
+
+	return submitted;
+}
+
+void UringEngine::reap() {
+	unsigned head = *cqHead_;
+
+	while (head != __atomic_load_n(cqTail_, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &cqes_[head & *cqMask_];
+		__u64 tag = cqe->user_data;
+		int result = cqe->res;
+		__atomic_store_n(cqHead_, ++head, __ATOMIC_RELEASE);
+
+		if (tag >= TAG_WRITE) {
+			pendingWrites_--;
+			/* writes of an aborted flushWrites() have no result anymore */
+			if (tag - TAG_WRITE < writeResults_.size() && writeResults_[tag - TAG_WRITE]) {
+				*writeResults_[tag - TAG_WRITE] = result;
+			}
+		}
+
+		if (tag >= IO_MAX_SLOTS) {
+			continue;
+		}
+
+		struct Slot &slot = slots_[tag];
+		slot.isPending = false;
+
+		if (slot.state == SlotState::Closing) {
+			slot.state = SlotState::Free;
+		} else if (slot.state == SlotState::Active && result != -EAGAIN && result != -EINTR) {
+			slot.isReady = true;
+			slot.result = result;
+
+			/* don't spin on broken files, e.g. unplugged devices */
+			if (result <= 0) {
+				slot.state = SlotState::Failed;
+			}
+		}
+	}
+}
+
+bool UringEngine::setupRing() {
+	struct io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	ringFd_ = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+
+	if (ringFd_ < 0) {
+		return false;
+	}
+
+	sqRingSize_ = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	cqRingSize_ = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	sqesSize_ = params.sq_entries * sizeof(struct io_uring_sqe);
+	bool isSingleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+
+	if (isSingleMmap) {
+		sqRingSize_ = cqRingSize_ = sqRingSize_ > cqRingSize_ ? sqRingSize_ : cqRingSize_;
+	}
+
+	sqRing_ = mmap(nullptr, sqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQ_RING);
+
+	if (sqRing_ == MAP_FAILED) {
+		sqRing_ = nullptr;
+
+		return false;
+	}
+
+	if (isSingleMmap) {
+		cqRing_ = sqRing_;
+	} else {
+		cqRing_ = mmap(nullptr, cqRingSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_CQ_RING);
+
+		if (cqRing_ == MAP_FAILED) {
+			cqRing_ = nullptr;
+
+			return false;
+		}
+	}
+
+	void *sqes = mmap(nullptr, sqesSize_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd_, IORING_OFF_SQES);
+
+	if (sqes == MAP_FAILED) {
+		return false;
+	}
+
+	auto sq = static_cast<unsigned char *>(sqRing_);
+	auto cq = static_cast<unsigned char *>(cqRing_);
+	sqEntries_ = params.sq_entries;
+	sqHead_ = reinterpret_cast<unsigned *>(sq + params.sq_off.head);
+	sqTail_ = reinterpret_cast<unsigned *>(sq + params.sq_off.tail);
+	sqMask_ = reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+	sqArray_ = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+	sqes_ = static_cast<struct io_uring_sqe *>(sqes);
+	cqHead_ = reinterpret_cast<unsigned *>(cq + params.cq_off.head);
+	cqTail_ = reinterpret_cast<unsigned *>(cq + params.cq_off.tail);
+	cqMask_ = reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+	cqes_ = reinterpret_cast<struct io_uring_cqe *>(cq + params.cq_off.cqes);
+
+	if (!isSupported()) {
+		return false;
+	}
+
+	/* buffer of slot n is registered with index n */
+	struct iovec iovecs[IO_MAX_SLOTS];
+
+	for (int slot = 0; slot < IO_MAX_SLOTS; slot++) {
+		iovecs[slot].iov_base = buffers_[slot];
+		iovecs[slot].iov_len = IO_BUFFER_SIZE;
+	}
+
+	return syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_BUFFERS, iovecs, IO_MAX_SLOTS) == 0;
+}
+
+/*
+ * Checks, if the kernel supports all needed operations. Probing itself is
+ * available since Linux 5.6, just like IORING_OP_WRITE.
+ */
+bool UringEngine::isSupported() {
+	std::vector<unsigned char> buf(sizeof(struct io_uring_probe) + PROBE_OPS * sizeof(struct io_uring_probe_op));
+	auto probe = reinterpret_cast<struct io_uring_probe *>(buf.data());
+
+	if (syscall(__NR_io_uring_register, ringFd_, IORING_REGISTER_PROBE, probe, PROBE_OPS) < 0) {
+		return false;
+	}
+
+	for (int op : {IORING_OP_READ_FIXED, IORING_OP_WRITE, IORING_OP_POLL_ADD, IORING_OP_TIMEOUT, IORING_OP_ASYNC_CANCEL}) {
+		if (op > probe->last_op || !(probe->ops[op].flags & IO_URING_OP_SUPPORTED)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+UringEngine::UringEngine() {
+	ringFd_ = -1;
+	sqRing_ = cqRing_ = nullptr;
+	sqes_ = nullptr;
+	sqRingSize_ = cqRingSize_ = sqesSize_ = 0;
+	toSubmit_ = 0;
+	pendingWrites_ = 0;
+	writeResults_.reserve(RING_ENTRIES);
+
+	for (auto &slot : slots_) {
+		slot.fd = -1;
+		slot.size = 0;
+		slot.state = SlotState::Free;
+		slot.isWatcher = false;
+		slot.isPending = false;
+		slot.isReady = false;
+		slot.result = 0;
+	}
+
+	if (!setupRing() && ringFd_ >= 0) {
+		close(ringFd_);
+		ringFd_ = -1;
+	}
+}
+
+UringEngine::~UringEngine() {
+	/* closing the ring cancels all reads in flight */
+	if (ringFd_ >= 0) {
+		close(ringFd_);
+	}
+
+	if (sqes_) {
+		munmap(sqes_, sqesSize_);
+	}
+
+	if (cqRing_ && cqRing_ != sqRing_) {
+		munmap(cqRing_, cqRingSize_);
+	}
+
+	if (sqRing_) {
+		munmap(sqRing_, sqRingSize_);
+	}
+}
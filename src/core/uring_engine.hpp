@@ -0,0 +1,94 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef URING_ENGINE_CLASS_H
+#define URING_ENGINE_CLASS_H
+
+#include <cstddef>
+#include <vector>
+
+#include <linux/io_uring.h>
+
+#include <core/io_engine.hpp>
+
+/**
+ * I/O engine based on io_uring, using the raw system calls.
+ *
+ * Every reader has a read into its registered buffer in flight, every watcher
+ * a poll request. Reads are
+ * re-armed and submitted by the same io_uring_enter() call, which waits for
+ * their completion, so a wakeup costs a single system call. Queued writes are
+ * submitted together by flushWrites().
+ */
+class UringEngine : public IoEngine {
+	public:
+		/**
+		 * Returns false, if io_uring couldn't be set up. The engine must
+		 * not be used then.
+		 */
+		bool isReady();
+		int addReader(int fd, std::size_t size);
+		int addWatcher(int fd);
+		void removeReader(int slot);
+		int wait(struct IoCompletion *completions, int max, int timeout);
+		void queueWrite(int fd, const void *data, std::size_t size, int *result = nullptr);
+		void flushWrites();
+		std::string getName();
+		UringEngine();
+		~UringEngine();
+
+	private:
+		/**
+		 * Enum class describing the state of a reader slot.
+		 *
+		 * @var Free slot can be used
+		 * @var Active reads get re-armed
+		 * @var Failed last read failed, no more reads get armed
+		 * @var Closing removed, waiting for the cancelled read
+		 */
+		enum class SlotState {
+			Free,
+			Active,
+			Failed,
+			Closing
+		};
+
+		struct Slot {
+			int fd;
+			int flags; /**< file status flags to restore, -1 for watchers */
+			std::size_t size;
+			SlotState state;
+			bool isWatcher; /**< polls for POLLOUT instead of reading */
+			bool isPending;
+			bool isReady;
+			int result;
+		};
+
+		int ringFd_;
+		unsigned sqEntries_;
+		unsigned *sqHead_, *sqTail_, *sqMask_, *sqArray_;
+		unsigned *cqHead_, *cqTail_, *cqMask_;
+		struct io_uring_sqe *sqes_;
+		struct io_uring_cqe *cqes_;
+		void *sqRing_, *cqRing_;
+		std::size_t sqRingSize_, cqRingSize_, sqesSize_;
+		unsigned toSubmit_;
+		int pendingWrites_;
+		std::vector<int *> writeResults_; /**< indexed by user_data - TAG_WRITE */
+		struct __kernel_timespec timeout_;
+		struct Slot slots_[IO_MAX_SLOTS];
+		unsigned char buffers_[IO_MAX_SLOTS][IO_BUFFER_SIZE];
+		bool setupRing();
+		bool isSupported();
+		struct io_uring_sqe *getSqe();
+		void armRead(int slot);
+		void armPoll(int slot);
+		int enter(unsigned minComplete);
+		void reap();
+};
+
+#endif
@@ -6,6 +6,7 @@
  */
 
 #include <cstdio>
+#include <cstring>
 #include <iostream>
 
 #include <fcntl.h>
@@ -17,38 +18,41 @@
 
 #include "virtual_input.hpp"
 
-/**
- * Method for sending input events to the operating system.
- *
- * @param type type of input event, e.g. EV_KEY
- * @param code keycode defined in header file input.h
- * @param value value the event carries, e.g. EV_KEY: 0 represents release, 1
- * keypress and 2 autorepeat
- */
-void VirtualInput::sendEvent(short type, short code, int value) {
-	struct input_event inev = input_event();
-	inev.type = type;
-	inev.code = code;
-	inev.value = value;
-	write(uifd_, &inev, sizeof(struct input_event));
-	inev.type = EV_SYN;
-	inev.code = 0;
-	inev.value = 0;
-	write(uifd_, &inev, sizeof(struct input_event));
+/* constants */
+constexpr auto UINPUT_NAME =	"Sidewinderd";
+
+int VirtualInput::getFd() {
+	return uifd_;
+}
+
+const KeyBitmap &VirtualInput::getKeys() {
+	return keys_;
+}
+
+bool VirtualInput::hasMotion() {
+	return hasMotion_;
 }
 
 /**
  * Constructor setting up operating system specific back-ends.
+ *
+ * @param device device to mimic or nullptr for a device shared by multiple
+ * keyboards
+ * @param keys keys the device should advertise
+ * @param hasMotion whether the device should advertise relative axes
  */
-VirtualInput::VirtualInput(struct Device *device, sidewinderd::DevNode *devNode, Process *process) {
+VirtualInput::VirtualInput(struct Device *device, const KeyBitmap &keys, bool hasMotion, Process *process) {
 	process_ = process;
-	device_ = device;
-	devNode_ = devNode;
+	keys_ = keys;
+	hasMotion_ = hasMotion;
+	vendor_ = device ? std::stoi(device->vendor, nullptr, 16) : 0;
+	product_ = device ? std::stoi(device->product, nullptr, 16) : 0;
 	/* for Linux */
 	createUidev();
 }
 
 VirtualInput::~VirtualInput() {
+	ioctl(uifd_, UI_DEV_DESTROY);
 	close(uifd_);
 }
 
@@ -57,43 +61,68 @@ VirtualInput::~VirtualInput() {
  */
 void VirtualInput::createUidev() {
 	/* open uinput device with root privileges */
-	process_->privilege();
-	uifd_ = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+	uifd_ = process_->openPrivileged("/dev/uinput", O_WRONLY | O_NONBLOCK);
 
 	if (uifd_ < 0) {
-		uifd_ = open("/dev/input/uinput", O_WRONLY | O_NONBLOCK);
+		uifd_ = process_->openPrivileged("/dev/input/uinput", O_WRONLY | O_NONBLOCK);
 
 		if (uifd_ < 0) {
 			std::cout << "Can't open uinput" << std::endl;
 		}
 	}
 
-	process_->unprivilege();
-	/* set all keybits */
+	setupUidev();
+}
+
+/*
+ * There is no ioctl for setting multiple keybits at once, so only keys
+ * contained in the precomputed bitmap get set, skipping whole empty words.
+ */
+void VirtualInput::setupUidev() {
 	ioctl(uifd_, UI_SET_EVBIT, EV_KEY);
 
-	for (int i = KEY_ESC; i <= KEY_KPDOT; i++) {
-		ioctl(uifd_, UI_SET_KEYBIT, i);
+	/*
+	 * Pointer motion and wheels of macros. Relative axes make the device
+	 * look like a mouse, so they are only advertised if needed.
+	 */
+	if (hasMotion_) {
+		ioctl(uifd_, UI_SET_EVBIT, EV_REL);
+
+		for (auto axis : {REL_X, REL_Y, REL_WHEEL, REL_HWHEEL}) {
+			ioctl(uifd_, UI_SET_RELBIT, axis);
+		}
 	}
 
-	for (int i = KEY_ZENKAKUHANKAKU; i <= KEY_F24; i++) {
-		ioctl(uifd_, UI_SET_KEYBIT, i);
+	for (int word = 0; word < KEY_BITMAP_WORDS; word++) {
+		for (auto bits = keys_.words[word]; bits; bits &= bits - 1) {
+			ioctl(uifd_, UI_SET_KEYBIT, word * 64 + __builtin_ctzll(bits));
+		}
 	}
 
-	for (int i = KEY_PLAYCD; i <= KEY_MICMUTE; i++) {
-		ioctl(uifd_, UI_SET_KEYBIT, i);
+	int ret = -1;
+
+#ifdef UI_DEV_SETUP
+	/* uinput device details, using the UI_DEV_SETUP API of uinput 5 */
+	struct uinput_setup setup = uinput_setup();
+	snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "%s", UINPUT_NAME);
+	setup.id.bustype = BUS_USB;
+	setup.id.vendor = vendor_;
+	setup.id.product = product_;
+	setup.id.version = 1;
+	ret = ioctl(uifd_, UI_DEV_SETUP, &setup);
+#endif
+
+	if (ret < 0) {
+		/* fall back to writing uinput device details on older kernels */
+		struct uinput_user_dev uidev = uinput_user_dev();
+		snprintf(uidev.name, UINPUT_MAX_NAME_SIZE, "%s", UINPUT_NAME);
+		uidev.id.bustype = BUS_USB;
+		uidev.id.vendor = vendor_;
+		uidev.id.product = product_;
+		uidev.id.version = 1;
+		write(uifd_, &uidev, sizeof(struct uinput_user_dev));
 	}
 
-	/* uinput device details */
-	struct uinput_user_dev uidev = uinput_user_dev();
-	/* TODO: copy device's name */
-	snprintf(uidev.name, UINPUT_MAX_NAME_SIZE, "Sidewinderd");
-	uidev.id.bustype = BUS_USB;
-	uidev.id.vendor = std::stoi(device_->vendor, nullptr, 16);
-	uidev.id.product = std::stoi(device_->product, nullptr, 16);
-	uidev.id.version = 1;
-	/* write uinput device details */
-	write(uifd_, &uidev, sizeof(struct uinput_user_dev));
 	/* create uinput device */
 	ioctl(uifd_, UI_DEV_CREATE);
 }
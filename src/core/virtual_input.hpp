@@ -8,28 +8,49 @@
 #ifndef VIRTUALINPUT_CLASS_H
 #define VIRTUALINPUT_CLASS_H
 
+#include <linux/input.h>
+
 #include <process.hpp>
-#include <device_data.hpp>
 #include <core/device.hpp>
+#include <core/key_bitmap.hpp>
 
 /**
  * Class representing a virtual input device.
  *
  * Needed to send key events to the operating system. For Linux, uinput is used
- * as the back-end.
+ * as the back-end. Virtual input devices are owned by OutputMux, which is the
+ * only one writing to them.
  */
 class VirtualInput {
 	public:
-		void sendEvent(short type, short code, int value);
-		VirtualInput(struct Device *device, sidewinderd::DevNode *devNode, Process *process);
+		/**
+		 * Returns the uinput file descriptor, which accepts input events
+		 * including their SYN_REPORT events.
+		 */
+		int getFd();
+
+		/**
+		 * Returns the keys advertised by the device. They are fixed,
+		 * once the device has been created.
+		 */
+		const KeyBitmap &getKeys();
+
+		/**
+		 * Returns, whether the device advertises relative axes.
+		 */
+		bool hasMotion();
+		VirtualInput(struct Device *device, const KeyBitmap &keys, bool hasMotion, Process *process);
 		~VirtualInput();
 
 	private:
 		int uifd_; /**< uinput device file descriptor */
+		int vendor_; /**< USB vendor ID advertised by the device */
+		int product_; /**< USB product ID advertised by the device */
+		KeyBitmap keys_; /**< key capabilities */
+		bool hasMotion_; /**< relative axis capabilities */
 		Process *process_; /**< process object for setting privileges */
-		Device *device_; /**< device information */
-		sidewinderd::DevNode *devNode_; /**< device information */
 		void createUidev();
+		void setupUidev();
 };
 
 #endif
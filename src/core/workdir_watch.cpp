@@ -0,0 +1,104 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <iostream>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/inotify.h>
+
+#include <core/workdir_watch.hpp>
+
+/* constants */
+constexpr auto WATCH_EVENTS =	IN_CREATE | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+
+bool WorkdirWatch::watch(std::string path) {
+	close();
+	path_ = path;
+	fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	mountFd_ = open("/proc/self/mountinfo", O_RDONLY | O_CLOEXEC);
+
+	if (fd_ < 0) {
+		std::cerr << "Can't watch " << path_ << std::endl;
+		close();
+
+		return false;
+	}
+
+	addWatch();
+
+	return true;
+}
+
+/*
+ * Notifications are only used as a hint, the path is checked again and the
+ * watch moves on to the new deepest existing parent.
+ */
+bool WorkdirWatch::update() {
+	char buf[4096];
+
+	while (fd_ >= 0 && read(fd_, buf, sizeof(buf)) > 0) {
+	}
+
+	if (access(path_.c_str(), F_OK)) {
+		addWatch();
+
+		return false;
+	}
+
+	close();
+
+	return true;
+}
+
+int WorkdirWatch::getFd() {
+	return fd_;
+}
+
+int WorkdirWatch::getMountFd() {
+	return mountFd_;
+}
+
+void WorkdirWatch::addWatch() {
+	std::string parent = path_;
+
+	while (parent.size() > 1 && access(parent.c_str(), F_OK)) {
+		auto pos = parent.find_last_of('/');
+		parent = pos == std::string::npos ? "." : pos ? parent.substr(0, pos) : "/";
+	}
+
+	if (wd_ >= 0) {
+		inotify_rm_watch(fd_, wd_);
+	}
+
+	wd_ = inotify_add_watch(fd_, parent.c_str(), WATCH_EVENTS);
+}
+
+void WorkdirWatch::close() {
+	if (fd_ >= 0) {
+		::close(fd_);
+	}
+
+	if (mountFd_ >= 0) {
+		::close(mountFd_);
+	}
+
+	fd_ = -1;
+	mountFd_ = -1;
+	wd_ = -1;
+}
+
+WorkdirWatch::WorkdirWatch() {
+	fd_ = -1;
+	mountFd_ = -1;
+	wd_ = -1;
+}
+
+WorkdirWatch::~WorkdirWatch() {
+	close();
+}
@@ -0,0 +1,49 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#ifndef WORKDIR_WATCH_CLASS_H
+#define WORKDIR_WATCH_CLASS_H
+
+#include <string>
+
+/**
+ * Class waiting for a directory to appear, e.g. an encrypted home directory,
+ * which gets mounted on login.
+ *
+ * The deepest existing parent directory is watched with inotify, mounts are
+ * noticed through /proc/self/mountinfo. Both file descriptors are meant to be
+ * polled by the caller, inotify for POLLIN and mountinfo for POLLPRI.
+ */
+class WorkdirWatch {
+	public:
+		/**
+		 * Starts watching for a path.
+		 * @return false, if the watch couldn't be set up
+		 */
+		bool watch(std::string path);
+
+		/**
+		 * Handles pending notifications, must be called, whenever one of
+		 * the file descriptors is ready.
+		 * @return true, once the path exists
+		 */
+		bool update();
+		int getFd();
+		int getMountFd();
+		WorkdirWatch();
+		~WorkdirWatch();
+
+	private:
+		std::string path_;
+		int fd_;
+		int mountFd_;
+		int wd_;
+		void addWatch();
+		void close();
+};
+
+#endif
@@ -17,6 +17,7 @@ namespace sidewinderd {
 	 */
 	struct DevNode {
 		std::string hidraw, inputEvent; /**< path to hidraw and input event */
+		std::string serial; /**< USB serial number or physical path, if there's none */
 	};
 };
 
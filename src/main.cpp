@@ -10,10 +10,9 @@
 
 #include <getopt.h>
 
-#include <libconfig.h++>
-
 #include <process.hpp>
 #include <core/device_manager.hpp>
+#include <core/settings.hpp>
 
 void help(std::string name) {
 	std::cerr << "Usage: " << name << " [options]" << std::endl
@@ -25,34 +24,6 @@ void help(std::string name) {
 		  << "  -v, --version         Print program version" << std::endl;
 }
 
-void setupConfig(libconfig::Config *config, std::string configFilePath = "/etc/sidewinderd.conf") {
-	try {
-		config->readFile(configFilePath.c_str());
-	} catch (const libconfig::FileIOException &fioex) {
-		std::cerr << "I/O error while reading file." << std::endl;
-	} catch (const libconfig::ParseException &pex) {
-		std::cerr << "Parse error at " << pex.getFile() << ":" << pex.getLine() << " - " << pex.getError() << std::endl;
-	}
-
-	libconfig::Setting &root = config->getRoot();
-
-	if (!root.exists("user")) {
-		root.add("user", libconfig::Setting::TypeString) = "root";
-	}
-
-	if (!root.exists("capture_delays")) {
-		root.add("capture_delays", libconfig::Setting::TypeBoolean) = true;
-	}
-
-	if (!root.exists("pid-file")) {
-		root.add("pid-file", libconfig::Setting::TypeString) = "/var/run/sidewinderd.pid";
-	}
-
-	if (!root.exists("encrypted_workdir")) {
-		root.add("encrypted_workdir", libconfig::Setting::TypeBoolean) = false;
-	}
-}
-
 int main(int argc, char *argv[]) {
 	/* object for managing runtime information */
 	Process process;
@@ -70,7 +41,7 @@ int main(int argc, char *argv[]) {
 	};
 
 	int opt, index = 0;
-	std::string configFilePath;
+	std::string configFilePath = "/etc/sidewinderd.conf";
 
 	/* flags */
 	bool shouldDaemonize = false;
@@ -101,14 +72,10 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
-	/* reading config file */
-	libconfig::Config config;
-
-	if (configFilePath.empty()) {
-		setupConfig(&config);
-	} else {
-		setupConfig(&config, configFilePath);
-	}
+	/* reading config file, SIGHUP reloads it */
+	SettingsStore settings;
+	settings.load(configFilePath);
+	const Settings *config = settings.get();
 
 	/* daemonize, if flag has been set */
 	if (shouldDaemonize) {
@@ -122,28 +89,22 @@ int main(int argc, char *argv[]) {
 	}
 
 	/* creating pid file for single instance mechanism */
-	if (process.createPid(config.lookup("pid-file"))) {
+	if (process.createPid(config->pidFile)) {
 		return EXIT_FAILURE;
 	}
 
 	/* setting gid and uid to configured user */
-	process.applyUser(config.lookup("user"));
+	process.applyUser(config->user);
 
 	// setting up working directory
-	std::string workdir;
-
-	if (config.exists("workdir")) {
-		workdir = config.lookup("workdir").c_str();
-	}
-
-	if (process.createWorkdir(workdir, config.lookup("encrypted_workdir"))) {
+	if (process.createWorkdir(config->workdir, config->isEncryptedWorkdir)) {
 		return EXIT_FAILURE;
 	}
 
 	std::clog << "Started sidewinderd." << std::endl;
 	process.setActive(true);
 
-	DeviceManager deviceManager(&config, &process);
+	DeviceManager deviceManager(&settings, &process);
 
 	deviceManager.monitor();
 	process.destroyPid();
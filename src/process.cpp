@@ -5,14 +5,14 @@
  * MIT License. For more information, see LICENSE file.
  */
 
-#include <chrono>
+#include <cerrno>
 #include <csignal>
 #include <iostream>
-#include <thread>
 
 #include <fcntl.h>
 #include <unistd.h>
 
+#include <sys/eventfd.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -21,9 +21,11 @@
 
 /* constants */
 constexpr auto version =	"0.4.0";
-constexpr auto wait =		1;
 
 std::atomic<bool> Process::isActive_;
+std::atomic<bool> Process::isStatsRequested_;
+std::atomic<bool> Process::isReloadRequested_;
+int Process::wakeFd_ = -1;
 
 bool Process::isActive() {
 	return isActive_;
@@ -33,6 +35,31 @@ void Process::setActive(bool isActive) {
 	isActive_ = isActive;
 }
 
+bool Process::isStatsRequested() {
+	return isStatsRequested_;
+}
+
+void Process::setStatsRequested(bool isStatsRequested) {
+	isStatsRequested_ = isStatsRequested;
+}
+
+bool Process::isReloadRequested() {
+	return isReloadRequested_;
+}
+
+void Process::setReloadRequested(bool isReloadRequested) {
+	isReloadRequested_ = isReloadRequested;
+}
+
+int Process::getWakeFd() {
+	return wakeFd_;
+}
+
+void Process::wake() {
+	uint64_t wake = 1;
+	write(wakeFd_, &wake, sizeof(wake));
+}
+
 std::string Process::getName() {
 	if (name_.empty()) {
 		name_ = "sidewinderd";
@@ -151,14 +178,38 @@ int Process::createWorkdir(std::string directory, bool isEncrypted) {
 		workdir.append(xdgData);
 	}
 
-	// wait until encrypted drive becomes available
-	if (isEncrypted) {
-		while (access(workdir.c_str(), F_OK)) {
-			std::this_thread::sleep_for(std::chrono::seconds(wait));
+	dataDir_ = workdir;
+
+	// devices are brought up, while waiting for an encrypted drive
+	if (isEncrypted && access(dataDir_.c_str(), F_OK)) {
+		if (workdirWatch_.watch(dataDir_)) {
+			std::clog << "Waiting for " << dataDir_ << " to become available." << std::endl;
+
+			return 0;
 		}
 	}
 
-	workdir.append("/sidewinderd");
+	return enterWorkdir();
+}
+
+bool Process::isWorkdirReady() {
+	return isWorkdirReady_;
+}
+
+WorkdirWatch *Process::getWorkdirWatch() {
+	return &workdirWatch_;
+}
+
+bool Process::updateWorkdir() {
+	if (isWorkdirReady_ || !workdirWatch_.update()) {
+		return false;
+	}
+
+	return !enterWorkdir();
+}
+
+int Process::enterWorkdir() {
+	std::string workdir = dataDir_ + "/sidewinderd";
 	mkdir(workdir.c_str(), S_IRWXU);
 
 	if (chdir(workdir.c_str())) {
@@ -167,6 +218,8 @@ int Process::createWorkdir(std::string directory, bool isEncrypted) {
 		return -1;
 	}
 
+	isWorkdirReady_ = true;
+
 	return 0;
 }
 
@@ -182,35 +235,68 @@ void Process::unprivilege() {
 	seteuid(pw_->pw_uid);
 }
 
+/*
+ * Devices are brought up concurrently, so switching privileges needs to be
+ * serialized. Otherwise, one thread could drop privileges, while another one
+ * is still opening its device node.
+ */
+int Process::openPrivileged(std::string path, int flags) {
+	std::lock_guard<std::mutex> lock(privilegeMutex_);
+	privilege();
+	int fd = open(path.c_str(), flags);
+	unprivilege();
+
+	return fd;
+}
+
 std::string Process::getVersion() {
 	return version;
 }
 
 void Process::sigHandler(int sig) {
-	std::cerr << std::endl << "Stop signal received." << std::endl;
-
 	switch(sig) {
 		case SIGINT:
+			std::cerr << std::endl << "Stop signal received." << std::endl;
 			setActive(false);
 			break;
 		case SIGTERM:
+			std::cerr << std::endl << "Stop signal received." << std::endl;
 			setActive(false);
 			break;
+		case SIGUSR1:
+			setStatsRequested(true);
+			break;
+		case SIGHUP:
+			setReloadRequested(true);
+			break;
 	}
+
+	/* write() is async-signal-safe, it wakes up the monitoring loop */
+	int savedErrno = errno;
+	uint64_t wake = 1;
+	write(wakeFd_, &wake, sizeof(wake));
+	errno = savedErrno;
 }
 
 Process::Process() {
 	isActive_ = false;
+	isStatsRequested_ = false;
+	isReloadRequested_ = false;
 	hasPid_ = false;
 	pidFd_ = 0;
+	isWorkdirReady_ = false;
+	wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
 
 	/* signal handling */
-	struct sigaction action;
+	struct sigaction action {};
 	action.sa_handler = sigHandler;
 	sigaction(SIGINT, &action, nullptr);
 	sigaction(SIGTERM, &action, nullptr);
+	sigaction(SIGUSR1, &action, nullptr);
+	sigaction(SIGHUP, &action, nullptr);
 }
 
 Process::~Process() {
 	destroyPid();
+	close(wakeFd_);
 }
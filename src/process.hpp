@@ -9,36 +9,82 @@
 #define PROCESS_CLASS_H
 
 #include <atomic>
+#include <mutex>
 #include <string>
 
 #include <pwd.h>
 
+#include <core/workdir_watch.hpp>
+
 class Process {
 	public:
 		static bool isActive();
 		static void setActive(bool isActive);
+		static bool isStatsRequested();
+		static void setStatsRequested(bool isStatsRequested);
+		static bool isReloadRequested();
+		static void setReloadRequested(bool isReloadRequested);
+
+		/**
+		 * Returns an eventfd, which becomes readable, whenever a signal
+		 * has been handled or wake() has been called.
+		 */
+		static int getWakeFd();
+
+		/**
+		 * Wakes up the monitoring loop, e.g. to recover a device.
+		 */
+		static void wake();
 		std::string getName();
 		void setName(std::string name);
 		int daemonize();
 		int createPid(std::string pidPath);
 		void destroyPid();
 		void applyUser(std::string user);
+
+		/**
+		 * Sets up the working directory and changes into it. Encrypted
+		 * working directories, which aren't available yet, are waited for
+		 * in the background, see updateWorkdir().
+		 * @return 0 on success, even if the directory is still pending
+		 */
 		int createWorkdir(std::string directory, bool isEncrypted);
+		bool isWorkdirReady();
+
+		/**
+		 * Returns the watch of a pending working directory.
+		 */
+		WorkdirWatch *getWorkdirWatch();
+
+		/**
+		 * Handles notifications of the workdir watch.
+		 * @return true, if the working directory has just become ready
+		 */
+		bool updateWorkdir();
 		void privilege();
 		void unprivilege();
+		int openPrivileged(std::string path, int flags);
 		std::string getVersion();
 		Process();
 		~Process();
 
 	private:
 		static std::atomic<bool> isActive_;
+		static std::atomic<bool> isStatsRequested_;
+		static std::atomic<bool> isReloadRequested_;
+		static int wakeFd_;
+		std::mutex privilegeMutex_;
 		bool hasPid_;
 		int pidFd_;
 		std::string name_;
 		std::string user_;
 		std::string pidPath_;
+		std::string dataDir_;
+		bool isWorkdirReady_;
+		WorkdirWatch workdirWatch_;
 		struct passwd *pw_;
 		static void sigHandler(int sig);
+		int enterWorkdir();
 };
 
 #endif
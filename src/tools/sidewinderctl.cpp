@@ -0,0 +1,751 @@
+/**
+ * Copyright (c) 2014 - 2016 Tolga Cakir <tolga@cevel.net>
+ *
+ * This source file is part of Sidewinder daemon and is distributed under the
+ * MIT License. For more information, see LICENSE file.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <dirent.h>
+#include <getopt.h>
+#include <tinyxml2.h>
+
+#include <sys/stat.h>
+
+#include <core/key.hpp>
+#include <core/macro.hpp>
+#include <core/macro_optimizer.hpp>
+#include <core/profile_bundle.hpp>
+#include <core/settings.hpp>
+
+/* constants */
+constexpr auto MAX_STEPS =	10000000;
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * Struct holding, what running a macro once does.
+ *
+ * @var duration sum of all delays in microseconds
+ * @var isEndless the macro didn't finish within MAX_STEPS instructions
+ */
+struct Estimate {
+	int64_t events;
+	int64_t duration;
+	bool isEndless;
+};
+
+/**
+ * Struct holding the outcome of a single file. Output is collected and printed
+ * in order, once all files are done.
+ *
+ * @var macro packed macro, key is 0 for files outside of the profile layout
+ */
+struct Job {
+	std::string path;
+	bool isOk;
+	std::string output;
+	BundleMacro macro;
+};
+
+/**
+ * Struct holding, what all jobs share. Settings and the optimizer are read
+ * only.
+ */
+struct Toolchain {
+	const Settings *settings;
+	const MacroOptimizer *optimizer;
+	bool isForced;
+};
+
+void help(std::string name) {
+	std::cerr << "Usage: " << name << " [options] <command> <path>..." << std::endl
+		  << std::endl
+		  << "Commands:" << std::endl
+		  << "  validate              Check, whether macros compile" << std::endl
+		  << "  compile               Compile s<n>.xml files to s<n>.bin" << std::endl
+		  << "  decompile             Convert s<n>.bin files back to s<n>.xml" << std::endl
+		  << "  stats                 Print events, duration and load times of macros" << std::endl
+		  << "  pack <dir> [bundle]   Pack the profile directories of dir into a bundle" << std::endl
+		  << "  unpack <bundle> [dir] Write the macros of a bundle to profile directories" << std::endl
+		  << std::endl
+		  << "Paths can be macro files or directories, e.g. a whole working directory." << std::endl
+		  << std::endl
+		  << "Options:" << std::endl
+		  << "  -c, --config=<file>   Use optimizer and text settings of a configuration file" << std::endl
+		  << "  -f, --force           Overwrite existing XML files when decompiling or unpacking" << std::endl
+		  << "  -j, --jobs=<n>        Number of files handled in parallel" << std::endl
+		  << "  -h, --help            Print this screen" << std::endl;
+}
+
+static bool hasSuffix(const std::string &path, const char *suffix) {
+	std::size_t length = std::strlen(suffix);
+
+	return path.size() >= length && !path.compare(path.size() - length, length, suffix);
+}
+
+static std::string replaceSuffix(const std::string &path, const char *suffix) {
+	return path.substr(0, path.rfind('.')) + suffix;
+}
+
+/*
+ * Directories are walked recursively, files given on the command line are
+ * taken as they are.
+ */
+static void collect(const std::string &path, const char *suffix, bool isExplicit, std::vector<std::string> *files) {
+	struct stat info;
+
+	if (stat(path.c_str(), &info)) {
+		std::cerr << "Can't access " << path << std::endl;
+
+		return;
+	}
+
+	if (!S_ISDIR(info.st_mode)) {
+		if (isExplicit || hasSuffix(path, suffix)) {
+			files->push_back(path);
+		}
+
+		return;
+	}
+
+	DIR *dir = opendir(path.c_str());
+
+	if (!dir) {
+		std::cerr << "Can't open " << path << std::endl;
+
+		return;
+	}
+
+	std::vector<std::string> names;
+
+	for (struct dirent *entry = readdir(dir); entry; entry = readdir(dir)) {
+		if (std::strcmp(entry->d_name, ".") && std::strcmp(entry->d_name, "..")) {
+			names.push_back(entry->d_name);
+		}
+	}
+
+	closedir(dir);
+	std::sort(names.begin(), names.end());
+
+	for (auto &name : names) {
+		collect(path + "/" + name, suffix, false, files);
+	}
+}
+
+/*
+ * Macros in profile_<n> directories are estimated for profile n, others for
+ * the first profile.
+ */
+static int getProfile(const std::string &path) {
+	std::size_t pos = path.rfind("profile_");
+
+	if (pos == std::string::npos) {
+		return 0;
+	}
+
+	return std::max(std::atoi(path.c_str() + pos + std::strlen("profile_")) - 1, 0);
+}
+
+/*
+ * Finds profile, layer and key of a file in the profile directory layout, i.e.
+ * profile_<n>/s<key>.xml or profile_<n>/layer_<l>/s<key>.xml.
+ */
+static bool parseLocation(const std::string &path, int *profile, int *layer, int *key) {
+	std::size_t pos = path.rfind("profile_");
+
+	if (pos == std::string::npos) {
+		return false;
+	}
+
+	const char *location = path.c_str() + pos;
+	int length = 0;
+
+	if (std::sscanf(location, "profile_%d/layer_%d/s%d.xml%n", profile, layer, key, &length) != 3 || location[length]) {
+		*layer = 0;
+		length = 0;
+
+		if (std::sscanf(location, "profile_%d/s%d.xml%n", profile, key, &length) != 2 || location[length]) {
+			return false;
+		}
+	}
+
+	(*profile)--;
+
+	return *profile >= 0 && *layer >= 0 && *key >= 1 && *key <= MAX_MACRO_KEYS;
+}
+
+/*
+ * Runs the program like MacroVm, without sending events or sleeping. Calls and
+ * WaitRelease don't count, as they depend on other macros and the user.
+ */
+static struct Estimate estimate(const std::vector<Instruction> &program, int profile) {
+	struct Estimate result = Estimate();
+	int32_t registers[VM_REGISTERS] = {};
+	std::size_t pc = 0;
+
+	for (int steps = 0; pc < program.size(); steps++) {
+		if (steps == MAX_STEPS) {
+			result.isEndless = true;
+			break;
+		}
+
+		const Instruction &instruction = program[pc++];
+
+		switch (instruction.opcode) {
+			case Opcode::End:
+				pc = program.size();
+				break;
+			case Opcode::Key:
+			case Opcode::Rel:
+				result.events++;
+				break;
+			case Opcode::Delay:
+				result.duration += instruction.value;
+				break;
+			case Opcode::Set:
+				registers[instruction.reg] = instruction.value;
+				break;
+			case Opcode::Add:
+				registers[instruction.reg] += instruction.value;
+				break;
+			case Opcode::Jump:
+				pc = instruction.value;
+				break;
+			case Opcode::JumpIfZero:
+				if (!registers[instruction.reg]) {
+					pc = instruction.value;
+				}
+
+				break;
+			case Opcode::JumpIfNotZero:
+				if (registers[instruction.reg]) {
+					pc = instruction.value;
+				}
+
+				break;
+			case Opcode::JumpUnlessProfile:
+				if (profile != instruction.arg) {
+					pc = instruction.value;
+				}
+
+				break;
+			case Opcode::WaitRelease:
+			case Opcode::Call:
+			case Opcode::Rate:
+				break;
+		}
+	}
+
+	return result;
+}
+
+/*
+ * XML files are parsed and compiled separately, so both steps can be timed.
+ * Compiled files are loaded as they are.
+ */
+static bool load(const std::string &path, const Toolchain &toolchain, Macro *macro, Clock::duration *parse, Clock::duration *compile) {
+	auto start = Clock::now();
+
+	if (hasSuffix(path, ".bin")) {
+		bool isLoaded = macro->loadCompiled(path);
+		*parse = Clock::duration::zero();
+		*compile = Clock::now() - start;
+
+		return isLoaded;
+	}
+
+	tinyxml2::XMLDocument xmlDoc;
+	xmlDoc.LoadFile(path.c_str());
+	*parse = Clock::now() - start;
+
+	if (xmlDoc.ErrorID()) {
+		std::cerr << "Can't parse " << path << std::endl;
+
+		return false;
+	}
+
+	start = Clock::now();
+	bool isCompiled = macro->compile(&xmlDoc, path, toolchain.optimizer, &toolchain.settings->text);
+	*compile = Clock::now() - start;
+
+	if (!isCompiled) {
+		std::cerr << "Can't compile " << path << std::endl;
+	}
+
+	return isCompiled;
+}
+
+/*
+ * Only programs, which the XML format can describe without control flow, are
+ * converted back. Loops and conditions are compiled to jumps, which can't be
+ * told apart reliably.
+ */
+static bool writeXml(const Macro &macro, const std::string &path, std::string *error) {
+	const std::vector<Instruction> &program = macro.getProgram();
+	tinyxml2::XMLDocument doc;
+	tinyxml2::XMLElement *root = doc.NewElement("Macro");
+	doc.InsertFirstChild(root);
+
+	for (std::size_t i = 0; i < program.size(); i++) {
+		const Instruction &instruction = program[i];
+		tinyxml2::XMLElement *element = nullptr;
+
+		switch (instruction.opcode) {
+			case Opcode::End:
+				if (i + 1 != program.size()) {
+					*error = "stops early";
+
+					return false;
+				}
+
+				break;
+			case Opcode::Key: {
+				bool isButton = instruction.arg >= BTN_MOUSE && instruction.arg <= BTN_TASK;
+				element = doc.NewElement(isButton ? "MouseButtonEvent" : "KeyBoardEvent");
+				element->SetAttribute("Down", instruction.value != 0);
+				element->SetText(instruction.arg);
+				break;
+			}
+			case Opcode::Rel:
+				if (instruction.arg == REL_X || instruction.arg == REL_Y) {
+					int x = 0, y = 0;
+					(instruction.arg == REL_X ? x : y) = instruction.value;
+
+					/* both axes of a frame make a single element */
+					if (instruction.arg == REL_X && instruction.reg && i + 1 < program.size()
+							&& program[i + 1].opcode == Opcode::Rel && program[i + 1].arg == REL_Y) {
+						y = program[++i].value;
+					}
+
+					element = doc.NewElement("MouseMoveEvent");
+					element->SetAttribute("X", x);
+					element->SetAttribute("Y", y);
+				} else if (instruction.arg == REL_WHEEL || instruction.arg == REL_HWHEEL) {
+					element = doc.NewElement("MouseWheelEvent");
+
+					if (instruction.arg == REL_HWHEEL) {
+						element->SetAttribute("Horizontal", true);
+					}
+
+					element->SetText(instruction.value);
+				} else {
+					*error = "moves an unsupported axis";
+
+					return false;
+				}
+
+				break;
+			case Opcode::Delay:
+				element = doc.NewElement("DelayEvent");
+
+				if (instruction.value % 1000) {
+					element->SetAttribute("Unit", "us");
+					element->SetText(instruction.value);
+				} else {
+					element->SetText(instruction.value / 1000);
+				}
+
+				break;
+			case Opcode::Set:
+			case Opcode::Add:
+				if (instruction.reg >= VM_USER_REGISTERS) {
+					*error = "uses loops";
+
+					return false;
+				}
+
+				element = doc.NewElement(instruction.opcode == Opcode::Set ? "Set" : "Add");
+				element->SetAttribute("Register", instruction.reg);
+				element->SetText(instruction.value);
+				break;
+			case Opcode::WaitRelease:
+				element = doc.NewElement("WaitRelease");
+				break;
+			case Opcode::Call:
+				element = doc.NewElement("Call");
+				element->SetAttribute("Key", instruction.arg);
+
+				if (instruction.reg) {
+					element->SetAttribute("Profile", instruction.reg);
+				}
+
+				break;
+			case Opcode::Rate:
+				/* rates are only set by the root element */
+				if (i) {
+					*error = "changes its rate";
+
+					return false;
+				}
+
+				root->SetAttribute("Rate", instruction.value);
+				root->SetAttribute("Burst", instruction.arg);
+				break;
+			case Opcode::Jump:
+			case Opcode::JumpIfZero:
+			case Opcode::JumpIfNotZero:
+			case Opcode::JumpUnlessProfile:
+				*error = "uses control flow";
+
+				return false;
+		}
+
+		if (element) {
+			root->InsertEndChild(element);
+		}
+	}
+
+	if (doc.SaveFile(path.c_str())) {
+		*error = "can't be written";
+
+		return false;
+	}
+
+	return true;
+}
+
+static void validate(Job *job, const Toolchain &toolchain) {
+	Macro macro;
+	Clock::duration parseTime, compileTime;
+	job->isOk = load(job->path, toolchain, &macro, &parseTime, &compileTime);
+}
+
+static void compile(Job *job, const Toolchain &toolchain) {
+	Macro macro;
+	Clock::duration parseTime, compileTime;
+	job->isOk = load(job->path, toolchain, &macro, &parseTime, &compileTime)
+		&& macro.save(replaceSuffix(job->path, ".bin"));
+}
+
+static void decompile(Job *job, const Toolchain &toolchain) {
+	std::string path = replaceSuffix(job->path, ".xml");
+	struct stat info;
+	std::string error;
+	Macro macro;
+
+	if (!toolchain.isForced && !stat(path.c_str(), &info)) {
+		std::cerr << "Not overwriting " << path << ", use --force." << std::endl;
+		job->isOk = false;
+
+		return;
+	}
+
+	job->isOk = macro.loadCompiled(job->path);
+
+	if (job->isOk && !writeXml(macro, path, &error)) {
+		std::cerr << "Can't convert " << job->path << ", it " << error << "." << std::endl;
+		job->isOk = false;
+	}
+}
+
+static void stats(Job *job, const Toolchain &toolchain) {
+	Macro macro;
+	Clock::duration parseTime, compileTime;
+	job->isOk = load(job->path, toolchain, &macro, &parseTime, &compileTime);
+
+	if (!job->isOk) {
+		return;
+	}
+
+	struct Estimate result = estimate(macro.getProgram(), getProfile(job->path));
+	std::ostringstream line;
+	line << job->path << "\t" << macro.size() << "\t" << result.events << "\t";
+
+	if (result.isEndless) {
+		line << "endless";
+	} else {
+		line << result.duration / 1000.0;
+	}
+
+	line << "\t" << std::chrono::duration_cast<std::chrono::microseconds>(parseTime).count()
+		<< "\t" << std::chrono::duration_cast<std::chrono::microseconds>(compileTime).count();
+	job->output = line.str();
+}
+
+/*
+ * Macros are packed without optimizations, the daemon optimizes them with its
+ * own settings. The XML file is packed along, so bundles can be unpacked again.
+ */
+static void pack(Job *job, const Toolchain &toolchain) {
+	BundleMacro &packed = job->macro;
+	job->isOk = true;
+
+	if (!parseLocation(job->path, &packed.profile, &packed.layer, &packed.key)) {
+		packed.key = 0;
+
+		return;
+	}
+
+	std::ifstream file(job->path, std::ios::binary);
+	std::ostringstream source;
+	source << file.rdbuf();
+	packed.source = source.str();
+	tinyxml2::XMLDocument xmlDoc;
+	xmlDoc.Parse(packed.source.c_str(), packed.source.size());
+	Macro macro;
+
+	if (!file || xmlDoc.ErrorID()) {
+		std::cerr << "Can't parse " << job->path << std::endl;
+		job->isOk = false;
+	} else if (!macro.compile(&xmlDoc, job->path, nullptr, &toolchain.settings->text)) {
+		std::cerr << "Can't compile " << job->path << std::endl;
+		job->isOk = false;
+	} else {
+		packed.program = macro.getProgram();
+		packed.keys = macro.getKeys();
+	}
+}
+
+static bool writeBundle(std::vector<Job> *jobs, const std::string &path) {
+	std::vector<BundleMacro> macros;
+	int profiles = 0, layers = 0;
+
+	for (auto &job : *jobs) {
+		if (job.macro.key) {
+			profiles = std::max(profiles, job.macro.profile + 1);
+			layers = std::max(layers, job.macro.layer + 1);
+			macros.push_back(std::move(job.macro));
+		}
+	}
+
+	if (macros.empty()) {
+		std::cerr << "No macros found." << std::endl;
+
+		return false;
+	}
+
+	return ProfileBundle::write(path, profiles, layers, macros);
+}
+
+/*
+ * Writes the XML files of a bundle to the profile directory layout.
+ */
+static bool unpack(const std::string &path, const std::string &dir, bool isForced) {
+	ProfileBundle bundle;
+	int count = 0;
+	bool isOk = true;
+
+	if (!bundle.open(path)) {
+		std::cerr << "Can't unpack " << path << std::endl;
+
+		return false;
+	}
+
+	for (int profile = 0; profile < bundle.getProfileCount(); profile++) {
+		for (int layer = 0; layer < bundle.getLayerCount(); layer++) {
+			for (int key = 1; key <= MAX_MACRO_KEYS; key++) {
+				std::string source = bundle.getSource(profile, layer, key);
+
+				if (source.empty()) {
+					continue;
+				}
+
+				std::string file = dir + "/profile_" + std::to_string(profile + 1);
+				mkdir(file.c_str(), S_IRWXU);
+
+				if (layer) {
+					file += "/layer_" + std::to_string(layer);
+					mkdir(file.c_str(), S_IRWXU);
+				}
+
+				file += std::string("/") + Key::getMacroName(key);
+				struct stat info;
+
+				if (!isForced && !stat(file.c_str(), &info)) {
+					std::cerr << "Not overwriting " << file << ", use --force." << std::endl;
+					isOk = false;
+					continue;
+				}
+
+				std::ofstream output(file, std::ios::binary);
+				output << source;
+
+				if (!output) {
+					std::cerr << "Can't write " << file << std::endl;
+					isOk = false;
+					continue;
+				}
+
+				count++;
+			}
+		}
+	}
+
+	std::cerr << count << " macros unpacked." << std::endl;
+
+	return isOk;
+}
+
+/*
+ * Workers take the next file from a shared index, so large files don't hold
+ * up a whole batch.
+ */
+static void runJobs(std::vector<Job> *jobs, int threads, void (*handle)(Job *, const Toolchain &), const Toolchain &toolchain) {
+	std::atomic<std::size_t> next(0);
+	std::vector<std::thread> workers;
+
+	auto work = [&] {
+		for (std::size_t i = next++; i < jobs->size(); i = next++) {
+			handle(&(*jobs)[i], toolchain);
+		}
+	};
+
+	for (int i = 1; i < threads; i++) {
+		workers.push_back(std::thread(work));
+	}
+
+	work();
+
+	for (auto &worker : workers) {
+		worker.join();
+	}
+}
+
+int main(int argc, char *argv[]) {
+	static struct option longOptions[] = {
+		{"config", required_argument, 0, 'c'},
+		{"force", no_argument, 0, 'f'},
+		{"jobs", required_argument, 0, 'j'},
+		{"help", no_argument, 0, 'h'},
+		{0, 0, 0, 0}
+	};
+
+	int opt, index = 0;
+	std::string configFilePath;
+	int threads = std::max(std::thread::hardware_concurrency(), 1U);
+	bool isForced = false;
+
+	while ((opt = getopt_long(argc, argv, ":c:fj:h", longOptions, &index)) != -1) {
+		switch (opt) {
+			case 'c':
+				configFilePath = optarg;
+				break;
+			case 'f':
+				isForced = true;
+				break;
+			case 'j':
+				threads = std::max(std::atoi(optarg), 1);
+				break;
+			case 'h':
+				help(argv[0]);
+				return EXIT_SUCCESS;
+			case ':':
+				std::cerr << "Missing argument." << std::endl;
+				return EXIT_FAILURE;
+			case '?':
+				std::cerr << "Unknown option." << std::endl;
+				return EXIT_FAILURE;
+			default:
+				std::cerr << "Unexpected error." << std::endl;
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind < 2) {
+		help(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	std::string command = argv[optind];
+	void (*handle)(Job *, const Toolchain &) = nullptr;
+	const char *suffix = ".xml";
+
+	if (command == "validate") {
+		handle = validate;
+	} else if (command == "compile") {
+		handle = compile;
+	} else if (command == "decompile") {
+		handle = decompile;
+		suffix = ".bin";
+	} else if (command == "stats") {
+		handle = stats;
+	} else if (command == "pack") {
+		handle = pack;
+	} else if (command == "unpack") {
+		return unpack(argv[optind + 1], argc - optind > 2 ? argv[optind + 2] : ".", isForced) ? EXIT_SUCCESS : EXIT_FAILURE;
+	} else {
+		std::cerr << "Unknown command " << command << "." << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	/* without a configuration file, macros are built with the defaults of the daemon */
+	Settings defaults;
+	SettingsStore settings;
+	const Settings *config = &defaults;
+
+	if (!configFilePath.empty()) {
+		if (!settings.load(configFilePath)) {
+			return EXIT_FAILURE;
+		}
+
+		config = settings.get();
+	}
+
+	std::vector<std::string> files;
+	int last = argc;
+	std::string bundlePath;
+
+	/* pack takes a single directory, followed by the bundle */
+	if (handle == pack) {
+		bundlePath = argc - optind > 2 ? argv[optind + 2] : std::string(argv[optind + 1]) + "/" + BUNDLE_FILE;
+		last = optind + 2;
+	}
+
+	for (int i = optind + 1; i < last; i++) {
+		collect(argv[i], suffix, true, &files);
+	}
+
+	std::vector<Job> jobs(files.size());
+
+	for (std::size_t i = 0; i < files.size(); i++) {
+		jobs[i].path = files[i];
+		jobs[i].isOk = false;
+	}
+
+	MacroOptimizer optimizer(config->optimizer);
+	struct Toolchain toolchain;
+	toolchain.settings = config;
+	toolchain.optimizer = &optimizer;
+	toolchain.isForced = isForced;
+	auto start = Clock::now();
+	runJobs(&jobs, threads, handle, toolchain);
+	auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+
+	if (handle == stats) {
+		std::cout << "file\tinstructions\tevents\tduration_ms\tparse_us\tcompile_us" << std::endl;
+	}
+
+	int failed = 0;
+
+	for (auto &job : jobs) {
+		if (!job.isOk) {
+			failed++;
+		} else if (!job.output.empty()) {
+			std::cout << job.output << std::endl;
+		}
+	}
+
+	std::cerr << jobs.size() << " macros, " << failed << " failed, " << elapsed << " ms." << std::endl;
+
+	/* a bundle is only written, if all of its macros compile */
+	if (handle == pack && (failed || !writeBundle(&jobs, bundlePath))) {
+		std::cerr << "Bundle " << bundlePath << " hasn't been written." << std::endl;
+
+		return EXIT_FAILURE;
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}